@@ -0,0 +1,286 @@
+#include "BinarySnapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    const char Magic[8] = { 'K', 'V', 'S', 'N', 'A', 'P', '\r', '\n' };
+    const uint32_t Version = 2;
+    // Version 1 had no expiration times; its header ends before them.
+    const uint32_t FirstVersion = 1;
+    const size_t FirstVersionHeaderSize = 56;
+    const size_t RecordHeaderSize = 2 * sizeof(uint32_t);
+
+    struct Header
+    {
+        char magic[sizeof(Magic)];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t recordCount;
+        uint64_t dataOffset;
+        uint64_t dataSize;
+        uint64_t indexOffset;
+        uint64_t bucketCount;
+        uint64_t expirationOffset;
+        uint64_t expirationCount;
+    };
+
+    struct Bucket
+    {
+        uint64_t hash;
+        uint64_t offset;
+    };
+
+    struct Expiration
+    {
+        uint64_t offset;
+        uint64_t expiresAt;
+    };
+
+    static_assert(sizeof(Header) == 72, "snapshot header must have no padding");
+    static_assert(sizeof(Bucket) == 16, "snapshot bucket must have no padding");
+    static_assert(sizeof(Expiration) == 16, "snapshot expiration must have no padding");
+
+    // FNV-1a; the index must not depend on the standard library's hash.
+    uint64_t SnapshotHash(std::string_view key)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (const char c: key)
+        {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Keeps the index at most half full.
+    uint64_t BucketCount(uint64_t recordCount)
+    {
+        uint64_t result = 1;
+        while (result < 2 * recordCount)
+        {
+            result *= 2;
+        }
+        return result;
+    }
+
+    uint32_t ReadUint32(const char* data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+}
+
+SnapshotWriter::SnapshotWriter(const std::string& path) :
+    path(path), file(path, std::ios::binary | std::ios::trunc), dataSize(0)
+{
+    if (!file)
+    {
+        throw std::runtime_error("Can't create snapshot " + path);
+    }
+
+    const Header header {};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+void SnapshotWriter::Add(std::string_view key, std::string_view value, uint64_t expiresAt)
+{
+    if (key.size() > UINT32_MAX || value.size() > UINT32_MAX)
+    {
+        throw std::runtime_error("Too long key or value for snapshot " + path);
+    }
+
+    const uint32_t lengths[] = { static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()) };
+    file.write(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+    file.write(key.data(), key.size());
+    file.write(value.data(), value.size());
+
+    records.emplace_back(SnapshotHash(key), dataSize);
+    if (expiresAt != 0)
+    {
+        expirations.emplace_back(dataSize, expiresAt);
+    }
+    dataSize += RecordHeaderSize + key.size() + value.size();
+}
+
+void SnapshotWriter::Finish()
+{
+    Header header {};
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.recordCount = records.size();
+    header.dataOffset = sizeof(Header);
+    header.dataSize = dataSize;
+    // Buckets start on an 8 byte boundary.
+    header.indexOffset = (header.dataOffset + dataSize + 7) / 8 * 8;
+    header.bucketCount = BucketCount(records.size());
+    header.expirationOffset = header.indexOffset + header.bucketCount * sizeof(Bucket);
+    header.expirationCount = expirations.size();
+
+    std::vector<Bucket> buckets(header.bucketCount);
+    const uint64_t mask = header.bucketCount - 1;
+    for (const auto& [hash, offset]: records)
+    {
+        uint64_t position = hash & mask;
+        while (buckets[position].offset != 0)
+        {
+            position = (position + 1) & mask;
+        }
+        buckets[position] = { hash, offset + 1 };
+    }
+
+    const char padding[8] = {};
+    file.write(padding, header.indexOffset - header.dataOffset - dataSize);
+    file.write(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(Bucket));
+    for (const auto& [offset, expiresAt]: expirations)
+    {
+        const Expiration expiration { offset, expiresAt };
+        file.write(reinterpret_cast<const char*>(&expiration), sizeof(expiration));
+    }
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.close();
+
+    if (!file)
+    {
+        throw std::runtime_error("Can't write snapshot " + path);
+    }
+}
+
+SnapshotReader::SnapshotReader(const std::string& path) :
+    path(path), file(path)
+{
+    const std::string_view mapping = file.Data();
+    Header header {};
+    if (mapping.size() < FirstVersionHeaderSize)
+    {
+        throw std::runtime_error("Corrupted snapshot " + path);
+    }
+    std::memcpy(&header, mapping.data(), std::min(mapping.size(), sizeof(header)));
+    if (header.version == FirstVersion)
+    {
+        header.expirationOffset = 0;
+        header.expirationCount = 0;
+    }
+
+    const size_t headerSize = header.version == FirstVersion ? FirstVersionHeaderSize : sizeof(Header);
+    const bool valid = std::memcmp(header.magic, Magic, sizeof(Magic)) == 0
+        && (header.version == Version || header.version == FirstVersion)
+        && header.dataOffset == headerSize
+        && header.dataOffset <= mapping.size()
+        && header.dataSize <= mapping.size() - header.dataOffset
+        && header.indexOffset >= header.dataOffset + header.dataSize
+        && header.bucketCount > 0 && (header.bucketCount & (header.bucketCount - 1)) == 0
+        && header.indexOffset <= mapping.size()
+        && header.bucketCount <= (mapping.size() - header.indexOffset) / sizeof(Bucket)
+        && header.recordCount < header.bucketCount
+        && header.expirationCount <= header.recordCount
+        && header.expirationOffset <= mapping.size()
+        && header.expirationCount <= (mapping.size() - header.expirationOffset) / sizeof(Expiration);
+    if (!valid)
+    {
+        throw std::runtime_error("Corrupted snapshot " + path);
+    }
+
+    recordCount = header.recordCount;
+    data = mapping.data() + header.dataOffset;
+    dataSize = header.dataSize;
+    index = mapping.data() + header.indexOffset;
+    bucketCount = header.bucketCount;
+    expirations = mapping.data() + header.expirationOffset;
+    expirationCount = header.expirationCount;
+}
+
+bool SnapshotReader::IsSnapshot(const std::string& path)
+{
+    char magic[sizeof(Magic)] = {};
+    std::ifstream file(path, std::ios::binary);
+    file.read(magic, sizeof(magic));
+    return file && std::memcmp(magic, Magic, sizeof(Magic)) == 0;
+}
+
+std::pair<std::string_view, std::string_view> SnapshotReader::RecordAt(uint64_t offset, uint64_t& next) const
+{
+    if (offset > dataSize || dataSize - offset < RecordHeaderSize)
+    {
+        throw std::runtime_error("Corrupted snapshot " + path);
+    }
+
+    const uint64_t keyLength = ReadUint32(data + offset);
+    const uint64_t valueLength = ReadUint32(data + offset + sizeof(uint32_t));
+    if (dataSize - offset - RecordHeaderSize < keyLength + valueLength)
+    {
+        throw std::runtime_error("Corrupted snapshot " + path);
+    }
+
+    const char* key = data + offset + RecordHeaderSize;
+    next = offset + RecordHeaderSize + keyLength + valueLength;
+    return { std::string_view(key, keyLength), std::string_view(key + keyLength, valueLength) };
+}
+
+std::optional<std::string_view> SnapshotReader::Find(std::string_view key) const
+{
+    const uint64_t hash = SnapshotHash(key);
+    const uint64_t mask = bucketCount - 1;
+
+    for (uint64_t position = hash & mask, probes = 0; probes < bucketCount; position = (position + 1) & mask, ++probes)
+    {
+        Bucket bucket;
+        std::memcpy(&bucket, index + position * sizeof(Bucket), sizeof(bucket));
+        if (bucket.offset == 0)
+        {
+            break;
+        }
+        if (bucket.hash != hash)
+        {
+            continue;
+        }
+
+        uint64_t next;
+        const auto [storedKey, value] = RecordAt(bucket.offset - 1, next);
+        if (storedKey == key)
+        {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+void SnapshotReader::ForEach(const Visitor& visitor) const
+{
+    file.AdviseSequential();
+
+    // Expirations are sorted by offset like the records they belong to.
+    uint64_t offset = 0;
+    uint64_t nextExpiration = 0;
+    for (uint64_t i = 0; i < recordCount; ++i)
+    {
+        Expiration expiration {};
+        if (nextExpiration < expirationCount)
+        {
+            std::memcpy(&expiration, expirations + nextExpiration * sizeof(Expiration), sizeof(expiration));
+            if (expiration.offset < offset)
+            {
+                throw std::runtime_error("Corrupted snapshot " + path);
+            }
+        }
+
+        const uint64_t recordOffset = offset;
+        const auto [key, value] = RecordAt(offset, offset);
+        if (nextExpiration < expirationCount && expiration.offset == recordOffset)
+        {
+            visitor(key, value, expiration.expiresAt);
+            ++nextExpiration;
+        }
+        else
+        {
+            visitor(key, value, 0);
+        }
+    }
+    if (nextExpiration != expirationCount)
+    {
+        throw std::runtime_error("Corrupted snapshot " + path);
+    }
+}
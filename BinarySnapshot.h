@@ -0,0 +1,84 @@
+#pragma once
+
+#include "MappedFile.h"
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Binary snapshot of the storage, read through mmap so that loading it needs
+// no parsing and no memory beyond the page cache.
+//
+// The file is, in host byte order:
+//     header  [magic: 8 bytes][version: u32][reserved: u32][record count: u64]
+//             [data offset: u64][data size: u64][index offset: u64][bucket count: u64]
+//             [expiration offset: u64][expiration count: u64]
+//     data    records [key length: u32][value length: u32][key][value], packed
+//     index   bucket count (a power of two) buckets [hash: u64][record offset + 1: u64],
+//             open addressing with linear probing; an offset of 0 is an empty bucket
+//     expirations  [record offset: u64][expiration time: u64] for every key
+//             that expires, in record order
+// Record offsets are relative to the start of the data. The index is written
+// after the data so that a snapshot can be written in a single pass. Version
+// 1 files have no expiration fields in the header and no expirations.
+class SnapshotWriter
+{
+public:
+    // Writes to 'path', replacing it; nothing is valid until Finish().
+    explicit SnapshotWriter(const std::string& path);
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Keys must be unique. 'expiresAt' is 0 for a key that never expires.
+    void Add(std::string_view key, std::string_view value, uint64_t expiresAt = 0);
+    void Finish();
+private:
+    const std::string path;
+    std::ofstream file;
+    uint64_t dataSize;
+    // Hash and offset of every record.
+    std::vector<std::pair<uint64_t, uint64_t>> records;
+    // Offset and expiration time of the records that expire.
+    std::vector<std::pair<uint64_t, uint64_t>> expirations;
+};
+
+class SnapshotReader
+{
+public:
+    using Visitor = std::function<void(std::string_view key, std::string_view value, uint64_t expiresAt)>;
+
+    explicit SnapshotReader(const std::string& path);
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    // Whether the file at 'path' starts like a snapshot.
+    static bool IsSnapshot(const std::string& path);
+
+    size_t Size() const { return recordCount; }
+    // Looks the key up in the index; the value points into the mapping.
+    std::optional<std::string_view> Find(std::string_view key) const;
+    // Visits the records in file order; 'expiresAt' is 0 for a key that
+    // never expires.
+    void ForEach(const Visitor& visitor) const;
+private:
+    const std::string path;
+    const MappedFile file;
+
+    uint64_t recordCount;
+    const char* data;
+    uint64_t dataSize;
+    const char* index;
+    uint64_t bucketCount;
+    const char* expirations;
+    uint64_t expirationCount;
+
+    // Record at 'offset' of the data, checked to lie within it.
+    std::pair<std::string_view, std::string_view> RecordAt(uint64_t offset, uint64_t& next) const;
+};
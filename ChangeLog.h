@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Receives every change a StorageEngine makes, see StorageEngine::SetLog().
+class ChangeLog
+{
+public:
+    virtual ~ChangeLog() = default;
+
+    // 'expiresAt' is 0 for a key that never expires.
+    virtual void Append(std::string_view key, std::string_view value, uint64_t expiresAt) = 0;
+    // The pairs are applied atomically and never expire.
+    virtual void AppendBatch(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues) = 0;
+};
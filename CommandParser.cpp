@@ -0,0 +1,235 @@
+#include "CommandParser.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    const char CommandEol = '\n';
+    const char KeyValueDelimiter = '=';
+
+    // Indexed by CommandId.
+    constexpr std::string_view CommandNames[] = { "", "$get", "$set", "$proto", "$mget", "$mset", "$stats", "$memory",
+                                                  "$expire" };
+    constexpr size_t CommandCount = std::size(CommandNames);
+    static_assert(CommandCount == CommandIdCount, "every command needs a name");
+
+    constexpr size_t HashTableSize = 16;
+    static_assert((HashTableSize & (HashTableSize - 1)) == 0, "table size must be a power of two");
+    static_assert(HashTableSize >= CommandCount, "table is too small");
+
+    constexpr uint32_t CommandHash(std::string_view name, uint32_t seed)
+    {
+        // FNV-1a, seeded.
+        uint32_t hash = 2166136261u ^ seed;
+        for (char c: name)
+        {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return hash & (HashTableSize - 1);
+    }
+
+    constexpr bool IsPerfect(uint32_t seed)
+    {
+        bool used[HashTableSize] {};
+        for (size_t id = 1; id < CommandCount; ++id)
+        {
+            const uint32_t slot = CommandHash(CommandNames[id], seed);
+            if (used[slot])
+            {
+                return false;
+            }
+            used[slot] = true;
+        }
+        return true;
+    }
+
+    constexpr uint32_t FindSeed()
+    {
+        uint32_t seed = 0;
+        while (!IsPerfect(seed))
+        {
+            ++seed;
+        }
+        return seed;
+    }
+
+    constexpr uint32_t CommandSeed = FindSeed();
+
+    constexpr std::array<uint8_t, HashTableSize> BuildCommandTable()
+    {
+        std::array<uint8_t, HashTableSize> table {};
+        for (size_t id = 1; id < CommandCount; ++id)
+        {
+            table[CommandHash(CommandNames[id], CommandSeed)] = static_cast<uint8_t>(id);
+        }
+        return table;
+    }
+
+    constexpr std::array<uint8_t, HashTableSize> CommandTable = BuildCommandTable();
+
+    constexpr CommandId LookupCommand(std::string_view name)
+    {
+        const uint8_t id = CommandTable[CommandHash(name, CommandSeed)];
+        return CommandNames[id] == name ? static_cast<CommandId>(id) : CommandId::Unknown;
+    }
+
+    static_assert(LookupCommand("$get") == CommandId::Get);
+    static_assert(LookupCommand("$set") == CommandId::Set);
+    static_assert(LookupCommand("$proto") == CommandId::Proto);
+    static_assert(LookupCommand("$mget") == CommandId::MGet);
+    static_assert(LookupCommand("$mset") == CommandId::MSet);
+    static_assert(LookupCommand("$stats") == CommandId::Stats);
+    static_assert(LookupCommand("$memory") == CommandId::Memory);
+    static_assert(LookupCommand("$expire") == CommandId::Expire);
+    static_assert(LookupCommand("$gets") == CommandId::Unknown);
+
+    bool IsDelimiter(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    // Position of the first token delimiter in [begin, end) or 'end'.
+    const char* FindDelimiter(const char* begin, const char* end)
+    {
+#if defined(__SSE2__)
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i lineFeed = _mm_set1_epi8('\n');
+        const __m128i carriageReturn = _mm_set1_epi8('\r');
+
+        for (; end - begin >= 16; begin += 16)
+        {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+            const __m128i matches =
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                             _mm_or_si128(_mm_cmpeq_epi8(chunk, lineFeed),
+                                          _mm_cmpeq_epi8(chunk, carriageReturn)));
+            const int mask = _mm_movemask_epi8(matches);
+            if (mask != 0)
+            {
+                return begin + __builtin_ctz(mask);
+            }
+        }
+#endif
+        for (; begin != end; ++begin)
+        {
+            if (IsDelimiter(*begin))
+            {
+                return begin;
+            }
+        }
+        return end;
+    }
+}
+
+std::string_view CommandName(CommandId id)
+{
+    return CommandNames[static_cast<size_t>(id)];
+}
+
+bool NextLine(std::string_view& input, std::string_view& line)
+{
+    if (input.empty())
+    {
+        return false;
+    }
+
+    const void* eol = std::memchr(input.data(), CommandEol, input.size());
+    if (!eol)
+    {
+        return false;
+    }
+
+    const size_t length = static_cast<const char*>(eol) - input.data();
+    line = input.substr(0, length);
+    input.remove_prefix(length + 1);
+    return true;
+}
+
+std::string_view TrimRight(std::string_view line)
+{
+    while (!line.empty() && IsSpace(line.back()))
+    {
+        line.remove_suffix(1);
+    }
+    return line;
+}
+
+ParsedCommand ParseCommand(std::string_view line)
+{
+    ParsedCommand result { CommandId::Unknown, line, std::string_view(), 0, std::string_view() };
+
+    const char* end = line.data() + line.size();
+    const char* nameEnd = FindDelimiter(line.data(), end);
+    result.name = std::string_view(line.data(), nameEnd - line.data());
+    result.id = LookupCommand(result.name);
+
+    if (nameEnd == end)
+    {
+        return result;
+    }
+
+    const char* argumentBegin = nameEnd + 1;
+    result.arguments = std::string_view(argumentBegin, end - argumentBegin);
+    const char* argumentEnd = FindDelimiter(argumentBegin, end);
+    result.argument = std::string_view(argumentBegin, argumentEnd - argumentBegin);
+    result.argumentCount = 1;
+
+    for (const char* it = argumentEnd; it != end; it = FindDelimiter(it + 1, end))
+    {
+        ++result.argumentCount;
+    }
+
+    return result;
+}
+
+bool NextArgument(std::string_view& arguments, std::string_view& argument)
+{
+    const char* end = arguments.data() + arguments.size();
+    const char* begin = arguments.data();
+
+    while (begin != end)
+    {
+        const char* tokenEnd = FindDelimiter(begin, end);
+        if (tokenEnd != begin)
+        {
+            argument = std::string_view(begin, tokenEnd - begin);
+            arguments = std::string_view(tokenEnd, end - tokenEnd);
+            return true;
+        }
+        ++begin;
+    }
+
+    arguments = std::string_view();
+    return false;
+}
+
+bool SplitKeyValue(std::string_view argument, std::string_view& key, std::string_view& value)
+{
+    const void* found = std::memchr(argument.data(), KeyValueDelimiter, argument.size());
+    if (!found)
+    {
+        return false;
+    }
+
+    const size_t keyLength = static_cast<const char*>(found) - argument.data();
+    value = argument.substr(keyLength + 1);
+    if (std::memchr(value.data(), KeyValueDelimiter, value.size()))
+    {
+        return false;
+    }
+
+    key = argument.substr(0, keyLength);
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+// Zero-copy parsing of the text protocol. All views point into the buffer
+// the line was received in.
+
+enum class CommandId
+{
+    Unknown,
+    Get,
+    Set,
+    Proto,
+    MGet,
+    MSet,
+    Stats,
+    Memory,
+    Expire
+};
+
+// Number of CommandId values, Unknown included.
+constexpr size_t CommandIdCount = static_cast<size_t>(CommandId::Expire) + 1;
+
+struct ParsedCommand
+{
+    CommandId id;
+    std::string_view name;
+    // The first token after the name.
+    std::string_view argument;
+    // Number of tokens after the name, including empty ones.
+    size_t argumentCount;
+    // Everything after the name and its delimiter.
+    std::string_view arguments;
+};
+
+// "$get" for CommandId::Get; empty for CommandId::Unknown.
+std::string_view CommandName(CommandId id);
+
+// Takes the next '\n' terminated line (without the terminator) from the
+// front of 'input'. Returns false if there is no complete line.
+bool NextLine(std::string_view& input, std::string_view& line);
+
+// Drops trailing whitespace the way boost::trim_right does.
+std::string_view TrimRight(std::string_view line);
+
+// Splits a line on every space, tab or carriage return like
+// boost::split(..., boost::is_any_of(" \t\n\r")) does.
+ParsedCommand ParseCommand(std::string_view line);
+
+// Takes the next non-empty token from the front of 'arguments'. Returns
+// false if there are no more tokens.
+bool NextArgument(std::string_view& arguments, std::string_view& argument);
+
+// Splits "key=value". Returns false unless there is exactly one '='.
+bool SplitKeyValue(std::string_view argument, std::string_view& key, std::string_view& value);
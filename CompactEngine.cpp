@@ -0,0 +1,173 @@
+#include "CompactEngine.h"
+
+#include <mutex>
+
+CompactEngine::CompactEngine(size_t shardCount) :
+    StorageEngine(shardCount), shards(new Shard[shardCount])
+{
+}
+
+CompactEngine::Shard& CompactEngine::GetShard(size_t hash) const
+{
+    return shards[ShardIndex(hash, shardCount)];
+}
+
+ReadStatus CompactEngine::Read(std::string_view key, std::string& value, uint64_t now) const
+{
+    const size_t hash = PersistentMap::Hash(key);
+    const Shard& shard = GetShard(hash);
+
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    std::string_view stored;
+    uint64_t expiresAt = 0;
+    if (!shard.keysValues.Find(key, hash, stored, expiresAt))
+    {
+        return ReadStatus::Missing;
+    }
+    if (IsExpired(expiresAt, now))
+    {
+        return ReadStatus::Expired;
+    }
+    value.assign(stored);
+    return ReadStatus::Found;
+}
+
+std::vector<std::optional<std::string>> CompactEngine::ReadMany(const std::vector<std::string_view>& keys,
+                                                                uint64_t now) const
+{
+    std::vector<size_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        hashes[i] = PersistentMap::Hash(keys[i]);
+    }
+
+    const std::vector<size_t> shardIndexes = ShardIndexes(hashes, shardCount);
+    std::vector<std::shared_lock<std::shared_mutex>> locks;
+    locks.reserve(shardIndexes.size());
+    for (size_t index: shardIndexes)
+    {
+        locks.emplace_back(shards[index].mutex);
+    }
+
+    std::vector<std::optional<std::string>> result(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        std::string_view stored;
+        uint64_t expiresAt = 0;
+        if (GetShard(hashes[i]).keysValues.Find(keys[i], hashes[i], stored, expiresAt)
+            && !IsExpired(expiresAt, now))
+        {
+            result[i] = std::string(stored);
+        }
+    }
+    return result;
+}
+
+void CompactEngine::Write(std::string_view key, std::string_view value, uint64_t expiresAt)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    shard.keysValues.Set(key, value, hash, expiresAt);
+    if (changeLog)
+    {
+        changeLog->Append(key, value, expiresAt);
+    }
+    Evict(shard.keysValues, shard.clockHand);
+}
+
+void CompactEngine::WriteMany(const std::vector<KeyValue>& keysValues)
+{
+    std::vector<size_t> hashes(keysValues.size());
+    for (size_t i = 0; i < keysValues.size(); ++i)
+    {
+        hashes[i] = PersistentMap::Hash(keysValues[i].first);
+    }
+
+    const std::vector<size_t> shardIndexes = ShardIndexes(hashes, shardCount);
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    locks.reserve(shardIndexes.size());
+    for (size_t index: shardIndexes)
+    {
+        locks.emplace_back(shards[index].mutex);
+    }
+
+    for (size_t i = 0; i < keysValues.size(); ++i)
+    {
+        GetShard(hashes[i]).keysValues.Set(keysValues[i].first, keysValues[i].second, hashes[i]);
+    }
+    if (changeLog)
+    {
+        changeLog->AppendBatch(keysValues);
+    }
+    for (size_t index: shardIndexes)
+    {
+        Evict(shards[index].keysValues, shards[index].clockHand);
+    }
+}
+
+bool CompactEngine::Expire(std::string_view key, uint64_t expiresAt, uint64_t now)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    std::string_view stored;
+    uint64_t oldExpiresAt = 0;
+    if (!shard.keysValues.Find(key, hash, stored, oldExpiresAt) || IsExpired(oldExpiresAt, now))
+    {
+        return false;
+    }
+
+    // Set() may move the record the value points to.
+    const std::string value(stored);
+    shard.keysValues.Set(key, value, hash, expiresAt);
+    if (changeLog)
+    {
+        changeLog->Append(key, value, expiresAt);
+    }
+    return true;
+}
+
+bool CompactEngine::EraseExpired(std::string_view key, uint64_t now)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    std::string_view stored;
+    uint64_t expiresAt = 0;
+    if (!shard.keysValues.Find(key, hash, stored, expiresAt) || !IsExpired(expiresAt, now))
+    {
+        return false;
+    }
+    return shard.keysValues.Erase(key, hash);
+}
+
+void CompactEngine::ForEach(const PersistentMap::Visitor& visitor) const
+{
+    // A shard is copied under its read lock and visited without it, one shard
+    // at a time, so only one shard is held twice in memory.
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        const Shard& shard = shards[i];
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        const CompactMap copy(shard.keysValues);
+        lock.unlock();
+
+        copy.ForEach(visitor);
+    }
+}
+
+MemoryUsage CompactEngine::Memory() const
+{
+    MemoryUsage result;
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        const Shard& shard = shards[i];
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        result += shard.keysValues.Memory();
+    }
+    return result;
+}
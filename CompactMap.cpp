@@ -0,0 +1,461 @@
+#include "CompactMap.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    const size_t InitialCapacity = 16;
+    // The table is rehashed when live and tombstone slots fill 4/5 of it.
+    const size_t MaxLoadNumerator = 4;
+    const size_t MaxLoadDenominator = 5;
+
+    // Blocks grow with the arena, by a quarter of its size.
+    const size_t MinBlockSize = 4 * 1024;
+    const size_t MaxBlockSize = 1024 * 1024;
+    // Records bigger than this get a block of their own.
+    const size_t MaxSharedRecordSize = MaxBlockSize / 4;
+    // Dead records are left alone until they take this much.
+    const size_t MinCompactionBytes = 64 * 1024;
+
+    const uint64_t EmptySlot = 0;
+    const uint64_t TombstoneSlot = 1;
+
+    // Slot layout: [16 bits of hash][24 bits of block index + 1][24 bits of offset].
+    const unsigned TagShift = 48;
+    const unsigned BlockShift = 24;
+    const uint64_t FieldMask = (uint64_t(1) << 24) - 1;
+    const size_t MaxBlockCount = FieldMask - 1;
+
+    uint64_t Tag(size_t hash)
+    {
+        return static_cast<uint64_t>(hash) >> TagShift;
+    }
+
+    uint64_t Pack(size_t block, size_t offset, size_t hash)
+    {
+        return (Tag(hash) << TagShift) | (uint64_t(block + 1) << BlockShift) | offset;
+    }
+
+    size_t SlotBlock(uint64_t slot)
+    {
+        return ((slot >> BlockShift) & FieldMask) - 1;
+    }
+
+    size_t SlotOffset(uint64_t slot)
+    {
+        return slot & FieldMask;
+    }
+
+    bool IsLive(uint64_t slot)
+    {
+        return slot != EmptySlot && slot != TombstoneSlot;
+    }
+
+    size_t VarintSize(uint64_t value)
+    {
+        size_t size = 1;
+        for (; value >= 0x80; value >>= 7)
+        {
+            ++size;
+        }
+        return size;
+    }
+
+    char* WriteVarint(char* destination, uint64_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+        {
+            *destination++ = static_cast<char>(value | 0x80);
+        }
+        *destination++ = static_cast<char>(value);
+        return destination;
+    }
+
+    uint64_t ReadVarint(const char*& source)
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; ; shift += 7)
+        {
+            const unsigned char byte = static_cast<unsigned char>(*source++);
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+            {
+                return value;
+            }
+        }
+    }
+
+    std::unique_ptr<std::atomic<uint8_t>[]> MakeReferenced(size_t capacity)
+    {
+        return std::unique_ptr<std::atomic<uint8_t>[]>(new std::atomic<uint8_t>[capacity]());
+    }
+
+    size_t RecordSize(std::string_view key, std::string_view value, uint64_t expiresAt)
+    {
+        return VarintSize(key.size()) + VarintSize(value.size()) + VarintSize(expiresAt) + key.size()
+            + value.size();
+    }
+}
+
+CompactMap::CompactMap() :
+    slots(InitialCapacity, EmptySlot), referenced(MakeReferenced(InitialCapacity)), size(0), tombstones(0),
+    currentBlock(NoBlock), blockUsed(0), arenaBytes(0), usedBytes(0), liveBytes(0), livePayloadBytes(0)
+{
+}
+
+CompactMap::CompactMap(const CompactMap& other) :
+    slots(other.slots), referenced(MakeReferenced(other.slots.size())), size(other.size),
+    tombstones(other.tombstones), currentBlock(other.currentBlock), blockUsed(other.blockUsed),
+    arenaBytes(other.arenaBytes), usedBytes(other.usedBytes), liveBytes(other.liveBytes),
+    livePayloadBytes(other.livePayloadBytes)
+{
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        referenced[i].store(other.referenced[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    blocks.reserve(other.blocks.size());
+    for (size_t i = 0; i < other.blocks.size(); ++i)
+    {
+        const Block& block = other.blocks[i];
+        blocks.push_back(Block { std::make_unique<char[]>(block.size), block.size });
+        std::memcpy(blocks.back().data.get(), block.data.get(), i == currentBlock ? blockUsed : block.size);
+    }
+}
+
+char* CompactMap::RecordData(uint64_t slot) const
+{
+    return blocks[SlotBlock(slot)].data.get() + SlotOffset(slot);
+}
+
+CompactMap::Record CompactMap::Load(uint64_t slot) const
+{
+    const char* data = RecordData(slot);
+    const char* begin = data;
+
+    const size_t keySize = ReadVarint(data);
+    const size_t valueSize = ReadVarint(data);
+
+    Record result;
+    result.expiresAt = ReadVarint(data);
+    result.key = std::string_view(data, keySize);
+    result.value = std::string_view(data + keySize, valueSize);
+    result.size = data + keySize + valueSize - begin;
+    return result;
+}
+
+size_t CompactMap::Probe(std::string_view key, size_t hash, size_t& reusable) const
+{
+    const size_t mask = slots.size() - 1;
+    const uint64_t tag = Tag(hash);
+    reusable = NoSlot;
+
+    for (size_t index = hash & mask; ; index = (index + 1) & mask)
+    {
+        const uint64_t slot = slots[index];
+        if (slot == EmptySlot)
+        {
+            return index;
+        }
+        if (slot == TombstoneSlot)
+        {
+            if (reusable == NoSlot)
+            {
+                reusable = index;
+            }
+        }
+        else if (slot >> TagShift == tag && Load(slot).key == key)
+        {
+            return index;
+        }
+    }
+}
+
+bool CompactMap::Find(std::string_view key, size_t hash, std::string_view& value, uint64_t& expiresAt) const
+{
+    size_t reusable;
+    const size_t index = Probe(key, hash, reusable);
+    const uint64_t slot = slots[index];
+    if (slot == EmptySlot)
+    {
+        return false;
+    }
+    // Readers don't write the cache line once the byte is set.
+    if (!referenced[index].load(std::memory_order_relaxed))
+    {
+        referenced[index].store(1, std::memory_order_relaxed);
+    }
+    const Record record = Load(slot);
+    value = record.value;
+    expiresAt = record.expiresAt;
+    return true;
+}
+
+void CompactMap::AddBlock(size_t blockSize)
+{
+    if (blocks.size() >= MaxBlockCount)
+    {
+        throw std::length_error("CompactMap: too many arena blocks");
+    }
+    blocks.push_back(Block { std::make_unique<char[]>(blockSize), blockSize });
+    arenaBytes += blockSize;
+}
+
+char* CompactMap::Allocate(size_t recordSize, size_t& block, size_t& offset)
+{
+    usedBytes += recordSize;
+
+    if (recordSize > MaxSharedRecordSize)
+    {
+        AddBlock(recordSize);
+        block = blocks.size() - 1;
+        offset = 0;
+        return blocks.back().data.get();
+    }
+
+    if (currentBlock == NoBlock || blockUsed + recordSize > blocks[currentBlock].size)
+    {
+        // The unused tail of the previous block stays free.
+        AddBlock(std::clamp(arenaBytes / 4, MinBlockSize, MaxBlockSize));
+        currentBlock = blocks.size() - 1;
+        blockUsed = 0;
+    }
+
+    block = currentBlock;
+    offset = blockUsed;
+    blockUsed += recordSize;
+    return blocks[block].data.get() + offset;
+}
+
+uint64_t CompactMap::Append(std::string_view key, std::string_view value, uint64_t expiresAt, size_t hash)
+{
+    const size_t recordSize = RecordSize(key, value, expiresAt);
+    size_t block;
+    size_t offset;
+    char* data = Allocate(recordSize, block, offset);
+
+    data = WriteVarint(data, key.size());
+    data = WriteVarint(data, value.size());
+    data = WriteVarint(data, expiresAt);
+    std::memcpy(data, key.data(), key.size());
+    std::memcpy(data + key.size(), value.data(), value.size());
+
+    liveBytes += recordSize;
+    livePayloadBytes += key.size() + value.size();
+    return Pack(block, offset, hash);
+}
+
+void CompactMap::Set(std::string_view key, std::string_view value, size_t hash, uint64_t expiresAt)
+{
+    size_t reusable;
+    const size_t index = Probe(key, hash, reusable);
+    const uint64_t slot = slots[index];
+
+    if (slot != EmptySlot)
+    {
+        const Record record = Load(slot);
+        if (record.value.size() == value.size() && VarintSize(record.expiresAt) == VarintSize(expiresAt))
+        {
+            // Every field keeps its place. The value may be a view of this
+            // very record.
+            char* data = RecordData(slot);
+            data = WriteVarint(data, key.size());
+            data = WriteVarint(data, value.size());
+            WriteVarint(data, expiresAt);
+            std::memmove(const_cast<char*>(record.value.data()), value.data(), value.size());
+            referenced[index].store(1, std::memory_order_relaxed);
+            return;
+        }
+
+        liveBytes -= record.size;
+        livePayloadBytes -= record.key.size() + record.value.size();
+        slots[index] = Append(key, value, expiresAt, hash);
+        referenced[index].store(1, std::memory_order_relaxed);
+    }
+    else if (reusable != NoSlot)
+    {
+        slots[reusable] = Append(key, value, expiresAt, hash);
+        referenced[reusable].store(1, std::memory_order_relaxed);
+        --tombstones;
+        ++size;
+    }
+    else
+    {
+        slots[index] = Append(key, value, expiresAt, hash);
+        referenced[index].store(1, std::memory_order_relaxed);
+        ++size;
+    }
+
+    Maintain();
+}
+
+bool CompactMap::Erase(std::string_view key, size_t hash)
+{
+    size_t reusable;
+    const size_t index = Probe(key, hash, reusable);
+    const uint64_t slot = slots[index];
+    if (slot == EmptySlot)
+    {
+        return false;
+    }
+
+    const Record record = Load(slot);
+    liveBytes -= record.size;
+    livePayloadBytes -= record.key.size() + record.value.size();
+
+    // A slot followed by an empty one ends no other probe sequence.
+    if (slots[(index + 1) & (slots.size() - 1)] == EmptySlot)
+    {
+        slots[index] = EmptySlot;
+    }
+    else
+    {
+        slots[index] = TombstoneSlot;
+        ++tombstones;
+    }
+    --size;
+
+    Maintain();
+    return true;
+}
+
+void CompactMap::Maintain()
+{
+    const size_t capacity = slots.size();
+    if ((size + tombstones) * MaxLoadDenominator >= capacity * MaxLoadNumerator)
+    {
+        // Only tombstones are dropped if the live slots fit well as they are.
+        Rehash(size * MaxLoadDenominator * 2 >= capacity * MaxLoadNumerator ? capacity * 2 : capacity);
+    }
+
+    const size_t deadBytes = usedBytes - liveBytes;
+    if (deadBytes >= MinCompactionBytes && deadBytes * 3 >= usedBytes)
+    {
+        CompactArena();
+    }
+}
+
+void CompactMap::Rehash(size_t capacity)
+{
+    std::vector<uint64_t> rehashed(capacity, EmptySlot);
+    std::unique_ptr<std::atomic<uint8_t>[]> rehashedReferenced = MakeReferenced(capacity);
+    const size_t mask = capacity - 1;
+
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        const uint64_t slot = slots[i];
+        if (!IsLive(slot))
+        {
+            continue;
+        }
+
+        size_t index = PersistentMap::Hash(Load(slot).key) & mask;
+        while (rehashed[index] != EmptySlot)
+        {
+            index = (index + 1) & mask;
+        }
+        rehashed[index] = slot;
+        rehashedReferenced[index].store(referenced[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    slots = std::move(rehashed);
+    referenced = std::move(rehashedReferenced);
+    tombstones = 0;
+}
+
+void CompactMap::CompactArena()
+{
+    // Live records are copied in table order into a fresh arena.
+    const std::vector<Block> oldBlocks = std::move(blocks);
+    blocks.clear();
+    currentBlock = NoBlock;
+    blockUsed = 0;
+    arenaBytes = 0;
+    usedBytes = 0;
+
+    if (liveBytes > 0)
+    {
+        AddBlock(std::clamp(liveBytes, MinBlockSize, MaxBlockSize));
+        currentBlock = 0;
+    }
+
+    for (uint64_t& slot: slots)
+    {
+        if (!IsLive(slot))
+        {
+            continue;
+        }
+
+        const char* data = oldBlocks[SlotBlock(slot)].data.get() + SlotOffset(slot);
+        const char* payload = data;
+        const size_t keySize = ReadVarint(payload);
+        const size_t valueSize = ReadVarint(payload);
+        ReadVarint(payload);
+        const size_t recordSize = payload + keySize + valueSize - data;
+
+        size_t block;
+        size_t offset;
+        std::memcpy(Allocate(recordSize, block, offset), data, recordSize);
+        slot = (slot & ~((uint64_t(1) << TagShift) - 1)) | (uint64_t(block + 1) << BlockShift) | offset;
+    }
+}
+
+void CompactMap::ForEach(const PersistentMap::Visitor& visitor) const
+{
+    std::string key;
+    std::string value;
+    for (uint64_t slot: slots)
+    {
+        if (IsLive(slot))
+        {
+            const Record record = Load(slot);
+            key.assign(record.key);
+            value.assign(record.value);
+            visitor(key, value, record.expiresAt);
+        }
+    }
+}
+
+size_t CompactMap::Bytes() const
+{
+    return liveBytes + slots.size() * (sizeof(uint64_t) + sizeof(uint8_t));
+}
+
+void CompactMap::Sweep(size_t& hand, size_t victimCount, std::vector<std::string>& victims) const
+{
+    // Every slot is passed at most twice: once to clear its byte and once to
+    // take its key.
+    const size_t stop = victims.size() + victimCount;
+    for (size_t step = 0; step < 2 * slots.size() && victims.size() < stop; ++step)
+    {
+        const size_t index = hand++ & (slots.size() - 1);
+        if (!IsLive(slots[index]))
+        {
+            continue;
+        }
+        if (referenced[index].load(std::memory_order_relaxed))
+        {
+            referenced[index].store(0, std::memory_order_relaxed);
+        }
+        else
+        {
+            victims.emplace_back(Load(slots[index]).key);
+        }
+    }
+}
+
+MemoryUsage CompactMap::Memory() const
+{
+    MemoryUsage result;
+    result.keyCount = size;
+    result.payloadBytes = livePayloadBytes;
+    result.entryOverheadBytes = liveBytes - livePayloadBytes;
+    result.indexBytes = slots.capacity() * (sizeof(uint64_t) + sizeof(uint8_t)) + blocks.capacity() * sizeof(Block);
+    result.deadBytes = usedBytes - liveBytes;
+    result.freeBytes = arenaBytes - usedBytes;
+    return result;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "MemoryUsage.h"
+#include "PersistentMap.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Hash map from string keys to string values with a few bytes of overhead
+// per entry.
+//
+// Every pair is packed into one record, [key length][value length]
+// [expiration time][key][value] with varint numbers, appended to an arena of
+// big blocks. The index
+// is an open-addressing table with linear probing whose 8-byte slots hold 16
+// bits of the key's hash and the record's place in the arena, so a probe
+// only touches the arena for likely matches.
+//
+// A changed value is written over its record if the size is the same and
+// appended otherwise; erasing leaves a tombstone slot. Dead records are
+// reclaimed by compacting the arena once they take a third of it, and
+// tombstones by rehashing the table when it fills up. Both happen within the
+// call that triggers them and take time proportional to the map size.
+// 'hash' must be PersistentMap::Hash(key): rehashing recomputes it.
+// Not thread safe, except that concurrent Find() calls are: each marks its
+// key as used in a byte per slot for Sweep() with a relaxed atomic store.
+class CompactMap
+{
+public:
+    CompactMap();
+    // Copies the arena, so it takes time proportional to the map size.
+    CompactMap(const CompactMap& other);
+    CompactMap(CompactMap&& other) = default;
+    CompactMap& operator=(const CompactMap& other) = delete;
+    CompactMap& operator=(CompactMap&& other) = default;
+
+    // Returns false if there is no such key. The value stays valid until the
+    // map is changed.
+    bool Find(std::string_view key, size_t hash, std::string_view& value, uint64_t& expiresAt) const;
+    void Set(std::string_view key, std::string_view value, size_t hash, uint64_t expiresAt = 0);
+    bool Erase(std::string_view key, size_t hash);
+
+    size_t Size() const { return size; }
+    // Bytes of the live records and the index.
+    size_t Bytes() const;
+    void ForEach(const PersistentMap::Visitor& visitor) const;
+    // CLOCK over the slots, see PersistentMap::Sweep(); 'hand' is a slot
+    // index.
+    void Sweep(size_t& hand, size_t victimCount, std::vector<std::string>& victims) const;
+    MemoryUsage Memory() const;
+private:
+    static const size_t NoSlot = static_cast<size_t>(-1);
+    static const size_t NoBlock = static_cast<size_t>(-1);
+
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    struct Record
+    {
+        std::string_view key;
+        std::string_view value;
+        uint64_t expiresAt;
+        size_t size;
+    };
+
+    // 0 is an empty slot, 1 a tombstone; see Pack() for the rest.
+    std::vector<uint64_t> slots;
+    // Whether the key of each slot has been used since the hand passed it.
+    std::unique_ptr<std::atomic<uint8_t>[]> referenced;
+    size_t size;
+    size_t tombstones;
+
+    std::vector<Block> blocks;
+    // Block small records are appended to; big ones get their own blocks.
+    size_t currentBlock;
+    size_t blockUsed;
+    size_t arenaBytes;
+    // Bytes of every appended record, dead or alive.
+    size_t usedBytes;
+    size_t liveBytes;
+    size_t livePayloadBytes;
+
+    // Index of the slot holding 'key' or of the empty slot ending its probe
+    // sequence. 'reusable' gets the first tombstone on the way, if any.
+    size_t Probe(std::string_view key, size_t hash, size_t& reusable) const;
+    char* RecordData(uint64_t slot) const;
+    Record Load(uint64_t slot) const;
+
+    void AddBlock(size_t blockSize);
+    // Space for a record of 'recordSize' bytes at 'offset' of 'block'.
+    char* Allocate(size_t recordSize, size_t& block, size_t& offset);
+    // Returns the slot value for a new record.
+    uint64_t Append(std::string_view key, std::string_view value, uint64_t expiresAt, size_t hash);
+    void Rehash(size_t capacity);
+    void CompactArena();
+    void Maintain();
+};
@@ -0,0 +1,151 @@
+#include "EpochDomain.h"
+
+#include <algorithm>
+
+namespace
+{
+    // Retired objects collected before trying to free them.
+    const size_t ReclaimThreshold = 64;
+}
+
+EpochDomain::Guard::Guard(EpochDomain& domain) : slot(domain.ThreadSlot())
+{
+    if (slot->depth++ > 0)
+    {
+        return;
+    }
+
+    slot->epoch.store(domain.globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // Pairs with the fence in ReclaimLocked(): either the reclaimer sees this
+    // slot as active, or this thread sees every unlink made before the
+    // reclaimer started.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+EpochDomain::Guard::~Guard()
+{
+    if (--slot->depth == 0)
+    {
+        slot->epoch.store(0, std::memory_order_release);
+    }
+}
+
+EpochDomain& EpochDomain::Global()
+{
+    static EpochDomain domain;
+    return domain;
+}
+
+EpochDomain::~EpochDomain()
+{
+    for (const Retired& object: retired)
+    {
+        object.deleter(object.object);
+    }
+
+    Slot* slot = slots.load();
+    while (slot)
+    {
+        Slot* next = slot->next;
+        delete slot;
+        slot = next;
+    }
+}
+
+EpochDomain::Slot* EpochDomain::ThreadSlot()
+{
+    // Gives the slot back when the thread exits.
+    struct SlotOwner
+    {
+        Slot* slot = nullptr;
+
+        ~SlotOwner()
+        {
+            if (slot)
+            {
+                slot->inUse.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    thread_local SlotOwner owner;
+    if (!owner.slot)
+    {
+        owner.slot = AcquireSlot();
+    }
+    return owner.slot;
+}
+
+EpochDomain::Slot* EpochDomain::AcquireSlot()
+{
+    for (Slot* slot = slots.load(std::memory_order_acquire); slot; slot = slot->next)
+    {
+        bool inUse = false;
+        if (slot->inUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+        {
+            return slot;
+        }
+    }
+
+    Slot* slot = new Slot();
+    slot->inUse.store(true, std::memory_order_relaxed);
+    slot->next = slots.load(std::memory_order_relaxed);
+    while (!slots.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    return slot;
+}
+
+void EpochDomain::Retire(const void* object, void (*deleter)(const void*))
+{
+    std::lock_guard<std::mutex> lock(retiredMutex);
+
+    // The object is already unlinked, so only guards entered in this epoch
+    // or earlier may still see it.
+    retired.push_back({ globalEpoch.load(), object, deleter });
+    if (retired.size() >= ReclaimThreshold)
+    {
+        ReclaimLocked();
+    }
+}
+
+void EpochDomain::Reclaim()
+{
+    std::lock_guard<std::mutex> lock(retiredMutex);
+    ReclaimLocked();
+}
+
+void EpochDomain::ReclaimLocked()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t current = globalEpoch.load();
+    uint64_t oldestActive = current;
+    bool allCurrent = true;
+    for (Slot* slot = slots.load(std::memory_order_acquire); slot; slot = slot->next)
+    {
+        const uint64_t epoch = slot->epoch.load(std::memory_order_acquire);
+        if (epoch != 0)
+        {
+            oldestActive = std::min(oldestActive, epoch);
+            allCurrent = allCurrent && epoch == current;
+        }
+    }
+
+    // Guards entered from now on get a later epoch than everything retired
+    // so far.
+    if (allCurrent)
+    {
+        globalEpoch.compare_exchange_strong(current, current + 1);
+    }
+
+    const auto end = std::partition(retired.begin(), retired.end(), [oldestActive](const Retired& object)
+        {
+            return object.epoch >= oldestActive;
+        });
+    for (auto it = end; it != retired.end(); ++it)
+    {
+        it->deleter(it->object);
+    }
+    retired.erase(end, retired.end());
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Epoch-based memory reclamation.
+//
+// Readers of a shared structure run inside a Guard. An object unlinked from
+// the structure is handed to Retire() and freed only once every guard that
+// could have seen it has ended. Entering and leaving a guard writes only to
+// a cache line owned by the calling thread, so readers never contend.
+class EpochDomain
+{
+    struct Slot;
+public:
+    class Guard
+    {
+    public:
+        explicit Guard(EpochDomain& domain);
+        ~Guard();
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    private:
+        Slot* slot;
+    };
+
+    // Slots of exited threads are reused, so the domain used by all
+    // structures of the process is a single one.
+    static EpochDomain& Global();
+
+    ~EpochDomain();
+
+    template <typename T>
+    void Retire(const T* object)
+    {
+        Retire(object, [](const void* retired)
+            {
+                delete static_cast<const T*>(retired);
+            });
+    }
+
+    void Retire(const void* object, void (*deleter)(const void*));
+    // Frees every retired object no guard can see any more.
+    void Reclaim();
+private:
+    // Epoch the owning thread entered its guard in, 0 outside of a guard.
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch {0};
+        std::atomic_bool inUse {false};
+        // Nesting depth of guards; touched by the owning thread only.
+        unsigned depth = 0;
+        Slot* next = nullptr;
+    };
+
+    struct Retired
+    {
+        uint64_t epoch;
+        const void* object;
+        void (*deleter)(const void*);
+    };
+
+    EpochDomain() = default;
+
+    std::atomic<uint64_t> globalEpoch {1};
+    // Slots are only ever added to the front and never removed.
+    std::atomic<Slot*> slots {nullptr};
+
+    std::mutex retiredMutex;
+    std::vector<Retired> retired;
+
+    Slot* ThreadSlot();
+    Slot* AcquireSlot();
+    void ReclaimLocked();
+};
@@ -0,0 +1,101 @@
+#include "Histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+    unsigned HighestBit(uint64_t value)
+    {
+        return 63 - __builtin_clzll(value);
+    }
+}
+
+Histogram::Histogram() :
+    counts(BucketIndex(std::numeric_limits<uint64_t>::max()) + 1)
+{
+    Reset();
+}
+
+// Values of [2^k, 2^(k+1)) with k > SubBucketBits are shifted right by
+// k - SubBucketBits, which maps them to SubBuckets distinct buckets.
+size_t Histogram::BucketIndex(uint64_t value)
+{
+    if (value < 2 * SubBuckets)
+    {
+        return value;
+    }
+
+    const unsigned shift = HighestBit(value) - SubBucketBits;
+    return shift * SubBuckets + (value >> shift);
+}
+
+uint64_t Histogram::BucketHighestValue(size_t index)
+{
+    if (index < 2 * SubBuckets)
+    {
+        return index;
+    }
+
+    const unsigned shift = index / SubBuckets - 1;
+    const uint64_t lowest = (index - shift * SubBuckets) << shift;
+    return lowest + ((uint64_t(1) << shift) - 1);
+}
+
+void Histogram::Record(uint64_t value)
+{
+    ++counts[BucketIndex(value)];
+    ++count;
+    min = std::min(min, value);
+    max = std::max(max, value);
+    sum += value;
+}
+
+void Histogram::Merge(const Histogram& other)
+{
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    count += other.count;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    sum += other.sum;
+}
+
+void Histogram::Reset()
+{
+    std::fill(counts.begin(), counts.end(), 0);
+    count = 0;
+    min = std::numeric_limits<uint64_t>::max();
+    max = 0;
+    sum = 0;
+}
+
+double Histogram::Mean() const
+{
+    return count ? static_cast<double>(sum / count) : 0.0;
+}
+
+uint64_t Histogram::Percentile(double percentile) const
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    const double clamped = std::min(std::max(percentile, 0.0), 100.0);
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(clamped / 100.0 * count)));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            return std::min(BucketHighestValue(i), max);
+        }
+    }
+    return max;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Log-linear histogram in the spirit of HdrHistogram. Values below
+// 2 * SubBuckets are counted exactly; above that every power of two is split
+// into SubBuckets equal buckets, so any percentile is reported with less
+// than 1% relative error over the whole uint64_t range.
+// Not thread safe: keep one per thread and Merge() them.
+class Histogram
+{
+public:
+    Histogram();
+
+    void Record(uint64_t value);
+    void Merge(const Histogram& other);
+    void Reset();
+
+    uint64_t Count() const { return count; }
+    uint64_t Min() const { return count ? min : 0; }
+    uint64_t Max() const { return max; }
+    double Mean() const;
+
+    // Value at 'percentile' (0..100): the highest value of the bucket that
+    // holds it, capped by the maximal recorded value.
+    uint64_t Percentile(double percentile) const;
+private:
+    static constexpr unsigned SubBucketBits = 7;
+    static constexpr uint64_t SubBuckets = uint64_t(1) << SubBucketBits;
+
+    std::vector<uint64_t> counts;
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    long double sum;
+
+    static size_t BucketIndex(uint64_t value);
+    static uint64_t BucketHighestValue(size_t index);
+};
@@ -0,0 +1,383 @@
+#include "IniLoader.h"
+
+#include "MappedFile.h"
+#include "StorageEngine.h"
+
+#include <boost/property_tree/ini_parser.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace
+{
+    const size_t MinChunkSize = 1024 * 1024;
+    // More chunks than threads even out differences in parsing speed.
+    const size_t ChunksPerThread = 4;
+    const size_t WriteBatchSize = 4096;
+
+    const char UnmatchedBracket[] = "unmatched '['";
+    const char NoEquals[] = "'=' character not found in line";
+    const char KeyExpected[] = "key expected";
+    const char DuplicateSection[] = "duplicate section name";
+    const char DuplicateKey[] = "duplicate key name";
+    const char InvalidExpiration[] = "invalid expiration time";
+
+    enum class EntryType : uint8_t
+    {
+        Key,
+        Section
+    };
+
+    struct Entry
+    {
+        std::string_view name;
+        std::string_view value;
+        // Counted from 0 within the chunk.
+        size_t line;
+        EntryType type;
+    };
+
+    // The error on the smallest line wins, as read_ini stops at the first one.
+    struct FirstError
+    {
+        size_t line = SIZE_MAX;
+        const char* message = nullptr;
+
+        void Update(size_t errorLine, const char* errorMessage)
+        {
+            if (errorLine < line)
+            {
+                line = errorLine;
+                message = errorMessage;
+            }
+        }
+
+        void Update(const FirstError& other)
+        {
+            Update(other.line, other.message);
+        }
+    };
+
+    struct Chunk
+    {
+        std::string_view text;
+        std::vector<Entry> entries;
+        // Lines parsed; parsing stops at the first error.
+        size_t lineCount = 0;
+        FirstError error;
+    };
+
+    // A top-level item in file order: a key before the first section or a
+    // section header.
+    struct Candidate
+    {
+        std::string_view name;
+        std::string_view value;
+        size_t line;
+        size_t hash;
+        // Present in the result: every key and every section holding keys.
+        bool kept;
+        bool isSection;
+    };
+
+    // Same characters as std::isspace() in the "C" locale read_ini uses.
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    std::string_view Trim(std::string_view text)
+    {
+        while (!text.empty() && IsSpace(text.front()))
+        {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && IsSpace(text.back()))
+        {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    void ParseChunk(Chunk& chunk)
+    {
+        std::string_view text = chunk.text;
+        while (!text.empty())
+        {
+            const size_t line = chunk.lineCount++;
+            const size_t eol = text.find('\n');
+            const std::string_view content = Trim(text.substr(0, eol));
+            text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+
+            if (content.empty() || content[0] == ';' || content[0] == '#')
+            {
+                continue;
+            }
+
+            if (content[0] == '[')
+            {
+                const size_t end = content.find(']');
+                if (end == std::string_view::npos)
+                {
+                    chunk.error.Update(line, UnmatchedBracket);
+                    return;
+                }
+                chunk.entries.push_back({ Trim(content.substr(1, end - 1)), {}, line, EntryType::Section });
+                continue;
+            }
+
+            const size_t equals = content.find('=');
+            if (equals == std::string_view::npos || equals == 0)
+            {
+                chunk.error.Update(line, equals == 0 ? KeyExpected : NoEquals);
+                return;
+            }
+            chunk.entries.push_back({ Trim(content.substr(0, equals)), Trim(content.substr(equals + 1)),
+                                      line, EntryType::Key });
+        }
+    }
+
+    std::vector<Chunk> SplitIntoChunks(std::string_view text, size_t chunkCount)
+    {
+        const size_t chunkSize = std::max(MinChunkSize, text.size() / chunkCount + 1);
+
+        std::vector<Chunk> chunks;
+        while (!text.empty())
+        {
+            size_t end = text.size();
+            if (chunkSize < text.size())
+            {
+                end = text.find('\n', chunkSize);
+                end = end == std::string_view::npos ? text.size() : end + 1;
+            }
+            chunks.emplace_back();
+            chunks.back().text = text.substr(0, end);
+            text.remove_prefix(end);
+        }
+        return chunks;
+    }
+
+    // Runs 'task(i)' for i in [0, count) on up to 'threadCount' threads.
+    void RunParallel(size_t count, size_t threadCount, const std::function<void(size_t)>& task)
+    {
+        std::atomic_size_t next(0);
+        auto worker = [&]()
+            {
+                for (size_t i = next++; i < count; i = next++)
+                {
+                    task(i);
+                }
+            };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(count, threadCount); ++i)
+        {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread: threads)
+        {
+            thread.join();
+        }
+    }
+
+    // Applies the section rules of read_ini in file order. Keys of sections
+    // are only checked for duplicates within their section; the keys of the
+    // ExpirationSection go to 'expirations' instead of a candidate.
+    std::vector<Candidate> CollectCandidates(const std::vector<Chunk>& chunks, std::vector<Entry>& expirations,
+                                             FirstError& error)
+    {
+        std::vector<Candidate> candidates;
+        std::optional<size_t> section;
+        bool inExpirationSection = false;
+        std::unordered_set<std::string_view> sectionKeys;
+
+        size_t firstLine = 1;
+        for (const Chunk& chunk: chunks)
+        {
+            for (const Entry& entry: chunk.entries)
+            {
+                const size_t line = firstLine + entry.line;
+                if (entry.type == EntryType::Section)
+                {
+                    inExpirationSection = entry.name == ExpirationSection;
+                    section = candidates.size();
+                    sectionKeys.clear();
+                    if (!inExpirationSection)
+                    {
+                        candidates.push_back({ entry.name, {}, line, 0, false, true });
+                    }
+                }
+                else if (!section)
+                {
+                    candidates.push_back({ entry.name, entry.value, line, 0, true, false });
+                }
+                else
+                {
+                    if (inExpirationSection)
+                    {
+                        expirations.push_back({ entry.name, entry.value, line, EntryType::Key });
+                    }
+                    else
+                    {
+                        candidates[*section].kept = true;
+                    }
+                    if (!sectionKeys.insert(entry.name).second)
+                    {
+                        error.Update(line, DuplicateKey);
+                    }
+                }
+            }
+
+            error.Update(chunk.error.line == SIZE_MAX ? SIZE_MAX : firstLine + chunk.error.line,
+                         chunk.error.message);
+            firstLine += chunk.lineCount;
+        }
+        return candidates;
+    }
+
+    // Finds an item named like an earlier kept one. 'indexes' are sorted by
+    // hash and then by position in the file.
+    void FindDuplicates(const std::vector<Candidate>& candidates, const std::vector<size_t>& indexes,
+                        FirstError& error)
+    {
+        for (size_t begin = 0, end = 0; begin < indexes.size(); begin = end)
+        {
+            const size_t hash = candidates[indexes[begin]].hash;
+            end = begin + 1;
+            while (end < indexes.size() && candidates[indexes[end]].hash == hash)
+            {
+                ++end;
+            }
+
+            for (size_t i = begin + 1; i < end; ++i)
+            {
+                const Candidate& candidate = candidates[indexes[i]];
+                for (size_t j = begin; j < i; ++j)
+                {
+                    const Candidate& earlier = candidates[indexes[j]];
+                    if (earlier.kept && earlier.name == candidate.name)
+                    {
+                        error.Update(candidate.line, candidate.isSection ? DuplicateSection : DuplicateKey);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+size_t LoadIniConfig(const std::string& path, StorageEngine& engine, size_t threadCount,
+                     const ExpirationCallback& onExpiration)
+{
+    threadCount = std::max<size_t>(threadCount, 1);
+
+    const MappedFile file(path);
+    file.AdviseSequential();
+
+    std::vector<Chunk> chunks = SplitIntoChunks(file.Data(), threadCount * ChunksPerThread);
+    RunParallel(chunks.size(), threadCount, [&chunks](size_t i)
+        {
+            ParseChunk(chunks[i]);
+        });
+
+    FirstError error;
+    std::vector<Entry> expirations;
+    std::vector<Candidate> candidates = CollectCandidates(chunks, expirations, error);
+    chunks.clear();
+
+    std::vector<uint64_t> expirationTimes(expirations.size());
+    for (size_t i = 0; i < expirations.size(); ++i)
+    {
+        const std::string_view text = expirations[i].value;
+        const auto [end, code] = std::from_chars(text.data(), text.data() + text.size(), expirationTimes[i]);
+        if (code != std::errc() || end != text.data() + text.size())
+        {
+            error.Update(expirations[i].line, InvalidExpiration);
+        }
+    }
+
+    const size_t sliceSize = candidates.size() / threadCount + 1;
+    RunParallel(threadCount, threadCount, [&](size_t slice)
+        {
+            const size_t end = std::min(candidates.size(), (slice + 1) * sliceSize);
+            for (size_t i = slice * sliceSize; i < end; ++i)
+            {
+                candidates[i].hash = PersistentMap::Hash(candidates[i].name);
+            }
+        });
+
+    // Equal names have equal hashes and so fall into the same shard; each
+    // thread checks and then writes the shards it owns.
+    std::vector<std::vector<size_t>> owned(threadCount);
+    std::vector<FirstError> errors(threadCount);
+    RunParallel(threadCount, threadCount, [&](size_t owner)
+        {
+            std::vector<size_t>& indexes = owned[owner];
+            for (size_t i = 0; i < candidates.size(); ++i)
+            {
+                if (engine.ShardOf(candidates[i].hash) % threadCount == owner)
+                {
+                    indexes.push_back(i);
+                }
+            }
+            std::sort(indexes.begin(), indexes.end(), [&candidates](size_t left, size_t right)
+                {
+                    return candidates[left].hash != candidates[right].hash
+                        ? candidates[left].hash < candidates[right].hash : left < right;
+                });
+            FindDuplicates(candidates, indexes, errors[owner]);
+        });
+
+    for (const FirstError& ownerError: errors)
+    {
+        error.Update(ownerError);
+    }
+    if (error.message)
+    {
+        throw boost::property_tree::ini_parser_error(error.message, path, error.line);
+    }
+
+    std::atomic_size_t written(0);
+    RunParallel(threadCount, threadCount, [&](size_t owner)
+        {
+            std::vector<std::vector<StorageEngine::KeyValue>> batches(engine.ShardCount());
+            size_t count = 0;
+            for (size_t i: owned[owner])
+            {
+                const Candidate& candidate = candidates[i];
+                if (!candidate.kept)
+                {
+                    continue;
+                }
+
+                auto& batch = batches[engine.ShardOf(candidate.hash)];
+                batch.emplace_back(candidate.name, candidate.value);
+                if (batch.size() == WriteBatchSize)
+                {
+                    engine.WriteMany(batch);
+                    batch.clear();
+                }
+                ++count;
+            }
+            for (const auto& batch: batches)
+            {
+                engine.WriteMany(batch);
+            }
+            written += count;
+        });
+
+    for (size_t i = 0; i < expirations.size(); ++i)
+    {
+        onExpiration(expirations[i].name, expirationTimes[i]);
+    }
+    return written;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+class StorageEngine;
+
+// Section of a saved config holding 'key=expiration time' for every key that
+// expires; it isn't loaded as a key itself.
+constexpr char ExpirationSection[] = "$expire";
+
+using ExpirationCallback = std::function<void(std::string_view key, uint64_t expiresAt)>;
+
+// Loads an INI config into 'engine' with the same result as reading it with
+// boost::property_tree::ini_parser::read_ini() and writing every top-level
+// (name, data) pair, but without building a ptree. So a [section] holding
+// keys becomes a key with an empty value, its keys are only checked for
+// duplicates, empty sections are dropped, and the first error in the file
+// is thrown as the same ini_parser_error. Nothing is written on an error.
+//
+// The file is mapped and split into line-aligned chunks that are parsed in
+// parallel; the pairs are then checked for duplicates and written shard by
+// shard, with each thread owning a set of the engine's shards.
+// 'onExpiration' is then called for every key of the ExpirationSection.
+// Returns the number of keys written.
+size_t LoadIniConfig(const std::string& path, StorageEngine& engine, size_t threadCount,
+                     const ExpirationCallback& onExpiration);
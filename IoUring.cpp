@@ -0,0 +1,308 @@
+#include "IoUring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+                  "ring indexes are shared with the kernel");
+
+    int Setup(unsigned entries, io_uring_params& params)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    }
+
+    int Enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    int Register(int fd, unsigned opcode, void* argument, unsigned count)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, argument, count));
+    }
+
+    void* Map(size_t size, int fd, off_t offset)
+    {
+        void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    void* MapAnonymous(size_t size)
+    {
+        void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    template <typename T>
+    T* At(void* ring, uint32_t offset)
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+    }
+}
+
+IoUring::IoUring(unsigned entries) :
+    fd(-1), features(0), submissionRing(nullptr), submissionRingSize(0), completionRing(nullptr),
+    completionRingSize(0), entries(nullptr), entriesSize(0), localTail(0), unsubmitted(0), supported {},
+    bufferRing(nullptr), bufferRingSize(0), buffers(nullptr), buffersSize(0), bufferSize(0), bufferMask(0),
+    bufferTail(0)
+{
+    // Cooperative task running saves an interrupt per completion where the
+    // kernel has it.
+    io_uring_params params {};
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    fd = Setup(entries, params);
+    if (fd < 0 && errno == EINVAL)
+    {
+        params = io_uring_params {};
+        fd = Setup(entries, params);
+    }
+    if (fd < 0)
+    {
+        throw std::runtime_error(std::string("Can't set up io_uring: ") + std::strerror(errno));
+    }
+    features = params.features;
+
+    submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMapping = features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMapping)
+    {
+        submissionRingSize = completionRingSize = std::max(submissionRingSize, completionRingSize);
+    }
+    submissionRing = Map(submissionRingSize, fd, IORING_OFF_SQ_RING);
+    completionRing = singleMapping ? submissionRing : Map(completionRingSize, fd, IORING_OFF_CQ_RING);
+    entriesSize = params.sq_entries * sizeof(io_uring_sqe);
+    this->entries = static_cast<io_uring_sqe*>(Map(entriesSize, fd, IORING_OFF_SQES));
+    if (!submissionRing || !completionRing || !this->entries)
+    {
+        const int error = errno;
+        Release();
+        throw std::runtime_error(std::string("Can't map io_uring: ") + std::strerror(error));
+    }
+
+    submissionHead = At<std::atomic<uint32_t>>(submissionRing, params.sq_off.head);
+    submissionTail = At<std::atomic<uint32_t>>(submissionRing, params.sq_off.tail);
+    submissionMask = *At<uint32_t>(submissionRing, params.sq_off.ring_mask);
+    submissionArray = At<uint32_t>(submissionRing, params.sq_off.array);
+    localTail = submissionTail->load(std::memory_order_relaxed);
+
+    completionHead = At<std::atomic<uint32_t>>(completionRing, params.cq_off.head);
+    completionTail = At<std::atomic<uint32_t>>(completionRing, params.cq_off.tail);
+    completionMask = *At<uint32_t>(completionRing, params.cq_off.ring_mask);
+    completions = At<io_uring_cqe>(completionRing, params.cq_off.cqes);
+
+    Probe();
+}
+
+IoUring::~IoUring()
+{
+    Release();
+}
+
+void IoUring::Release()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    if (entries)
+    {
+        ::munmap(entries, entriesSize);
+    }
+    if (completionRing && completionRing != submissionRing)
+    {
+        ::munmap(completionRing, completionRingSize);
+    }
+    if (submissionRing)
+    {
+        ::munmap(submissionRing, submissionRingSize);
+    }
+    if (bufferRing)
+    {
+        ::munmap(bufferRing, bufferRingSize);
+    }
+    if (buffers)
+    {
+        ::munmap(buffers, buffersSize);
+    }
+}
+
+void IoUring::Probe()
+{
+    const size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::unique_ptr<char[]> memory(new char[probeSize]());
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(memory.get());
+
+    // Kernels without probing lack most operations anyway.
+    if (Register(fd, IORING_REGISTER_PROBE, probe, 256) != 0)
+    {
+        return;
+    }
+    for (unsigned i = 0; i < probe->ops_len; ++i)
+    {
+        if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+        {
+            supported[probe->ops[i].op / 8] |= uint8_t(1) << (probe->ops[i].op % 8);
+        }
+    }
+}
+
+bool IoUring::Supports(uint8_t opcode) const
+{
+    return supported[opcode / 8] & (uint8_t(1) << (opcode % 8));
+}
+
+io_uring_sqe& IoUring::NextEntry()
+{
+    // A slot is reused only after the kernel has read the entry in it.
+    while (localTail - submissionHead->load(std::memory_order_acquire) > submissionMask)
+    {
+        Submit(0);
+        if (localTail - submissionHead->load(std::memory_order_acquire) <= submissionMask)
+        {
+            break;
+        }
+        // The kernel takes no more entries while the completion queue is
+        // full: ready completions are put aside for ForEachCompletion(), or
+        // one is waited for.
+        if (DeferCompletions() == 0)
+        {
+            Submit(1);
+        }
+    }
+
+    const uint32_t index = localTail & submissionMask;
+    io_uring_sqe& entry = entries[index];
+    std::memset(&entry, 0, sizeof(entry));
+    submissionArray[index] = index;
+    ++localTail;
+    ++unsubmitted;
+    return entry;
+}
+
+void IoUring::Submit(unsigned waitCount)
+{
+    submissionTail->store(localTail, std::memory_order_release);
+
+    // Completions put aside are ready already.
+    if (!deferred.empty())
+    {
+        waitCount = 0;
+    }
+    const unsigned flags = waitCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true)
+    {
+        const int submitted = Enter(fd, unsubmitted, waitCount, flags);
+        if (submitted >= 0)
+        {
+            unsubmitted -= submitted;
+            return;
+        }
+        // A full completion queue has to be drained before anything more is
+        // submitted.
+        if (errno == EBUSY || errno == EAGAIN)
+        {
+            return;
+        }
+        if (errno != EINTR)
+        {
+            throw std::runtime_error(std::string("Can't submit to io_uring: ") + std::strerror(errno));
+        }
+    }
+}
+
+size_t IoUring::ForEachCompletion(const CompletionHandler& handler)
+{
+    // A handler may queue entries, which may put completions aside, so each
+    // one is taken off the ring before it's handled. Completions only move
+    // from the ring to the back of 'deferred', which keeps their order.
+    const size_t count = deferred.size() + (completionTail->load(std::memory_order_acquire) -
+                                            completionHead->load(std::memory_order_relaxed));
+    for (size_t i = 0; i < count; ++i)
+    {
+        io_uring_cqe completion;
+        if (!deferred.empty())
+        {
+            completion = deferred.front();
+            deferred.pop_front();
+        }
+        else
+        {
+            const uint32_t head = completionHead->load(std::memory_order_relaxed);
+            completion = completions[head & completionMask];
+            completionHead->store(head + 1, std::memory_order_release);
+        }
+        handler(completion);
+    }
+    return count;
+}
+
+size_t IoUring::DeferCompletions()
+{
+    const uint32_t head = completionHead->load(std::memory_order_relaxed);
+    const uint32_t tail = completionTail->load(std::memory_order_acquire);
+    for (uint32_t i = head; i != tail; ++i)
+    {
+        deferred.push_back(completions[i & completionMask]);
+    }
+    completionHead->store(tail, std::memory_order_release);
+    return tail - head;
+}
+
+bool IoUring::RegisterBufferRing(uint16_t group, unsigned count, size_t size)
+{
+    bufferRingSize = count * sizeof(io_uring_buf);
+    bufferRing = static_cast<io_uring_buf_ring*>(MapAnonymous(bufferRingSize));
+    buffersSize = count * size;
+    buffers = static_cast<char*>(MapAnonymous(buffersSize));
+
+    io_uring_buf_reg registration {};
+    registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+    registration.ring_entries = count;
+    registration.bgid = group;
+    if (!bufferRing || !buffers || Register(fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0)
+    {
+        if (bufferRing)
+        {
+            ::munmap(bufferRing, bufferRingSize);
+            bufferRing = nullptr;
+        }
+        if (buffers)
+        {
+            ::munmap(buffers, buffersSize);
+            buffers = nullptr;
+        }
+        return false;
+    }
+
+    bufferSize = size;
+    bufferMask = static_cast<uint16_t>(count - 1);
+    for (unsigned id = 0; id < count; ++id)
+    {
+        RecycleBuffer(static_cast<uint16_t>(id));
+    }
+    return true;
+}
+
+void IoUring::RecycleBuffer(uint16_t id)
+{
+    // The tail shares the first entry's reserved field, which isn't written.
+    // Entries are addressed directly: in C++ the flexible array of the
+    // kernel header starts after an empty struct, off the kernel's layout.
+    io_uring_buf& buffer = reinterpret_cast<io_uring_buf*>(bufferRing)[bufferTail & bufferMask];
+    buffer.addr = reinterpret_cast<uint64_t>(Buffer(id));
+    buffer.len = static_cast<uint32_t>(bufferSize);
+    buffer.bid = id;
+    ++bufferTail;
+    __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
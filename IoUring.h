@@ -0,0 +1,89 @@
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+// Minimal io_uring instance driven by the raw system calls, so no liburing
+// is needed. The submission and completion rings are mapped from the kernel;
+// an entry is prepared in place by NextEntry() and passed to the kernel by
+// the next Submit(), which also waits for completions. Used by one thread.
+class IoUring
+{
+public:
+    using CompletionHandler = std::function<void(const io_uring_cqe& completion)>;
+
+    // Throws std::runtime_error if the kernel has no io_uring or forbids it.
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Whether the kernel implements 'opcode'.
+    bool Supports(uint8_t opcode) const;
+
+    // A zeroed submission entry; if the ring is full, submits the queued
+    // ones first and waits until the kernel has taken some.
+    io_uring_sqe& NextEntry();
+    // Submits the queued entries and waits for at least 'waitCount'
+    // completions in the same system call.
+    void Submit(unsigned waitCount);
+    // Calls 'handler' for every completion ready and returns their number.
+    size_t ForEachCompletion(const CompletionHandler& handler);
+
+    // Registers a ring of 'count' (a power of two) buffers of 'size' bytes
+    // each as buffer group 'group', for receives that pick a buffer when
+    // data arrives. Returns false if the kernel can't do that.
+    bool RegisterBufferRing(uint16_t group, unsigned count, size_t size);
+    // Data of buffer 'id' of the registered ring.
+    char* Buffer(uint16_t id) const { return buffers + size_t(id) * bufferSize; }
+    // Gives buffer 'id' back to the kernel once its data is consumed.
+    void RecycleBuffer(uint16_t id);
+private:
+    int fd;
+    uint32_t features;
+
+    void* submissionRing;
+    size_t submissionRingSize;
+    void* completionRing;
+    size_t completionRingSize;
+    io_uring_sqe* entries;
+    size_t entriesSize;
+
+    std::atomic<uint32_t>* submissionHead;
+    std::atomic<uint32_t>* submissionTail;
+    uint32_t submissionMask;
+    uint32_t* submissionArray;
+    // Entries prepared but not yet published to the kernel.
+    uint32_t localTail;
+    uint32_t unsubmitted;
+
+    std::atomic<uint32_t>* completionHead;
+    std::atomic<uint32_t>* completionTail;
+    uint32_t completionMask;
+    io_uring_cqe* completions;
+    // Completions taken off a full ring so entries could be submitted,
+    // handled by the next ForEachCompletion().
+    std::deque<io_uring_cqe> deferred;
+
+    // Opcodes the kernel implements, from IORING_REGISTER_PROBE.
+    uint8_t supported[256 / 8];
+
+    io_uring_buf_ring* bufferRing;
+    size_t bufferRingSize;
+    char* buffers;
+    size_t buffersSize;
+    size_t bufferSize;
+    uint16_t bufferMask;
+    uint16_t bufferTail;
+
+    // Moves the ready completions to 'deferred' and returns their number.
+    size_t DeferCompletions();
+    void Probe();
+    void Release();
+};
@@ -0,0 +1,260 @@
+#include "LockFreeEngine.h"
+
+#include "EpochDomain.h"
+
+#include <algorithm>
+
+LockFreeEngine::LockFreeEngine(size_t shardCount) :
+    StorageEngine(shardCount), shards(new Shard[shardCount]), batchSequence(0)
+{
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        shards[i].map.store(new PersistentMap(), std::memory_order_relaxed);
+    }
+}
+
+LockFreeEngine::~LockFreeEngine()
+{
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        EpochDomain::Global().Retire(shards[i].map.load());
+    }
+}
+
+LockFreeEngine::Shard& LockFreeEngine::GetShard(size_t hash) const
+{
+    return shards[ShardIndex(hash, shardCount)];
+}
+
+ReadStatus LockFreeEngine::Read(std::string_view key, std::string& value, uint64_t now) const
+{
+    const size_t hash = PersistentMap::Hash(key);
+    const Shard& shard = GetShard(hash);
+
+    EpochDomain::Guard guard(EpochDomain::Global());
+    uint64_t expiresAt = 0;
+    const std::string* stored = shard.map.load(std::memory_order_acquire)->Find(key, hash, expiresAt);
+    if (!stored)
+    {
+        return ReadStatus::Missing;
+    }
+    if (IsExpired(expiresAt, now))
+    {
+        return ReadStatus::Expired;
+    }
+    value = *stored;
+    return ReadStatus::Found;
+}
+
+std::vector<std::optional<std::string>> LockFreeEngine::ReadMany(const std::vector<std::string_view>& keys,
+                                                                 uint64_t now) const
+{
+    std::vector<size_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        hashes[i] = PersistentMap::Hash(keys[i]);
+    }
+    const std::vector<size_t> shardIndexes = ShardIndexes(hashes, shardCount);
+
+    EpochDomain::Guard guard(EpochDomain::Global());
+
+    // Maps of the involved shards, indexed like 'shardIndexes'.
+    std::vector<const PersistentMap*> maps(shardIndexes.size());
+    while (true)
+    {
+        const uint64_t sequence = batchSequence.load(std::memory_order_acquire);
+        if (sequence % 2 != 0)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < shardIndexes.size(); ++i)
+        {
+            maps[i] = shards[shardIndexes[i]].map.load(std::memory_order_acquire);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (batchSequence.load(std::memory_order_relaxed) == sequence)
+        {
+            break;
+        }
+    }
+
+    std::vector<std::optional<std::string>> result(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        const size_t position = std::lower_bound(shardIndexes.begin(), shardIndexes.end(),
+                                                 ShardIndex(hashes[i], shardCount)) - shardIndexes.begin();
+        uint64_t expiresAt = 0;
+        const std::string* stored = maps[position]->Find(keys[i], hashes[i], expiresAt);
+        if (stored && !IsExpired(expiresAt, now))
+        {
+            result[i] = *stored;
+        }
+    }
+    return result;
+}
+
+void LockFreeEngine::Write(std::string_view key, std::string_view value, uint64_t expiresAt)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.writeMutex);
+
+    // The published map shares its root with the copy, so Set() copies the
+    // path to the key instead of changing nodes readers may be looking at.
+    const PersistentMap* published = shard.map.load(std::memory_order_relaxed);
+    PersistentMap* changed = new PersistentMap(*published);
+    changed->Set(key, value, hash, expiresAt);
+    Evict(*changed, shard.clockHand);
+    shard.map.store(changed, std::memory_order_release);
+
+    if (changeLog)
+    {
+        changeLog->Append(key, value, expiresAt);
+    }
+    EpochDomain::Global().Retire(published);
+}
+
+void LockFreeEngine::WriteMany(const std::vector<KeyValue>& keysValues)
+{
+    std::vector<size_t> hashes(keysValues.size());
+    for (size_t i = 0; i < keysValues.size(); ++i)
+    {
+        hashes[i] = PersistentMap::Hash(keysValues[i].first);
+    }
+    const std::vector<size_t> shardIndexes = ShardIndexes(hashes, shardCount);
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(shardIndexes.size());
+    for (size_t index: shardIndexes)
+    {
+        locks.emplace_back(shards[index].writeMutex);
+    }
+
+    // Only the first change of a copy copies nodes; the rest of the batch
+    // changes the copy's own nodes in place.
+    std::vector<const PersistentMap*> published(shardIndexes.size());
+    std::vector<std::unique_ptr<PersistentMap>> changed(shardIndexes.size());
+    for (size_t i = 0; i < shardIndexes.size(); ++i)
+    {
+        published[i] = shards[shardIndexes[i]].map.load(std::memory_order_relaxed);
+        changed[i] = std::make_unique<PersistentMap>(*published[i]);
+    }
+    for (size_t i = 0; i < keysValues.size(); ++i)
+    {
+        const size_t position = std::lower_bound(shardIndexes.begin(), shardIndexes.end(),
+                                                 ShardIndex(hashes[i], shardCount)) - shardIndexes.begin();
+        changed[position]->Set(keysValues[i].first, keysValues[i].second, hashes[i]);
+    }
+    for (size_t i = 0; i < shardIndexes.size(); ++i)
+    {
+        Evict(*changed[i], shards[shardIndexes[i]].clockHand);
+    }
+
+    {
+        std::unique_lock<std::mutex> batchLock(batchMutex, std::defer_lock);
+        if (shardIndexes.size() > 1)
+        {
+            batchLock.lock();
+            batchSequence.fetch_add(1);
+        }
+        for (size_t i = 0; i < shardIndexes.size(); ++i)
+        {
+            shards[shardIndexes[i]].map.store(changed[i].release(), std::memory_order_release);
+        }
+        if (batchLock)
+        {
+            batchSequence.fetch_add(1);
+        }
+    }
+
+    if (changeLog)
+    {
+        changeLog->AppendBatch(keysValues);
+    }
+    for (const PersistentMap* map: published)
+    {
+        EpochDomain::Global().Retire(map);
+    }
+}
+
+bool LockFreeEngine::Expire(std::string_view key, uint64_t expiresAt, uint64_t now)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.writeMutex);
+
+    // Writers of the shard are locked out, so the published map stays.
+    const PersistentMap* published = shard.map.load(std::memory_order_relaxed);
+    uint64_t oldExpiresAt = 0;
+    const std::string* stored = published->Find(key, hash, oldExpiresAt);
+    if (!stored || IsExpired(oldExpiresAt, now))
+    {
+        return false;
+    }
+
+    PersistentMap* changed = new PersistentMap(*published);
+    changed->Set(key, *stored, hash, expiresAt);
+    shard.map.store(changed, std::memory_order_release);
+
+    if (changeLog)
+    {
+        changeLog->Append(key, *stored, expiresAt);
+    }
+    EpochDomain::Global().Retire(published);
+    return true;
+}
+
+bool LockFreeEngine::EraseExpired(std::string_view key, uint64_t now)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.writeMutex);
+
+    const PersistentMap* published = shard.map.load(std::memory_order_relaxed);
+    uint64_t expiresAt = 0;
+    if (!published->Find(key, hash, expiresAt) || !IsExpired(expiresAt, now))
+    {
+        return false;
+    }
+
+    PersistentMap* changed = new PersistentMap(*published);
+    changed->Erase(key, hash);
+    shard.map.store(changed, std::memory_order_release);
+    EpochDomain::Global().Retire(published);
+    return true;
+}
+
+void LockFreeEngine::ForEach(const PersistentMap::Visitor& visitor) const
+{
+    // Copies share the published roots and keep them alive after the guard.
+    std::vector<PersistentMap> snapshot;
+    snapshot.reserve(shardCount);
+    {
+        EpochDomain::Guard guard(EpochDomain::Global());
+        for (size_t i = 0; i < shardCount; ++i)
+        {
+            snapshot.push_back(*shards[i].map.load(std::memory_order_acquire));
+        }
+    }
+
+    for (const PersistentMap& map: snapshot)
+    {
+        map.ForEach(visitor);
+    }
+}
+
+MemoryUsage LockFreeEngine::Memory() const
+{
+    MemoryUsage result;
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        PersistentMap map;
+        {
+            EpochDomain::Guard guard(EpochDomain::Global());
+            map = *shards[i].map.load(std::memory_order_acquire);
+        }
+
+        result += map.Memory();
+    }
+    return result;
+}
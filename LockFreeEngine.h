@@ -0,0 +1,49 @@
+#pragma once
+
+#include "StorageEngine.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+// Engine whose reads take no lock and write no shared memory.
+//
+// Each shard publishes an immutable map through an atomic pointer. A writer
+// copies the published map (a constant time copy of a persistent map),
+// changes the copy and publishes it; the old map is freed by epoch-based
+// reclamation once no reader can hold it. Writers of a shard are serialized
+// by a mutex. Batches over several shards are published under a sequence
+// lock, which ReadMany checks to see them whole.
+class LockFreeEngine : public StorageEngine
+{
+public:
+    explicit LockFreeEngine(size_t shardCount);
+    ~LockFreeEngine() override;
+
+    ReadStatus Read(std::string_view key, std::string& value, uint64_t now) const override;
+    std::vector<std::optional<std::string>> ReadMany(const std::vector<std::string_view>& keys,
+                                                     uint64_t now) const override;
+    void Write(std::string_view key, std::string_view value, uint64_t expiresAt) override;
+    void WriteMany(const std::vector<KeyValue>& keysValues) override;
+    bool Expire(std::string_view key, uint64_t expiresAt, uint64_t now) override;
+    bool EraseExpired(std::string_view key, uint64_t now) override;
+
+    void ForEach(const PersistentMap::Visitor& visitor) const override;
+    MemoryUsage Memory() const override;
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<const PersistentMap*> map;
+        std::mutex writeMutex;
+        // Where the eviction sweep goes on from; guarded by writeMutex.
+        size_t clockHand = 0;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+    // Odd while a batch is being published.
+    alignas(64) std::atomic<uint64_t> batchSequence;
+    // Batches over disjoint shards still publish one at a time.
+    std::mutex batchMutex;
+
+    Shard& GetShard(size_t hash) const;
+};
@@ -0,0 +1,58 @@
+#include "MappedFile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path) :
+    data(nullptr), size(0)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+    }
+
+    struct stat fileStat;
+    if (::fstat(fd, &fileStat) != 0)
+    {
+        const int error = errno;
+        ::close(fd);
+        throw std::runtime_error("Can't get size of " + path + ": " + std::strerror(error));
+    }
+
+    // mmap() refuses an empty mapping.
+    if (fileStat.st_size > 0)
+    {
+        void* address = ::mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            const int error = errno;
+            ::close(fd);
+            throw std::runtime_error("Can't map " + path + ": " + std::strerror(error));
+        }
+        data = static_cast<const char*>(address);
+        size = fileStat.st_size;
+    }
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data)
+    {
+        ::munmap(const_cast<char*>(data), size);
+    }
+}
+
+void MappedFile::AdviseSequential() const
+{
+    if (data)
+    {
+        ::madvise(const_cast<char*>(data), size, MADV_SEQUENTIAL);
+    }
+}
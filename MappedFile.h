@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Whole file mapped read-only into memory.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Empty for an empty file.
+    std::string_view Data() const { return std::string_view(data, size); }
+
+    // Tells the kernel the file will be read from the start to the end.
+    void AdviseSequential() const;
+private:
+    const char* data;
+    size_t size;
+};
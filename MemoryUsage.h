@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+
+// Bytes held by the keys and values of a storage, by component. Allocator
+// overhead isn't included.
+struct MemoryUsage
+{
+    size_t keyCount = 0;
+    // The bytes of the keys and values themselves.
+    size_t payloadBytes = 0;
+    // Per-entry headers: string objects, nodes, record lengths.
+    size_t entryOverheadBytes = 0;
+    // Hash tables and trie branches.
+    size_t indexBytes = 0;
+    // Overwritten or erased entries whose space isn't reclaimed yet.
+    size_t deadBytes = 0;
+    // Allocated but not used yet.
+    size_t freeBytes = 0;
+
+    size_t TotalBytes() const
+    {
+        return payloadBytes + entryOverheadBytes + indexBytes + deadBytes + freeBytes;
+    }
+
+    MemoryUsage& operator+=(const MemoryUsage& other)
+    {
+        keyCount += other.keyCount;
+        payloadBytes += other.payloadBytes;
+        entryOverheadBytes += other.entryOverheadBytes;
+        indexBytes += other.indexBytes;
+        deadBytes += other.deadBytes;
+        freeBytes += other.freeBytes;
+        return *this;
+    }
+};
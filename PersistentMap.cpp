@@ -0,0 +1,685 @@
+#include "PersistentMap.h"
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace hamt
+{
+    const unsigned BitsPerLevel = 5;
+    const size_t LevelMask = (size_t(1) << BitsPerLevel) - 1;
+
+    enum class NodeType : uint8_t
+    {
+        Leaf,
+        Branch,
+        // Leaves whose full hashes are equal.
+        Collision
+    };
+
+    struct Node
+    {
+        std::atomic<uint32_t> refCount;
+        const NodeType type;
+
+        explicit Node(NodeType type) : refCount(1), type(type) {}
+    };
+
+    struct Leaf : Node
+    {
+        // Set by every lookup and cleared by the eviction hand; it fits into
+        // the padding after the node header.
+        mutable std::atomic<bool> referenced;
+        const size_t hash;
+        const std::string key;
+        std::string value;
+        uint64_t expiresAt;
+
+        Leaf(size_t hash, std::string_view key, std::string_view value, uint64_t expiresAt) :
+            Node(NodeType::Leaf), referenced(true), hash(hash), key(key), value(value), expiresAt(expiresAt)
+        {
+        }
+    };
+
+    // Estimated bytes of a leaf and its share of the branches, besides the
+    // key and the value.
+    const size_t EntryOverheadBytes = sizeof(Leaf) + 2 * sizeof(Node*);
+
+    void MarkReferenced(const Leaf* leaf)
+    {
+        // Readers don't write the cache line once the bit is set.
+        if (!leaf->referenced.load(std::memory_order_relaxed))
+        {
+            leaf->referenced.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // Branch and collision nodes store their children right after the header.
+    struct alignas(Node*) Array : Node
+    {
+        // For a branch: which of the 2^BitsPerLevel slots are present.
+        const uint32_t bitmap;
+        const uint32_t count;
+
+        Array(NodeType type, uint32_t bitmap, uint32_t count) :
+            Node(type), bitmap(bitmap), count(count)
+        {
+        }
+
+        Node** Children() { return reinterpret_cast<Node**>(this + 1); }
+    };
+
+    void Release(Node* node);
+
+    Node* Retain(Node* node)
+    {
+        if (node)
+        {
+            node->refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        return node;
+    }
+
+    // A node may be changed in place only if it and all its ancestors have
+    // a single owner: a node with one reference can still be reachable from
+    // another map through a shared parent.
+    bool IsExclusive(const Node* node, bool pathExclusive)
+    {
+        return pathExclusive && node->refCount.load(std::memory_order_acquire) == 1;
+    }
+
+    Array* AllocateArray(NodeType type, uint32_t bitmap, uint32_t count)
+    {
+        void* memory = ::operator new(sizeof(Array) + count * sizeof(Node*));
+        return new (memory) Array(type, bitmap, count);
+    }
+
+    void Destroy(Node* node)
+    {
+        if (node->type == NodeType::Leaf)
+        {
+            delete static_cast<Leaf*>(node);
+            return;
+        }
+
+        Array* array = static_cast<Array*>(node);
+        for (uint32_t i = 0; i < array->count; ++i)
+        {
+            Release(array->Children()[i]);
+        }
+        array->~Array();
+        ::operator delete(array);
+    }
+
+    void Release(Node* node)
+    {
+        if (node && node->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            Destroy(node);
+        }
+    }
+
+    size_t NodeHash(Node* node)
+    {
+        if (node->type == NodeType::Leaf)
+        {
+            return static_cast<Leaf*>(node)->hash;
+        }
+        return static_cast<Leaf*>(static_cast<Array*>(node)->Children()[0])->hash;
+    }
+
+    uint32_t SlotBit(size_t hash, unsigned shift)
+    {
+        return uint32_t(1) << ((hash >> shift) & LevelMask);
+    }
+
+    uint32_t SlotPosition(uint32_t bitmap, uint32_t bit)
+    {
+        return __builtin_popcount(bitmap & (bit - 1));
+    }
+
+    // Copy of 'array' with 'inserted' placed at 'position' (when 'inserted'
+    // isn't null) or with the child at 'position' dropped. Retains the
+    // children it shares with 'array' and takes over the 'inserted' reference.
+    Array* CopyArray(Array* array, uint32_t bitmap, uint32_t position, Node* inserted)
+    {
+        const uint32_t count = inserted ? array->count + 1 : array->count - 1;
+        Array* copy = AllocateArray(array->type, bitmap, count);
+
+        Node** from = array->Children();
+        Node** to = copy->Children();
+        for (uint32_t i = 0, j = 0; i < array->count; ++i)
+        {
+            if (i == position)
+            {
+                if (inserted)
+                {
+                    to[j++] = inserted;
+                }
+                else
+                {
+                    continue;
+                }
+            }
+            to[j++] = Retain(from[i]);
+        }
+        if (inserted && position == array->count)
+        {
+            to[count - 1] = inserted;
+        }
+
+        return copy;
+    }
+
+    // Puts 'replacement' to the child slot at 'position'. Takes over the
+    // 'replacement' reference.
+    Node* ReplaceChild(Array* array, bool exclusive, uint32_t position, Node* replacement)
+    {
+        if (exclusive)
+        {
+            Release(array->Children()[position]);
+            array->Children()[position] = replacement;
+            return array;
+        }
+
+        Array* copy = AllocateArray(array->type, array->bitmap, array->count);
+        for (uint32_t i = 0; i < array->count; ++i)
+        {
+            copy->Children()[i] = i == position ? replacement : Retain(array->Children()[i]);
+        }
+        return copy;
+    }
+
+    // Builds the subtree holding two nodes whose hashes differ.
+    Node* Merge(Node* first, size_t firstHash, Node* second, size_t secondHash, unsigned shift)
+    {
+        const uint32_t firstBit = SlotBit(firstHash, shift);
+        const uint32_t secondBit = SlotBit(secondHash, shift);
+
+        if (firstBit == secondBit)
+        {
+            Array* branch = AllocateArray(NodeType::Branch, firstBit, 1);
+            branch->Children()[0] = Merge(first, firstHash, second, secondHash, shift + BitsPerLevel);
+            return branch;
+        }
+
+        Array* branch = AllocateArray(NodeType::Branch, firstBit | secondBit, 2);
+        branch->Children()[0] = firstBit < secondBit ? first : second;
+        branch->Children()[1] = firstBit < secondBit ? second : first;
+        return branch;
+    }
+
+    // Returns the node that replaces 'node' in its parent: 'node' itself if
+    // it has been changed in place, otherwise a new reference. 'oldPayload'
+    // gets the key and value size of the replaced pair, if any.
+    Node* Assign(Node* node, bool pathExclusive, unsigned shift, size_t hash, std::string_view key,
+                 std::string_view value, uint64_t expiresAt, bool& added, size_t& oldPayload)
+    {
+        if (!node)
+        {
+            added = true;
+            return new Leaf(hash, key, value, expiresAt);
+        }
+
+        const bool exclusive = IsExclusive(node, pathExclusive);
+
+        switch (node->type)
+        {
+        case NodeType::Leaf:
+        {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            if (leaf->hash == hash && leaf->key == key)
+            {
+                oldPayload = leaf->key.size() + leaf->value.size();
+                if (exclusive)
+                {
+                    leaf->value.assign(value);
+                    leaf->expiresAt = expiresAt;
+                    MarkReferenced(leaf);
+                    return leaf;
+                }
+                return new Leaf(hash, key, value, expiresAt);
+            }
+
+            added = true;
+            if (leaf->hash == hash)
+            {
+                Array* collision = AllocateArray(NodeType::Collision, 0, 2);
+                collision->Children()[0] = Retain(leaf);
+                collision->Children()[1] = new Leaf(hash, key, value, expiresAt);
+                return collision;
+            }
+            return Merge(Retain(leaf), leaf->hash, new Leaf(hash, key, value, expiresAt), hash, shift);
+        }
+        case NodeType::Collision:
+        {
+            Array* collision = static_cast<Array*>(node);
+            const size_t collisionHash = NodeHash(collision);
+            if (collisionHash != hash)
+            {
+                added = true;
+                return Merge(Retain(collision), collisionHash, new Leaf(hash, key, value, expiresAt), hash, shift);
+            }
+
+            for (uint32_t i = 0; i < collision->count; ++i)
+            {
+                Node* child = collision->Children()[i];
+                if (static_cast<Leaf*>(child)->key == key)
+                {
+                    Node* newChild = Assign(child, exclusive, shift, hash, key, value, expiresAt, added, oldPayload);
+                    return newChild == child ? collision : ReplaceChild(collision, exclusive, i, newChild);
+                }
+            }
+
+            added = true;
+            return CopyArray(collision, 0, collision->count, new Leaf(hash, key, value, expiresAt));
+        }
+        case NodeType::Branch:
+        {
+            Array* branch = static_cast<Array*>(node);
+            const uint32_t bit = SlotBit(hash, shift);
+            const uint32_t position = SlotPosition(branch->bitmap, bit);
+
+            if (!(branch->bitmap & bit))
+            {
+                added = true;
+                return CopyArray(branch, branch->bitmap | bit, position, new Leaf(hash, key, value, expiresAt));
+            }
+
+            Node* child = branch->Children()[position];
+            Node* newChild = Assign(child, exclusive, shift + BitsPerLevel, hash, key, value, expiresAt, added,
+                                    oldPayload);
+            return newChild == child ? branch : ReplaceChild(branch, exclusive, position, newChild);
+        }
+        }
+
+        return node;
+    }
+
+    // Returns the node that replaces 'node' in its parent: 'node' itself if
+    // nothing is removed, nullptr if the whole subtree is gone, otherwise a
+    // new reference. 'oldPayload' gets the key and value size of the removed
+    // pair.
+    Node* Remove(Node* node, bool pathExclusive, unsigned shift, size_t hash, std::string_view key,
+                 bool& removed, size_t& oldPayload)
+    {
+        if (!node)
+        {
+            return node;
+        }
+
+        switch (node->type)
+        {
+        case NodeType::Leaf:
+        {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            removed = leaf->hash == hash && leaf->key == key;
+            oldPayload = removed ? leaf->key.size() + leaf->value.size() : 0;
+            return removed ? nullptr : node;
+        }
+        case NodeType::Collision:
+        {
+            Array* collision = static_cast<Array*>(node);
+            if (NodeHash(collision) != hash)
+            {
+                return node;
+            }
+
+            for (uint32_t i = 0; i < collision->count; ++i)
+            {
+                const Leaf* leaf = static_cast<Leaf*>(collision->Children()[i]);
+                if (leaf->key == key)
+                {
+                    removed = true;
+                    oldPayload = leaf->key.size() + leaf->value.size();
+                    if (collision->count == 2)
+                    {
+                        return Retain(collision->Children()[1 - i]);
+                    }
+                    return CopyArray(collision, 0, i, nullptr);
+                }
+            }
+            return node;
+        }
+        case NodeType::Branch:
+        {
+            Array* branch = static_cast<Array*>(node);
+            const uint32_t bit = SlotBit(hash, shift);
+            if (!(branch->bitmap & bit))
+            {
+                return node;
+            }
+
+            const uint32_t position = SlotPosition(branch->bitmap, bit);
+            Node* child = branch->Children()[position];
+            const bool exclusive = IsExclusive(branch, pathExclusive);
+            Node* newChild = Remove(child, exclusive, shift + BitsPerLevel, hash, key, removed, oldPayload);
+            if (newChild == child)
+            {
+                return node;
+            }
+
+            if (!newChild)
+            {
+                if (branch->count == 1)
+                {
+                    return nullptr;
+                }
+                // A lone leaf or collision node moves up to replace its branch.
+                if (branch->count == 2 && branch->Children()[1 - position]->type != NodeType::Branch)
+                {
+                    return Retain(branch->Children()[1 - position]);
+                }
+                return CopyArray(branch, branch->bitmap & ~bit, position, nullptr);
+            }
+
+            if (branch->count == 1 && newChild->type != NodeType::Branch)
+            {
+                return newChild;
+            }
+            return ReplaceChild(branch, exclusive, position, newChild);
+        }
+        }
+
+        return node;
+    }
+
+    void Visit(Node* node, const PersistentMap::Visitor& visitor)
+    {
+        if (node->type == NodeType::Leaf)
+        {
+            const Leaf* leaf = static_cast<Leaf*>(node);
+            visitor(leaf->key, leaf->value, leaf->expiresAt);
+            return;
+        }
+
+        Array* array = static_cast<Array*>(node);
+        for (uint32_t i = 0; i < array->count; ++i)
+        {
+            Visit(array->Children()[i], visitor);
+        }
+    }
+
+    // Whether 'hash' comes after 'hand' in the order leaves are visited,
+    // given that the two agree below 'shift'.
+    bool VisitedAfter(size_t hash, size_t hand, unsigned shift)
+    {
+        for (; shift < sizeof(size_t) * 8; shift += BitsPerLevel)
+        {
+            const size_t hashSlot = (hash >> shift) & LevelMask;
+            const size_t handSlot = (hand >> shift) & LevelMask;
+            if (hashSlot != handSlot)
+            {
+                return hashSlot > handSlot;
+            }
+        }
+        return false;
+    }
+
+    // One pass of the CLOCK hand of PersistentMap::Sweep().
+    struct Sweeper
+    {
+        size_t& hand;
+        // Leaves the hand may still pass.
+        size_t budget;
+        const size_t victimCount;
+        std::vector<std::string>& victims;
+
+        bool Done() const
+        {
+            return budget == 0 || victims.size() >= victimCount;
+        }
+
+        void Look(const Leaf* leaf)
+        {
+            --budget;
+            if (leaf->referenced.load(std::memory_order_relaxed))
+            {
+                leaf->referenced.store(false, std::memory_order_relaxed);
+            }
+            else
+            {
+                victims.push_back(leaf->key);
+            }
+        }
+
+        // Looks at the leaves that come after the hand, or at all of them if
+        // 'fromStart'. Returns false once done.
+        bool Visit(Node* node, unsigned shift, bool fromStart)
+        {
+            if (node->type != NodeType::Branch)
+            {
+                const size_t hash = NodeHash(node);
+                if (!fromStart && !VisitedAfter(hash, hand, shift))
+                {
+                    return true;
+                }
+
+                // Leaves of a collision node are passed together.
+                if (node->type == NodeType::Leaf)
+                {
+                    Look(static_cast<Leaf*>(node));
+                }
+                else
+                {
+                    Array* collision = static_cast<Array*>(node);
+                    for (uint32_t i = 0; i < collision->count && budget > 0; ++i)
+                    {
+                        Look(static_cast<Leaf*>(collision->Children()[i]));
+                    }
+                }
+                hand = hash;
+                return !Done();
+            }
+
+            Array* branch = static_cast<Array*>(node);
+            const size_t handSlot = (hand >> shift) & LevelMask;
+            uint32_t position = 0;
+            for (size_t slot = 0; slot <= LevelMask; ++slot)
+            {
+                if (!(branch->bitmap & (uint32_t(1) << slot)))
+                {
+                    continue;
+                }
+                Node* child = branch->Children()[position++];
+                if (!fromStart && slot < handSlot)
+                {
+                    continue;
+                }
+                if (!Visit(child, shift + BitsPerLevel, fromStart || slot > handSlot))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    // Bytes a string holds outside of its object.
+    size_t HeapBytes(const std::string& string)
+    {
+        static const size_t InlineCapacity = std::string().capacity();
+        return string.capacity() > InlineCapacity ? string.capacity() + 1 : 0;
+    }
+
+    void Measure(Node* node, MemoryUsage& usage)
+    {
+        if (node->type == NodeType::Leaf)
+        {
+            const Leaf* leaf = static_cast<Leaf*>(node);
+            const size_t payload = leaf->key.size() + leaf->value.size();
+            ++usage.keyCount;
+            usage.payloadBytes += payload;
+            usage.entryOverheadBytes += sizeof(Leaf) + HeapBytes(leaf->key) + HeapBytes(leaf->value) - payload;
+            return;
+        }
+
+        Array* array = static_cast<Array*>(node);
+        usage.indexBytes += sizeof(Array) + array->count * sizeof(Node*);
+        for (uint32_t i = 0; i < array->count; ++i)
+        {
+            Measure(array->Children()[i], usage);
+        }
+    }
+}
+
+PersistentMap::PersistentMap() :
+    root(nullptr), size(0), payloadBytes(0)
+{
+}
+
+PersistentMap::PersistentMap(const PersistentMap& other) :
+    root(hamt::Retain(other.root)), size(other.size), payloadBytes(other.payloadBytes)
+{
+}
+
+PersistentMap::PersistentMap(PersistentMap&& other) noexcept :
+    root(other.root), size(other.size), payloadBytes(other.payloadBytes)
+{
+    other.root = nullptr;
+    other.size = 0;
+    other.payloadBytes = 0;
+}
+
+PersistentMap::~PersistentMap()
+{
+    hamt::Release(root);
+}
+
+PersistentMap& PersistentMap::operator=(PersistentMap other) noexcept
+{
+    std::swap(root, other.root);
+    std::swap(size, other.size);
+    std::swap(payloadBytes, other.payloadBytes);
+    return *this;
+}
+
+size_t PersistentMap::Hash(std::string_view key)
+{
+    return std::hash<std::string_view>()(key);
+}
+
+const std::string* PersistentMap::Find(std::string_view key, size_t hash, uint64_t& expiresAt) const
+{
+    hamt::Node* node = root;
+    unsigned shift = 0;
+
+    while (node)
+    {
+        switch (node->type)
+        {
+        case hamt::NodeType::Leaf:
+        {
+            const hamt::Leaf* leaf = static_cast<hamt::Leaf*>(node);
+            if (leaf->hash != hash || leaf->key != key)
+            {
+                return nullptr;
+            }
+            hamt::MarkReferenced(leaf);
+            expiresAt = leaf->expiresAt;
+            return &leaf->value;
+        }
+        case hamt::NodeType::Collision:
+        {
+            hamt::Array* collision = static_cast<hamt::Array*>(node);
+            for (uint32_t i = 0; i < collision->count; ++i)
+            {
+                const hamt::Leaf* leaf = static_cast<hamt::Leaf*>(collision->Children()[i]);
+                if (leaf->hash == hash && leaf->key == key)
+                {
+                    hamt::MarkReferenced(leaf);
+                    expiresAt = leaf->expiresAt;
+                    return &leaf->value;
+                }
+            }
+            return nullptr;
+        }
+        case hamt::NodeType::Branch:
+        {
+            hamt::Array* branch = static_cast<hamt::Array*>(node);
+            const uint32_t bit = hamt::SlotBit(hash, shift);
+            if (!(branch->bitmap & bit))
+            {
+                return nullptr;
+            }
+            node = branch->Children()[hamt::SlotPosition(branch->bitmap, bit)];
+            shift += hamt::BitsPerLevel;
+            break;
+        }
+        }
+    }
+
+    return nullptr;
+}
+
+void PersistentMap::Set(std::string_view key, std::string_view value, size_t hash, uint64_t expiresAt)
+{
+    bool added = false;
+    size_t oldPayload = 0;
+    hamt::Node* newRoot = hamt::Assign(root, true, 0, hash, key, value, expiresAt, added, oldPayload);
+    if (newRoot != root)
+    {
+        hamt::Release(root);
+        root = newRoot;
+    }
+    size += added ? 1 : 0;
+    payloadBytes += key.size() + value.size() - oldPayload;
+}
+
+bool PersistentMap::Erase(std::string_view key, size_t hash)
+{
+    bool removed = false;
+    size_t oldPayload = 0;
+    hamt::Node* newRoot = hamt::Remove(root, true, 0, hash, key, removed, oldPayload);
+    if (newRoot != root)
+    {
+        hamt::Release(root);
+        root = newRoot;
+    }
+    size -= removed ? 1 : 0;
+    payloadBytes -= oldPayload;
+    return removed;
+}
+
+size_t PersistentMap::Bytes() const
+{
+    return payloadBytes + size * hamt::EntryOverheadBytes;
+}
+
+void PersistentMap::Sweep(size_t& hand, size_t victimCount, std::vector<std::string>& victims) const
+{
+    if (!root)
+    {
+        return;
+    }
+
+    // Every key is passed at most twice: once to clear its bit and once to
+    // take it.
+    hamt::Sweeper sweeper { hand, 2 * size, victims.size() + victimCount, victims };
+    // The first pass starts at the hand, the next ones at the first key.
+    bool fromStart = false;
+    while (sweeper.Visit(root, 0, fromStart))
+    {
+        fromStart = true;
+    }
+}
+
+void PersistentMap::ForEach(const Visitor& visitor) const
+{
+    if (root)
+    {
+        hamt::Visit(root, visitor);
+    }
+}
+
+MemoryUsage PersistentMap::Memory() const
+{
+    MemoryUsage result;
+    if (root)
+    {
+        hamt::Measure(root, result);
+    }
+    return result;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "MemoryUsage.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace hamt
+{
+    struct Node;
+}
+
+// Persistent hash array mapped trie from string keys to string values, each
+// with an expiration time that the map stores but doesn't interpret.
+// Lookups mark a key as recently used with a relaxed atomic bit for Sweep().
+//
+// Copying a map takes constant time: the copy shares every node with the
+// original. A change copies only the nodes on the path to the changed key
+// that are still shared with another copy, so a copy kept for a snapshot is
+// a consistent point-in-time view while the original keeps changing.
+// A map object isn't thread safe, but copies of one map can be read and
+// destroyed from different threads.
+class PersistentMap
+{
+public:
+    using Visitor = std::function<void(const std::string& key, const std::string& value, uint64_t expiresAt)>;
+
+    PersistentMap();
+    PersistentMap(const PersistentMap& other);
+    PersistentMap(PersistentMap&& other) noexcept;
+    ~PersistentMap();
+
+    PersistentMap& operator=(PersistentMap other) noexcept;
+
+    static size_t Hash(std::string_view key);
+
+    // Returns nullptr if there is no such key. The pointer stays valid until
+    // the map is changed. Marks the key as used, which is safe from several
+    // readers at once.
+    const std::string* Find(std::string_view key, size_t hash, uint64_t& expiresAt) const;
+    void Set(std::string_view key, std::string_view value, size_t hash, uint64_t expiresAt = 0);
+    bool Erase(std::string_view key, size_t hash);
+
+    size_t Size() const { return size; }
+    // Estimated bytes of the keys, the values and their nodes, kept up to
+    // date by every change.
+    size_t Bytes() const;
+    void ForEach(const Visitor& visitor) const;
+    // Moves a CLOCK hand over the keys in trie order, starting after 'hand':
+    // a key used since the hand last passed it loses its mark, any other one
+    // is appended to 'victims'. Stops after 'victimCount' victims or once
+    // every key has been passed twice. Only the marks change, so a map that
+    // readers share may be swept.
+    void Sweep(size_t& hand, size_t victimCount, std::vector<std::string>& victims) const;
+    // Walks every node, so it takes time proportional to the size.
+    MemoryUsage Memory() const;
+private:
+    hamt::Node* root;
+    size_t size;
+    // Key and value bytes of every pair.
+    size_t payloadBytes;
+};
@@ -0,0 +1,304 @@
+#include "PollServer.h"
+
+#include "Session.h"
+
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+class PollServer::Worker
+{
+public:
+    explicit Worker(Server& server);
+    ~Worker();
+
+    void Run();
+    // Both may be called from any thread.
+    void Add(boost::asio::generic::stream_protocol::socket socket);
+    void Stop();
+
+    size_t ConnectionCount() const { return connectionCount.load(std::memory_order_relaxed); }
+private:
+    struct Connection
+    {
+        Connection(Server& server, boost::asio::generic::stream_protocol::socket&& socket) :
+            socket(std::move(socket)), session(server)
+        {
+        }
+
+        boost::asio::generic::stream_protocol::socket socket;
+        Session session;
+        // Responses wait for their writes to reach the disk; the socket
+        // isn't polled meanwhile.
+        bool syncing = false;
+    };
+
+    Server& server;
+    int wakeFd;
+    std::atomic_bool stopping;
+    std::atomic<size_t> connectionCount;
+
+    std::mutex incomingMutex;
+    std::vector<boost::asio::generic::stream_protocol::socket> incoming;
+    // Connections whose sync finished, and whether it succeeded; guarded by
+    // incomingMutex too.
+    std::vector<std::pair<Connection*, bool>> synced;
+
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::vector<pollfd> pollFds;
+
+    void Wake();
+    void TakeIncoming();
+    void TakeSynced();
+    // Returns false when the connection is finished.
+    bool Serve(Connection& connection, short events, short readyEvents);
+    bool Send(Connection& connection);
+    void Drop(size_t index);
+};
+
+PollServer::Worker::Worker(Server& server) :
+    server(server), wakeFd(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)), stopping(false), connectionCount(0)
+{
+    if (wakeFd < 0)
+    {
+        throw std::runtime_error(std::string("Can't create an eventfd: ") + std::strerror(errno));
+    }
+}
+
+PollServer::Worker::~Worker()
+{
+    connections.clear();
+    ::close(wakeFd);
+}
+
+void PollServer::Worker::Run()
+{
+    while (!stopping)
+    {
+        pollFds.resize(connections.size() + 1);
+        pollFds[0] = pollfd {wakeFd, POLLIN, 0};
+        for (size_t i = 0; i < connections.size(); ++i)
+        {
+            Connection& connection = *connections[i];
+            pollFds[i + 1] = pollfd {connection.syncing ? -1 : connection.socket.native_handle(),
+                                     short(connection.session.HasOutput() ? POLLOUT : POLLIN), 0};
+        }
+
+        if (::poll(pollFds.data(), pollFds.size(), -1) == -1)
+        {
+            if (errno != EINTR)
+            {
+                BOOST_LOG_TRIVIAL(warning) << "error while polling: " << errno;
+            }
+            continue;
+        }
+
+        // Backwards, so dropping a connection only moves one already served.
+        for (size_t i = connections.size(); i-- > 0;)
+        {
+            if (!Serve(*connections[i], pollFds[i + 1].events, pollFds[i + 1].revents))
+            {
+                Drop(i);
+            }
+        }
+
+        if (pollFds[0].revents & POLLIN)
+        {
+            uint64_t count = 0;
+            if (::read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            {
+                BOOST_LOG_TRIVIAL(warning) << "error while reading an eventfd: " << errno;
+            }
+            TakeIncoming();
+            TakeSynced();
+        }
+    }
+}
+
+void PollServer::Worker::Add(boost::asio::generic::stream_protocol::socket socket)
+{
+    connectionCount.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(incomingMutex);
+        incoming.push_back(std::move(socket));
+    }
+    Wake();
+}
+
+void PollServer::Worker::Stop()
+{
+    stopping = true;
+    Wake();
+}
+
+void PollServer::Worker::Wake()
+{
+    const uint64_t one = 1;
+    if (::write(wakeFd, &one, sizeof(one)) != sizeof(one))
+    {
+        BOOST_LOG_TRIVIAL(error) << "Can't wake a poll worker: " << std::strerror(errno);
+    }
+}
+
+void PollServer::Worker::Drop(size_t index)
+{
+    std::swap(connections[index], connections.back());
+    connections.pop_back();
+    connectionCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void PollServer::Worker::TakeIncoming()
+{
+    std::vector<boost::asio::generic::stream_protocol::socket> sockets;
+    {
+        std::lock_guard<std::mutex> lock(incomingMutex);
+        sockets.swap(incoming);
+    }
+    for (auto& socket: sockets)
+    {
+        socket.non_blocking(true);
+        connections.push_back(std::make_unique<Connection>(server, std::move(socket)));
+    }
+}
+
+void PollServer::Worker::TakeSynced()
+{
+    std::vector<std::pair<Connection*, bool>> finished;
+    {
+        std::lock_guard<std::mutex> lock(incomingMutex);
+        finished.swap(synced);
+    }
+    for (const auto& [connection, durable]: finished)
+    {
+        connection->syncing = false;
+        if (durable && Send(*connection))
+        {
+            continue;
+        }
+        const auto position = std::find_if(connections.begin(), connections.end(),
+            [connection = connection](const std::unique_ptr<Connection>& candidate)
+            {
+                return candidate.get() == connection;
+            });
+        Drop(position - connections.begin());
+    }
+}
+
+bool PollServer::Worker::Serve(Connection& connection, short events, short readyEvents)
+{
+    if (!(readyEvents & (events | POLLHUP | POLLERR)))
+    {
+        return true;
+    }
+
+    boost::system::error_code error;
+    Session& session = connection.session;
+    if (!session.HasOutput())
+    {
+        const size_t received = connection.socket.read_some(session.Input().Prepare(), error);
+        if (error == boost::asio::error::would_block)
+        {
+            return true;
+        }
+        if (error == boost::asio::error::eof)
+        {
+            BOOST_LOG_TRIVIAL(trace) << "Reading data: " << error.message();
+            return false;
+        }
+        if (error)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Error reading data: " << error.message();
+            return false;
+        }
+        session.Input().Commit(received);
+        if (!session.Process())
+        {
+            if (session.HandOverRequested())
+            {
+                const int fd = connection.socket.release(error);
+                if (!error)
+                {
+                    session.HandOver(fd);
+                }
+            }
+            return false;
+        }
+        if (session.SyncPending())
+        {
+            // Called from the server's sync thread.
+            connection.syncing = true;
+            session.WhenDurable([this, &connection](bool durable)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(incomingMutex);
+                        synced.emplace_back(&connection, durable);
+                    }
+                    Wake();
+                });
+            return true;
+        }
+        if (!session.HasOutput())
+        {
+            return true;
+        }
+    }
+    return Send(connection);
+}
+
+bool PollServer::Worker::Send(Connection& connection)
+{
+    // One gathered write for all queued responses, tried at once as the
+    // socket can usually take them; the rest waits for POLLOUT.
+    boost::system::error_code error;
+    const size_t sent = connection.socket.write_some(connection.session.Output(), error);
+    if (error && error != boost::asio::error::would_block)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Error writing data: " << error.message();
+        return false;
+    }
+    connection.session.ConsumeOutput(sent);
+    return true;
+}
+
+PollServer::PollServer(Server& server, size_t threadCount)
+{
+    for (size_t i = 0; i < std::max<size_t>(threadCount, 1); ++i)
+    {
+        workers.push_back(std::make_unique<Worker>(server));
+    }
+    for (auto& worker: workers)
+    {
+        threads.emplace_back(&Worker::Run, worker.get());
+    }
+}
+
+PollServer::~PollServer()
+{
+    for (auto& worker: workers)
+    {
+        worker->Stop();
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    BOOST_LOG_TRIVIAL(trace) << "Poll worker threads are joined";
+}
+
+void PollServer::Add(boost::asio::generic::stream_protocol::socket socket)
+{
+    const auto least = std::min_element(workers.begin(), workers.end(),
+        [](const std::unique_ptr<Worker>& left, const std::unique_ptr<Worker>& right)
+        {
+            return left->ConnectionCount() < right->ConnectionCount();
+        });
+    (*least)->Add(std::move(socket));
+}
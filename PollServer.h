@@ -0,0 +1,33 @@
+#pragma once
+
+#include <boost/asio/generic/stream_protocol.hpp>
+#include <memory>
+#include <thread>
+#include <vector>
+
+class Server;
+
+// Serves connections of the threads mode with a fixed pool of threads, each
+// polling the sockets of the connections handed to it, so the number of
+// threads doesn't grow with the number of connections. A finished connection
+// is dropped at once by the thread serving it.
+class PollServer
+{
+public:
+    // Throws std::runtime_error if a worker can't be set up.
+    PollServer(Server& server, size_t threadCount);
+    // Stops the workers and closes their connections.
+    ~PollServer();
+
+    PollServer(const PollServer&) = delete;
+    PollServer& operator=(const PollServer&) = delete;
+
+    // Hands an accepted TCP or Unix domain connection to the worker serving
+    // the fewest.
+    void Add(boost::asio::generic::stream_protocol::socket socket);
+private:
+    class Worker;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+};
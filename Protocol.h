@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Wire format details shared by the server and the client.
+
+// "$proto framed" switches a connection to framed responses, "$proto text"
+// switches it back. Text is the default so old clients keep working.
+inline constexpr std::string_view ProtocolText = "text";
+inline constexpr std::string_view ProtocolFramed = "framed";
+
+// "$stats" reports server statistics as "name value" lines, "$stats prometheus"
+// in the Prometheus text format. Both are sent as one value.
+inline constexpr std::string_view StatsPrometheus = "prometheus";
+
+// "$set key=value ex=<seconds>" makes the key expire after that many seconds;
+// "$expire <key> <seconds>" does the same for a key that is already there.
+inline constexpr std::string_view SetExpiresIn = "ex=";
+
+// In the framed mode every command line gets exactly one response:
+//     VALUE <length>\n<length bytes>\n     $get found the key
+//     NOT_FOUND\n                          $get didn't find the key
+//     OK\n                                 the command succeeded
+//     ERROR <reason>\n                     the command was rejected
+//     VALUES <count>\n                     $mget, followed by <count> VALUE
+//                                          or NOT_FOUND responses in key order
+inline constexpr std::string_view FramedValue = "VALUE ";
+inline constexpr std::string_view FramedValues = "VALUES ";
+inline constexpr std::string_view FramedNotFound = "NOT_FOUND\n";
+inline constexpr std::string_view FramedOk = "OK\n";
+inline constexpr std::string_view FramedError = "ERROR ";
+inline constexpr char FramedEol = '\n';
+
+// A connection whose first byte is BinaryMagic uses the binary protocol for
+// its whole life. Text commands always start with '$', so the byte can't be
+// mistaken for one.
+//
+// Every request and response is a BinaryHeader followed by the key and the
+// value bytes, so both can be used in place without scanning. Fields are
+// little-endian. A response has no key and echoes the request id.
+inline constexpr unsigned char BinaryMagic = 0xB7;
+
+enum class BinaryOpcode : uint8_t
+{
+    Get = 1,
+    Set = 2
+};
+
+enum class BinaryStatus : uint8_t
+{
+    Ok = 0,
+    NotFound = 1,
+    Error = 2
+};
+
+struct BinaryHeader
+{
+    // BinaryOpcode in a request, BinaryStatus in a response.
+    uint8_t code;
+    uint8_t reserved;
+    uint16_t keyLength;
+    uint32_t valueLength;
+    uint32_t requestId;
+};
+
+static_assert(sizeof(BinaryHeader) == 12, "binary header must have no padding");
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "binary header is sent in host byte order");
+
+// Bigger values are rejected and the connection is closed.
+inline constexpr uint32_t MaxBinaryValueLength = 64 * 1024 * 1024;
+// Longer text lines are rejected the same way; a '$set' of the longest binary
+// key and value fits.
+inline constexpr size_t MaxTextLineLength = MaxBinaryValueLength + 64 * 1024;
+
+// "$replicate" turns the connection into a replication stream: from then on
+// the server only sends frames, each a ReplicationFrameHeader followed by
+// 'length' bytes. The replica gets every key and then every change as
+// Records frames of whole write-ahead log records (see WriteAheadLog.h).
+// A Heartbeat frame carries the server's time (u64 milliseconds, see
+// NowMilliseconds()) and follows once every change made before that time
+// has been sent, at least every ReplicationHeartbeatMs.
+inline constexpr std::string_view ReplicateCommand = "$replicate";
+inline constexpr uint32_t ReplicationHeartbeatMs = 100;
+
+enum class ReplicationFrame : uint8_t
+{
+    Records = 1,
+    Heartbeat = 2
+};
+
+struct ReplicationFrameHeader
+{
+    // ReplicationFrame.
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint32_t length;
+};
+
+static_assert(sizeof(ReplicationFrameHeader) == 8, "replication frame header must have no padding");
+
+// "$shm <name>" moves the connection's commands to a SharedMemoryChannel the
+// client created as the POSIX shared memory object <name>, which must start
+// with SharedMemoryPrefix. Only a connection over the Unix domain socket from
+// a process of the server's user may ask, for an object that user owns. The
+// server answers on the socket with "OK\n" once it has mapped the object, or
+// "ERROR <reason>\n" before closing, whatever the response format. After "OK\n" requests and responses go through the
+// channel as they would through the socket, starting with the choice of the
+// protocol, and the socket stays idle until closing either end ends both.
+inline constexpr std::string_view SharedMemoryCommand = "$shm";
+inline constexpr std::string_view SharedMemoryPrefix = "/kv-shm-";
@@ -0,0 +1,360 @@
+#include "Replication.h"
+
+#include "Protocol.h"
+#include "ServerMetrics.h"
+#include "Storage.h"
+#include "StorageEngine.h"
+#include "TimerWheel.h"
+#include "WriteAheadLog.h"
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    void AppendFrame(std::string& out, ReplicationFrame kind, std::string_view payload)
+    {
+        ReplicationFrameHeader header {};
+        header.kind = static_cast<uint8_t>(kind);
+        header.length = payload.size();
+        out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append(payload);
+    }
+
+    // Returns false if the peer is gone.
+    bool SendAll(int fd, std::string_view data)
+    {
+        while (!data.empty())
+        {
+            const ssize_t sent = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (sent < 0)
+            {
+                BOOST_LOG_TRIVIAL(trace) << "Sending to a replica: " << std::strerror(errno);
+                return false;
+            }
+            data.remove_prefix(sent);
+        }
+        return true;
+    }
+}
+
+ReplicationSource::ReplicationSource(const StorageEngine& engine) :
+    engine(engine), next(nullptr), replicaCount(0), backlogStart(0), threadCount(0), stopping(false)
+{
+}
+
+ReplicationSource::~ReplicationSource()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    for (Replica* replica: replicas)
+    {
+        ::shutdown(replica->fd, SHUT_RDWR);
+    }
+    changed.notify_all();
+    finished.wait(lock, [this]()
+        {
+            return threadCount == 0;
+        });
+}
+
+void ReplicationSource::Append(std::string_view key, std::string_view value, uint64_t expiresAt)
+{
+    if (next)
+    {
+        next->Append(key, value, expiresAt);
+    }
+
+    // The change is applied already. Pairs with the fence in Serve(): either
+    // the change is in a new replica's snapshot or the replica is counted.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (replicaCount.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    WriteAheadLog::EncodeRecord(backlog, key, value, expiresAt);
+    if (backlog.size() > MaxBacklogBytes)
+    {
+        TrimLocked();
+    }
+    changed.notify_all();
+}
+
+void ReplicationSource::AppendBatch(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)
+{
+    if (next)
+    {
+        next->AppendBatch(keysValues);
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (replicaCount.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    WriteAheadLog::EncodeBatch(backlog, keysValues);
+    if (backlog.size() > MaxBacklogBytes)
+    {
+        TrimLocked();
+    }
+    changed.notify_all();
+}
+
+void ReplicationSource::AddReplica(int fd)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping)
+        {
+            ::close(fd);
+            return;
+        }
+        ++threadCount;
+    }
+    std::thread(&ReplicationSource::Serve, this, fd).detach();
+}
+
+void ReplicationSource::Serve(int fd)
+{
+    // Transports hand their sockets over in non-blocking mode.
+    const int flags = ::fcntl(fd, F_GETFL);
+    if (flags != -1)
+    {
+        ::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    Replica replica {fd, 0, false};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        replica.position = backlogStart + backlog.size();
+        replicas.push_back(&replica);
+        replicaCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    BOOST_LOG_TRIVIAL(info) << "Replica connected, " << ReplicaCount() << " replicas now.";
+
+    // Changes in the backlog may be in the snapshot too; applying them again
+    // is harmless, as with compacting the write-ahead log. ForEach() visits
+    // copies of the shards, so frames are sent as they fill without holding
+    // up writers, and the snapshot is never held in memory whole.
+    bool connected = true;
+    std::string frames;
+    std::string records;
+    const uint64_t now = NowMilliseconds();
+    engine.ForEach([fd, &connected, &frames, &records, now](const std::string& key, const std::string& value,
+                                                            uint64_t expiresAt)
+        {
+            if (!connected || StorageEngine::IsExpired(expiresAt, now))
+            {
+                return;
+            }
+            WriteAheadLog::EncodeRecord(records, key, value, expiresAt);
+            if (records.size() >= SnapshotFrameBytes)
+            {
+                frames.clear();
+                AppendFrame(frames, ReplicationFrame::Records, records);
+                records.clear();
+                connected = SendAll(fd, frames);
+            }
+        });
+    if (connected && !records.empty())
+    {
+        frames.clear();
+        AppendFrame(frames, ReplicationFrame::Records, records);
+        connected = SendAll(fd, frames);
+    }
+
+    while (connected)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_for(lock, std::chrono::milliseconds(ReplicationHeartbeatMs), [this, &replica]()
+            {
+                return stopping || replica.dropped || backlogStart + backlog.size() > replica.position;
+            });
+        if (stopping || replica.dropped)
+        {
+            break;
+        }
+
+        // Every change appended so far goes out before this time does.
+        const uint64_t time = NowMilliseconds();
+        records.assign(backlog, replica.position - backlogStart);
+        replica.position = backlogStart + backlog.size();
+        TrimLocked();
+        lock.unlock();
+
+        frames.clear();
+        if (!records.empty())
+        {
+            AppendFrame(frames, ReplicationFrame::Records, records);
+        }
+        AppendFrame(frames, ReplicationFrame::Heartbeat,
+                    std::string_view(reinterpret_cast<const char*>(&time), sizeof(time)));
+        connected = SendAll(fd, frames);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    replicas.remove(&replica);
+    replicaCount.fetch_sub(1, std::memory_order_relaxed);
+    TrimLocked();
+    ::close(fd);
+    BOOST_LOG_TRIVIAL(info) << "Replica disconnected, " << ReplicaCount() << " replicas now.";
+
+    --threadCount;
+    finished.notify_all();
+}
+
+void ReplicationSource::TrimLocked()
+{
+    const uint64_t end = backlogStart + backlog.size();
+    uint64_t sent = end;
+    for (Replica* replica: replicas)
+    {
+        if (replica->dropped)
+        {
+            continue;
+        }
+        if (end - replica->position > MaxBacklogBytes)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "Replica is " << end - replica->position
+                                       << " bytes behind. Replica is disconnected.";
+            replica->dropped = true;
+            // Unblocks a send in progress.
+            ::shutdown(replica->fd, SHUT_RDWR);
+            continue;
+        }
+        sent = std::min(sent, replica->position);
+    }
+
+    backlog.erase(0, sent - backlogStart);
+    backlogStart = sent;
+}
+
+ReplicaClient::ReplicaClient(const std::string& host, const std::string& port, Storage& storage,
+                             ServerMetrics& metrics) :
+    host(host), port(port), storage(storage), metrics(metrics), socketFd(-1), stopping(false)
+{
+    metrics.ReplicaConnected(false);
+    thread = std::thread(&ReplicaClient::Run, this);
+}
+
+ReplicaClient::~ReplicaClient()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        if (socketFd != -1)
+        {
+            ::shutdown(socketFd, SHUT_RDWR);
+        }
+    }
+    stopped.notify_all();
+    thread.join();
+}
+
+void ReplicaClient::Run()
+{
+    while (true)
+    {
+        boost::asio::ip::tcp::socket socket(ioContext);
+        try
+        {
+            boost::asio::ip::tcp::resolver resolver(ioContext);
+            boost::asio::connect(socket, resolver.resolve(host, port));
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping)
+                {
+                    return;
+                }
+                socketFd = socket.native_handle();
+            }
+
+            const std::string request = std::string(ReplicateCommand) + "\n";
+            boost::asio::write(socket, boost::asio::buffer(request));
+            BOOST_LOG_TRIVIAL(info) << "Replicating " << host << ":" << port << ".";
+            metrics.ReplicaConnected(true);
+            Stream(socket);
+        }
+        catch (std::exception& e)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stopping)
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Replicating " << host << ":" << port << ": " << e.what()
+                                           << ". Reconnecting in " << ReconnectPeriod.count() << " s.";
+            }
+        }
+        metrics.ReplicaConnected(false);
+
+        // The socket is closed only after it can't be shut down any more.
+        std::unique_lock<std::mutex> lock(mutex);
+        socketFd = -1;
+        if (stopped.wait_for(lock, ReconnectPeriod, [this]()
+            {
+                return stopping;
+            }))
+        {
+            return;
+        }
+    }
+}
+
+void ReplicaClient::Stream(boost::asio::ip::tcp::socket& socket)
+{
+    std::string payload;
+    while (true)
+    {
+        ReplicationFrameHeader header;
+        boost::asio::read(socket, boost::asio::buffer(&header, sizeof(header)));
+        payload.resize(header.length);
+        boost::asio::read(socket, boost::asio::buffer(payload));
+
+        const auto kind = static_cast<ReplicationFrame>(header.kind);
+        if (kind == ReplicationFrame::Records)
+        {
+            size_t count = 0;
+            // A batch is applied whole, so ReadMany sees all or none of it
+            // here as on the primary.
+            const size_t applied = WriteAheadLog::ReplayRecords(payload,
+                [this](std::string_view key, std::string_view value, uint64_t expiresAt)
+                {
+                    storage.WriteReplicated(key, value, expiresAt);
+                }, count,
+                [this](const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)
+                {
+                    storage.WriteReplicatedMany(keysValues);
+                });
+            if (applied != payload.size())
+            {
+                throw std::runtime_error("damaged records from the primary");
+            }
+        }
+        else if (kind == ReplicationFrame::Heartbeat && payload.size() == sizeof(uint64_t))
+        {
+            uint64_t time;
+            std::memcpy(&time, payload.data(), sizeof(time));
+            metrics.ReplicatedUntil(time);
+        }
+        else
+        {
+            throw std::runtime_error("unknown frame from the primary");
+        }
+    }
+}
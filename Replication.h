@@ -0,0 +1,116 @@
+#pragma once
+
+#include "ChangeLog.h"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class ServerMetrics;
+class Storage;
+class StorageEngine;
+
+// Primary side of replication, see ReplicateCommand in Protocol.h.
+//
+// Sits between a storage engine and its write-ahead log: every change goes
+// on to the next log and, while replicas are connected, to a backlog that a
+// thread per replica sends from. A replica too slow to keep the backlog
+// within MaxBacklogBytes is disconnected and has to start over.
+class ReplicationSource : public ChangeLog
+{
+public:
+    explicit ReplicationSource(const StorageEngine& engine);
+    // Disconnects the replicas and waits for their threads.
+    ~ReplicationSource();
+
+    ReplicationSource(const ReplicationSource&) = delete;
+    ReplicationSource& operator=(const ReplicationSource&) = delete;
+
+    // Not thread safe; set before changes are made.
+    void SetNext(ChangeLog* log) { next = log; }
+
+    void Append(std::string_view key, std::string_view value, uint64_t expiresAt) override;
+    void AppendBatch(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues) override;
+
+    // Takes the connected socket 'fd' over and streams a snapshot and then
+    // every change to it from a thread of its own until it disconnects.
+    void AddReplica(int fd);
+
+    size_t ReplicaCount() const { return replicaCount.load(std::memory_order_relaxed); }
+private:
+    static const size_t MaxBacklogBytes = 64 * 1024 * 1024;
+    // Snapshot records sent per frame.
+    static const size_t SnapshotFrameBytes = 1024 * 1024;
+
+    struct Replica
+    {
+        int fd;
+        // Stream offset of the first backlog byte not sent yet.
+        uint64_t position;
+        bool dropped;
+    };
+
+    const StorageEngine& engine;
+    ChangeLog* next;
+    std::atomic<size_t> replicaCount;
+
+    std::mutex mutex;
+    // Signalled when the backlog grows or the source stops.
+    std::condition_variable changed;
+    // Signalled when a replica thread ends.
+    std::condition_variable finished;
+    std::string backlog;
+    // Stream offset of the first backlog byte.
+    uint64_t backlogStart;
+    std::list<Replica*> replicas;
+    size_t threadCount;
+    bool stopping;
+
+    void Serve(int fd);
+    // Drops replicas beyond MaxBacklogBytes and what every replica has sent.
+    void TrimLocked();
+};
+
+// Replica side: keeps a connection to the primary, applies the snapshot and
+// the changes it streams to the storage and reconnects after a failure,
+// taking a fresh snapshot. Keys the primary erased meanwhile stay until they
+// are written again.
+class ReplicaClient
+{
+public:
+    ReplicaClient(const std::string& host, const std::string& port, Storage& storage, ServerMetrics& metrics);
+    // Disconnects and waits for the thread.
+    ~ReplicaClient();
+
+    ReplicaClient(const ReplicaClient&) = delete;
+    ReplicaClient& operator=(const ReplicaClient&) = delete;
+private:
+    const std::chrono::seconds ReconnectPeriod = std::chrono::seconds(1);
+
+    const std::string host;
+    const std::string port;
+    Storage& storage;
+    ServerMetrics& metrics;
+
+    boost::asio::io_context ioContext;
+    std::mutex mutex;
+    std::condition_variable stopped;
+    // Open while connected; shut down from another thread to stop.
+    int socketFd;
+    bool stopping;
+    std::thread thread;
+
+    void Run();
+    // Returns when the connection fails.
+    void Stream(boost::asio::ip::tcp::socket& socket);
+};
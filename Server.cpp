@@ -1,244 +1,923 @@
 
 #include "Server.h"
 
+#include "CommandParser.h"
+#include "PollServer.h"
+#include "Protocol.h"
+#include "Replication.h"
+#include "Session.h"
+#include "SharedMemoryServer.h"
 #include "Storage.h"
+#include "UringServer.h"
 
-#include <boost/algorithm/string.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/system/system_error.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 namespace
 {
     const char CommandPrefix = '$';
-    const char CommandDelimiters[] = " \t\n\r";
-    const char KeyValueDelimiter[] = "=";
-    const char CommandEol = '\n';
-    const std::string CommandGet = std::string(1, CommandPrefix) + "get";
-    const std::string CommandSet = std::string(1, CommandPrefix) + "set";
+    // Sent to a connection over the limit before it is closed.
+    const std::string BusyResponse = std::string(FramedError) + "too many connections" + FramedEol;
+    // Accepting pauses this long once descriptors or memory run out; trying
+    // again at once would only spin until a connection ends.
+    const std::chrono::milliseconds AcceptPause(100);
+    // Descriptors kept for everything but connections: listening sockets,
+    // the log, the config file, replicas and the like.
+    const rlim_t ReservedDescriptors = 64;
+    // Longer times to live are surely mistakes.
+    const uint64_t MaxTtlSeconds = 100ull * 365 * 24 * 60 * 60;
+
+    // A whole number of seconds in [1, MaxTtlSeconds].
+    bool ParseTtl(std::string_view text, std::chrono::seconds& ttl)
+    {
+        uint64_t seconds = 0;
+        const auto [end, code] = std::from_chars(text.data(), text.data() + text.size(), seconds);
+        if (code != std::errc() || end != text.data() + text.size() || seconds == 0 || seconds > MaxTtlSeconds)
+        {
+            return false;
+        }
+        ttl = std::chrono::seconds(seconds);
+        return true;
+    }
+
+    // Whether '$set' has an expiration time; any other second argument is
+    // an extra one, ignored with a warning.
+    bool SetExpires(std::string_view arguments)
+    {
+        std::string_view option;
+        NextArgument(arguments, option);
+        return NextArgument(arguments, option) && option.substr(0, SetExpiresIn.size()) == SetExpiresIn;
+    }
+
+    std::string FormatValue(ResponseFormat format, bool found, std::string&& value)
+    {
+        if (format == ResponseFormat::Text)
+        {
+            return std::move(value);
+        }
+        if (!found)
+        {
+            return std::string(FramedNotFound);
+        }
+
+        std::string result(FramedValue);
+        result += std::to_string(value.size());
+        result += FramedEol;
+        result += value;
+        result += FramedEol;
+        return result;
+    }
+
+    // Text format has a line per key, empty for a missing one.
+    std::string FormatValues(ResponseFormat format, std::vector<std::optional<std::string>>&& values)
+    {
+        std::string result;
+        if (format == ResponseFormat::Framed)
+        {
+            result += FramedValues;
+            result += std::to_string(values.size());
+            result += FramedEol;
+        }
+
+        for (auto& value: values)
+        {
+            const bool found = value.has_value();
+            result += FormatValue(format, found, found ? std::move(*value) : std::string());
+            if (format == ResponseFormat::Text)
+            {
+                result += FramedEol;
+            }
+        }
+        return result;
+    }
+
+    std::string FormatOk(ResponseFormat format)
+    {
+        return format == ResponseFormat::Text ? std::string() : std::string(FramedOk);
+    }
+
+    std::string FormatError(ResponseFormat format, std::string_view reason)
+    {
+        if (format == ResponseFormat::Text)
+        {
+            return std::string();
+        }
+
+        std::string result(FramedError);
+        result += reason;
+        result += FramedEol;
+        return result;
+    }
+
+    // Resident set size of the process; 0 if it's unknown.
+    size_t ResidentBytes()
+    {
+        std::ifstream statm("/proc/self/statm");
+        size_t totalPages = 0;
+        size_t residentPages = 0;
+        if (!(statm >> totalPages >> residentPages))
+        {
+            return 0;
+        }
+        return residentPages * ::sysconf(_SC_PAGESIZE);
+    }
+
+    std::string FormatMemory(const MemoryUsage& usage)
+    {
+        std::ostringstream stream;
+        stream << "keys " << usage.keyCount << "\n"
+               << "payload_bytes " << usage.payloadBytes << "\n"
+               << "entry_overhead_bytes " << usage.entryOverheadBytes << "\n"
+               << "index_bytes " << usage.indexBytes << "\n"
+               << "dead_bytes " << usage.deadBytes << "\n"
+               << "free_bytes " << usage.freeBytes << "\n"
+               << "total_bytes " << usage.TotalBytes() << "\n"
+               << "bytes_per_key " << (usage.keyCount ? usage.TotalBytes() / double(usage.keyCount) : 0.0) << "\n"
+               << "process_resident_bytes " << ResidentBytes() << "\n";
+        return stream.str();
+    }
+
+    using ReusePort = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+    // A listening socket on 'port'; several of them may share the port if
+    // 'reusePort' is set on all.
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> Listen(boost::asio::io_context& context,
+                                                           boost::asio::ip::port_type port, bool reusePort)
+    {
+        const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+        auto acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(context);
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        if (reusePort)
+        {
+            acceptor->set_option(ReusePort(true));
+        }
+        acceptor->bind(endpoint);
+        acceptor->listen();
+        return acceptor;
+    }
+
+    // Errors accept() keeps failing with until a connection ends.
+    bool IsResourceShortage(const boost::system::error_code& error)
+    {
+        return error == boost::system::errc::too_many_files_open
+               || error == boost::system::errc::too_many_files_open_in_system
+               || error == boost::system::errc::no_buffer_space
+               || error == boost::system::errc::not_enough_memory;
+    }
+
+    // Raises the soft limit of open files as far as maxConnections needs and
+    // the hard limit allows, and lowers maxConnections to what fits in it.
+    ServerOptions FitDescriptorLimit(ServerOptions options)
+    {
+        rlimit limit {};
+        if (options.maxConnections == 0 || ::getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            return options;
+        }
+
+        const rlim_t needed = options.maxConnections + ReservedDescriptors;
+        if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed)
+        {
+            const rlim_t current = limit.rlim_cur;
+            limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? needed : std::min(needed, limit.rlim_max);
+            if (::setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            {
+                limit.rlim_cur = current;
+            }
+        }
+        if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed)
+        {
+            const size_t fitting = limit.rlim_cur > ReservedDescriptors ? limit.rlim_cur - ReservedDescriptors : 1;
+            BOOST_LOG_TRIVIAL(warning) << "Only " << limit.rlim_cur << " files may be open, so at most " << fitting
+                                       << " connections are served instead of " << options.maxConnections << ".";
+            options.maxConnections = fitting;
+        }
+        return options;
+    }
+
+    // Where a new connection comes from, for the log.
+    std::string PeerOf(const boost::asio::ip::tcp::socket& socket)
+    {
+        boost::system::error_code error;
+        std::ostringstream stream;
+        stream << socket.remote_endpoint(error);
+        return stream.str();
+    }
+
+    std::string PeerOf(const boost::asio::local::stream_protocol::socket&)
+    {
+        return "the Unix socket";
+    }
+
+    void LogReadError(const boost::system::error_code& error)
+    {
+        if (error.value() == boost::system::errc::resource_unavailable_try_again
+            || error.value() == boost::asio::error::eof)
+        {
+            BOOST_LOG_TRIVIAL(trace) << "Reading data: " << error.message();
+        }
+        else
+        {
+            BOOST_LOG_TRIVIAL(error) << "Error reading data: " << error.message();
+        }
+    }
 }
 
-Server::Server(const boost::asio::ip::port_type port, Storage& storage) :
-    port(port), storage(storage), stopConnectionThreads(false), stopMonitoringThread(false),
-    stopMainThread(false)
+// A connection served by the io_context. Only one read or write is in flight
+// at a time, so handlers of a session never run concurrently.
+class Server::AsyncSession : public std::enable_shared_from_this<Server::AsyncSession>
+{
+public:
+    AsyncSession(Server& server, boost::asio::generic::stream_protocol::socket socket) :
+        socket(std::move(socket)), session(server)
+    {
+    }
+
+    void Start()
+    {
+        ReadCommands();
+    }
+private:
+    // A TCP or a Unix domain socket.
+    boost::asio::generic::stream_protocol::socket socket;
+    Session session;
+
+    void ReadCommands()
+    {
+        socket.async_read_some(session.Input().Prepare(),
+            [self = shared_from_this()](const boost::system::error_code& error, size_t received)
+            {
+                if (error)
+                {
+                    LogReadError(error);
+                    return;
+                }
+                self->session.Input().Commit(received);
+                if (!self->session.Process())
+                {
+                    self->HandOver();
+                    return;
+                }
+                if (self->session.SyncPending())
+                {
+                    self->WriteWhenDurable();
+                    return;
+                }
+                self->WriteResponses();
+            });
+    }
+
+    // The connection is dropped if the sync fails.
+    void WriteWhenDurable()
+    {
+        session.WhenDurable([self = shared_from_this()](bool durable)
+            {
+                boost::asio::post(self->socket.get_executor(), [self, durable]()
+                    {
+                        if (durable)
+                        {
+                            self->WriteResponses();
+                        }
+                    });
+            });
+    }
+
+    void HandOver()
+    {
+        if (!session.HandOverRequested())
+        {
+            return;
+        }
+        boost::system::error_code error;
+        const int fd = socket.release(error);
+        if (error)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Can't hand a connection over: " << error.message();
+            return;
+        }
+        session.HandOver(fd);
+    }
+
+    void WriteResponses()
+    {
+        if (!session.HasOutput())
+        {
+            ReadCommands();
+            return;
+        }
+
+        // Responses to everything pipelined in this read go out together.
+        boost::asio::async_write(socket, session.Output(),
+            [self = shared_from_this()](const boost::system::error_code& error, size_t sent)
+            {
+                if (error)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "Error writing data: " << error.message();
+                    return;
+                }
+                self->session.ConsumeOutput(sent);
+                self->ReadCommands();
+            });
+    }
+};
+
+Server::Server(const boost::asio::ip::port_type port, Storage& storage, const ServerOptions& options) :
+    port(port), options(FitDescriptorLimit(options)), storage(storage), activeConnections(0), stopMainThread(false),
+    stopSyncThread(false)
 {
 }
 
 
 Server::~Server()
 {
-    stopMonitoringThread = true;
-    monitoringThread.join();
-    BOOST_LOG_TRIVIAL(trace) << "Monitoring thread is joined";            
-    
-    stopConnectionThreads = true;
+    // Waiting sessions are answered before the transports they belong to go.
+    {
+        std::lock_guard<std::mutex> lock(syncMutex);
+        stopSyncThread = true;
+    }
+    syncWanted.notify_one();
+    if (syncThread.joinable())
+    {
+        syncThread.join();
+    }
 
-    std::lock_guard<std::mutex> lock(threadListMutex);
-    for (auto& thIt: connectionThreads)
+    replicaClient.reset();
+
+    if (options.mode != ServerMode::Threads)
+    {
+        uringServer.reset();
+        StopAsync();
+    }
+    else
     {
-        thIt.join();
+        stopMainThread = true;
+        mainThread.join();
+        BOOST_LOG_TRIVIAL(trace) << "Main thread is joined";
+
+        pollServer.reset();
     }
-    BOOST_LOG_TRIVIAL(trace) << "Connection threads are joined";            
+    // Transports hand connections over to it until they stop.
+    sharedMemoryServer.reset();
 
-    stopMainThread = true;
-    mainThread.join();
-    BOOST_LOG_TRIVIAL(trace) << "Main thread is joined";            
+    if (localAcceptor)
+    {
+        ::unlink(options.unixSocket.c_str());
+    }
 }
 
 void Server::Start()
 {
+    if (!options.replicaOf.empty())
+    {
+        const size_t colon = options.replicaOf.rfind(':');
+        replicaClient = std::make_unique<ReplicaClient>(options.replicaOf.substr(0, colon),
+                                                        options.replicaOf.substr(colon + 1), storage, metrics);
+    }
+    sharedMemoryServer = std::make_unique<SharedMemoryServer>(*this);
+    syncThread = std::thread(&Server::SyncLoop, this);
+
+    if (options.mode == ServerMode::Async)
+    {
+        StartAsync();
+        return;
+    }
+    if (options.mode == ServerMode::IoUring)
+    {
+        StartUring();
+        return;
+    }
+
+    pollServer = std::make_unique<PollServer>(*this, options.workerThreads);
     mainThread = std::thread(&Server::MainLoop, this);
-    monitoringThread = std::thread(&Server::MonitorThreads, this);
 }
 
-void Server::MainLoop()
+bool Server::Admit(int fd)
 {
-    boost::asio::io_context ioContext;
-    boost::asio::ip::tcp::acceptor
-        acceptor(ioContext,
-                 boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port));
+    if (activeConnections.fetch_add(1, std::memory_order_relaxed) < options.maxConnections
+        || options.maxConnections == 0)
+    {
+        return true;
+    }
+    activeConnections.fetch_sub(1, std::memory_order_relaxed);
+    metrics.ConnectionRejected();
 
-    BOOST_LOG_TRIVIAL(info) << "TCP Echo Server started. Listening on port " << port << ".";
+    BOOST_LOG_TRIVIAL(warning) << "There are " << options.maxConnections
+                               << " connections already. New connection is rejected.";
+    // Best effort, the socket is closed anyway.
+    if (::send(fd, BusyResponse.data(), BusyResponse.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "Can't tell a rejected connection: " << errno;
+    }
+    return false;
+}
 
-    while (!stopMainThread)
+void Server::WhenDurable(uint64_t position, std::function<void(bool durable)> done)
+{
     {
-        std::shared_ptr<boost::asio::ip::tcp::socket> socket =
-            std::make_shared<boost::asio::ip::tcp::socket>(ioContext);
+        std::lock_guard<std::mutex> lock(syncMutex);
+        if (!stopSyncThread)
+        {
+            syncWaiters.push_back({position, std::move(done)});
+            syncWanted.notify_one();
+            return;
+        }
+    }
+    done(false);
+}
 
-        acceptor.non_blocking(true);
-        acceptor.listen();
+void Server::SyncLoop()
+{
+    std::unique_lock<std::mutex> lock(syncMutex);
+    while (true)
+    {
+        syncWanted.wait(lock, [this]()
+            {
+                return stopSyncThread || !syncWaiters.empty();
+            });
+        if (syncWaiters.empty())
+        {
+            return;
+        }
 
-        struct pollfd pollFd {};
-        pollFd.fd = acceptor.native_handle();
-        pollFd.events = POLLIN;
+        // Sessions asking meanwhile are served by the next sync together.
+        std::vector<DurabilityWaiter> waiters;
+        waiters.swap(syncWaiters);
+        lock.unlock();
 
-        if (::poll(&pollFd, 1, pollTimeoutMs) == -1)
+        uint64_t position = 0;
+        for (const DurabilityWaiter& waiter: waiters)
         {
-            BOOST_LOG_TRIVIAL(warning) << "error while polling: " << errno;            
+            position = std::max(position, waiter.position);
         }
-        if (!(pollFd.revents & POLLIN))
+        bool durable = true;
+        try
         {
-            // No connection. Wait.
-            continue;
+            storage.Sync(position);
         }
-
-        acceptor.accept(*socket);
-
-        BOOST_LOG_TRIVIAL(info) << "New connection from: " << socket->remote_endpoint();
-
+        catch (std::exception& e)
         {
-            std::lock_guard<std::mutex> lock(threadListMutex);
-            connectionThreads.emplace_back(&Server::HandleClient, this, socket);
+            BOOST_LOG_TRIVIAL(error) << "Syncing writes: " << e.what() << ".";
+            durable = false;
         }
+        for (DurabilityWaiter& waiter: waiters)
+        {
+            waiter.done(durable);
+        }
+
+        lock.lock();
     }
 }
 
-void Server::HandleClient(std::shared_ptr<boost::asio::ip::tcp::socket> socket)
+void Server::StartUring()
 {
-    boost::system::error_code error;
-    boost::asio::streambuf buffer;
+    const size_t threadCount = std::max<size_t>(options.workerThreads, 1);
+    std::vector<int> listenFds;
+    for (size_t i = 0; i < (options.reusePort ? threadCount : 1); ++i)
+    {
+        acceptors.push_back(Listen(ioContext, port, options.reusePort));
+        listenFds.push_back(acceptors.back()->native_handle());
+    }
+    ListenLocal(ioContext);
+
+    try
+    {
+        uringServer = std::make_unique<UringServer>(*this, listenFds,
+                                                    localAcceptor ? localAcceptor->native_handle() : -1,
+                                                    threadCount);
+    }
+    catch (const std::runtime_error& error)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "io_uring is unavailable (" << error.what() << "), using the async mode.";
+        // The async mode listens again on sockets of its own contexts.
+        acceptors.clear();
+        localAcceptor.reset();
+        StartAsync();
+        return;
+    }
 
-    socket->non_blocking(true);
+    BOOST_LOG_TRIVIAL(info) << "TCP Echo Server started. Listening on port " << port
+                            << " with " << threadCount << " io_uring worker threads"
+                            << (options.reusePort ? " on sockets of their own." : ".");
+}
 
-    while (!stopConnectionThreads)
+void Server::StartAsync()
+{
+    const size_t threadCount = std::max<size_t>(options.workerThreads, 1);
+    if (options.reusePort)
     {
-        if (buffer.size() == 0)
+        // Handlers of a worker's context never run concurrently, so it needs
+        // no locking.
+        for (size_t i = 0; i < threadCount; ++i)
         {
-            struct pollfd pollFd {};
-            pollFd.fd = socket->native_handle();
-            pollFd.events = POLLIN;
+            workerContexts.push_back(std::make_unique<boost::asio::io_context>(1));
+            acceptors.push_back(Listen(*workerContexts.back(), port, true));
+        }
+    }
+    else
+    {
+        acceptors.push_back(Listen(ioContext, port, false));
+    }
+    // Local connections are few, so with sockets of their own one worker
+    // takes them all.
+    ListenLocal(options.reusePort ? *workerContexts.front() : ioContext);
 
-            if (::poll(&pollFd, 1, pollTimeoutMs) == -1)
-            {
-                BOOST_LOG_TRIVIAL(warning) << "error while polling: " << errno;
-            }
-            if (!(pollFd.revents & POLLIN))
+    BOOST_LOG_TRIVIAL(info) << "TCP Echo Server started. Listening on port " << port
+                            << " with " << threadCount << " worker threads"
+                            << (options.reusePort ? " on sockets of their own." : ".");
+
+    for (auto& acceptor: acceptors)
+    {
+        AcceptAsync(*acceptor);
+    }
+    if (localAcceptor)
+    {
+        AcceptAsync(*localAcceptor);
+    }
+
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        boost::asio::io_context& context = options.reusePort ? *workerContexts[i] : ioContext;
+        workerThreads.emplace_back([&context]()
             {
-                // No data for reading. Wait.
-                continue;
-            }
-        }
-        
-        // Read data from the client
-        boost::asio::read_until(*socket, buffer, CommandEol, error);
-        if (error)
+                context.run();
+            });
+    }
+}
+
+template <typename Acceptor>
+void Server::AcceptAsync(Acceptor& acceptor)
+{
+    // An accepted socket is bound to the acceptor's context, so with its own
+    // socket a worker serves every connection it accepts.
+    acceptor.async_accept(
+        [this, &acceptor](const boost::system::error_code& error, typename Acceptor::protocol_type::socket socket)
         {
-            if (error.value() == boost::system::errc::resource_unavailable_try_again
-                || error.value() == boost::asio::error::eof)
+            if (error)
             {
-                BOOST_LOG_TRIVIAL(trace) << "Reading data: " << error.message();
+                if (error == boost::asio::error::operation_aborted)
+                {
+                    return;
+                }
+                BOOST_LOG_TRIVIAL(warning) << "error while accepting: " << error.message();
+                if (IsResourceShortage(error))
+                {
+                    auto timer = std::make_shared<boost::asio::steady_timer>(acceptor.get_executor(),
+                                                                             AcceptPause);
+                    timer->async_wait([this, &acceptor, timer](const boost::system::error_code& timerError)
+                        {
+                            if (timerError != boost::asio::error::operation_aborted)
+                            {
+                                AcceptAsync(acceptor);
+                            }
+                        });
+                    return;
+                }
             }
-            else
+            else if (Admit(socket.native_handle()))
             {
-                BOOST_LOG_TRIVIAL(error) << "Error reading data: " << error.message();
+                BOOST_LOG_TRIVIAL(info) << "New connection from: " << PeerOf(socket);
+                std::make_shared<AsyncSession>(*this, std::move(socket))->Start();
             }
-            break;
-        }
+            AcceptAsync(acceptor);
+        });
+}
 
-        std::string command;
-        std::istream is(&buffer);
+void Server::StopAsync()
+{
+    ioContext.stop();
+    for (auto& context: workerContexts)
+    {
+        context->stop();
+    }
+    for (auto& thread: workerThreads)
+    {
+        thread.join();
+    }
+    BOOST_LOG_TRIVIAL(trace) << "Worker threads are joined";
+}
 
-        std::getline(is, command);
-        BOOST_LOG_TRIVIAL(trace) << command;
+void Server::ListenLocal(boost::asio::io_context& context)
+{
+    if (options.unixSocket.empty())
+    {
+        return;
+    }
 
-        boost::trim_right(command);
-        std::string message;
-        message = HandleCommand(command);
-        if (!message.empty())
+    // A socket file left by a server that didn't stop cleanly fails the bind.
+    struct stat status {};
+    if (::lstat(options.unixSocket.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    {
+        ::unlink(options.unixSocket.c_str());
+    }
+    localAcceptor = std::make_unique<boost::asio::local::stream_protocol::acceptor>(
+        context, boost::asio::local::stream_protocol::endpoint(options.unixSocket));
+    BOOST_LOG_TRIVIAL(info) << "Listening on Unix socket " << options.unixSocket << ".";
+}
+
+void Server::MainLoop()
+{
+    boost::asio::ip::tcp::acceptor
+        acceptor(ioContext,
+                 boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port));
+
+    BOOST_LOG_TRIVIAL(info) << "TCP Echo Server started. Listening on port " << port
+                            << " with " << options.workerThreads << " poll worker threads.";
+    ListenLocal(ioContext);
+
+    // The acceptors already listen; accepts only happen once poll() says so.
+    acceptor.non_blocking(true);
+    if (localAcceptor)
+    {
+        localAcceptor->non_blocking(true);
+    }
+
+    const auto accept = [this](auto& acceptor)
         {
-            boost::asio::write(*socket, boost::asio::buffer(message), error);
+            boost::system::error_code error;
+            typename std::decay_t<decltype(acceptor)>::protocol_type::socket socket(ioContext);
+            acceptor.accept(socket, error);
             if (error)
             {
-                BOOST_LOG_TRIVIAL(error) << "Error writing data: " << error.message() << std::endl;
-                break;
+                BOOST_LOG_TRIVIAL(warning) << "error while accepting: " << error.message();
+                if (IsResourceShortage(error))
+                {
+                    // Only this thread accepts, so connections are served meanwhile.
+                    std::this_thread::sleep_for(AcceptPause);
+                }
+                return;
+            }
+            if (!Admit(socket.native_handle()))
+            {
+                return;
             }
+
+            BOOST_LOG_TRIVIAL(info) << "New connection from: " << PeerOf(socket);
+            pollServer->Add(std::move(socket));
+        };
+
+    while (!stopMainThread)
+    {
+        // poll() skips the entry of a missing Unix socket.
+        struct pollfd pollFds[2] {};
+        pollFds[0].fd = acceptor.native_handle();
+        pollFds[0].events = POLLIN;
+        pollFds[1].fd = localAcceptor ? localAcceptor->native_handle() : -1;
+        pollFds[1].events = POLLIN;
+
+        if (::poll(pollFds, 2, pollTimeoutMs) == -1)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "error while polling: " << errno;            
+        }
+        if (pollFds[0].revents & POLLIN)
+        {
+            accept(acceptor);
+        }
+        if (pollFds[1].revents & POLLIN)
+        {
+            accept(*localAcceptor);
         }
     }
+}
+
+std::string Server::HandleCommand(std::string_view line, ResponseFormat& format)
+{
+    if (line.empty() || line[0] != CommandPrefix)
+    {
+        return FormatError(format, "not a command");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const ParsedCommand command = ParseCommand(line);
+    std::string result = ExecuteCommand(command, line, format);
+    if (command.id != CommandId::Unknown)
     {
-        std::lock_guard<std::mutex> lock(listMutex);
-        threadsForJoin.push_back(std::this_thread::get_id());
+        metrics.RecordCommand(command.id, std::chrono::steady_clock::now() - start);
     }
+
+    return result;
 }
 
-std::string Server::HandleCommand(const std::string& line)
+std::string Server::ExecuteCommand(const ParsedCommand& command, std::string_view line, ResponseFormat& format)
 {
-    std::string result;
-
-    if (line.empty() || line[0] != CommandPrefix)
+    if (!options.replicaOf.empty()
+        && (command.id == CommandId::Set || command.id == CommandId::MSet || command.id == CommandId::Expire))
     {
-        return result;
+        BOOST_LOG_TRIVIAL(warning) << "The server is a read-only replica (" <<  line << "). Command ignored.";
+        return FormatError(format, "read-only replica");
     }
 
-    std::vector<std::string> commandArg;
-    boost::split(commandArg, line, boost::is_any_of(CommandDelimiters));
+    const bool takesList = command.id == CommandId::MGet || command.id == CommandId::MSet;
+    const bool argumentOptional = command.id == CommandId::Stats || command.id == CommandId::Memory;
+    const bool expires = command.id == CommandId::Set && SetExpires(command.arguments);
+    const size_t maxArguments = expires || command.id == CommandId::Expire ? 2 : 1;
 
-    if (commandArg.size() < 2)
+    if (command.argumentCount < 1 && !argumentOptional)
     {
         BOOST_LOG_TRIVIAL(warning) << "There is no argument for a command (" <<  line << "). Command ignored.";
 
-        return result;
+        return FormatError(format, "no argument");
     }
-    else if (commandArg.size() > 2)
+    else if (command.argumentCount > maxArguments && !takesList)
     {
         BOOST_LOG_TRIVIAL(warning) << "Too much arguments for a command (" <<  line << "). Extra parameters will be ignored.";
     }
-    
-    auto& command = commandArg[0];
-    
-    if (command == CommandGet)
+
+    switch (command.id)
     {
-        BOOST_LOG_TRIVIAL(trace) << "command: \"" << CommandGet << "\"" << std::endl;
-        result = storage.Read(commandArg[1]);
+    case CommandId::Get:
+    {
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
+
+        std::string value;
+        const bool found = storage.Read(command.argument, value);
+        metrics.AddHits(found ? 1 : 0);
+        metrics.AddMisses(found ? 0 : 1);
+        return FormatValue(format, found, std::move(value));
     }
-    else if (command == CommandSet)
+    case CommandId::Set:
     {
-        BOOST_LOG_TRIVIAL(trace) << "command: \"" << CommandSet << "\"" << std::endl;
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
 
-        std::vector<std::string> keyValue;
-        boost::split(keyValue, commandArg[1], boost::is_any_of(KeyValueDelimiter));
+        std::string_view key;
+        std::string_view value;
+        if (!SplitKeyValue(command.argument, key, value))
+        {
+            BOOST_LOG_TRIVIAL(warning) << "invalid key/value pair (" <<  line << "). $set is not perfomed.";
+            return FormatError(format, "invalid key/value pair");
+        }
+        if (!storage.CanSave(key, value))
+        {
+            BOOST_LOG_TRIVIAL(warning) << "the config file can't hold the key or value (" <<  line << "). $set is not perfomed.";
+            return FormatError(format, "key or value can't be saved");
+        }
+        if (!expires)
+        {
+            storage.Write(key, value);
+            return FormatOk(format);
+        }
 
-        if (keyValue.size() == 2)
+        std::string_view arguments = command.arguments;
+        std::string_view option;
+        NextArgument(arguments, option);
+        NextArgument(arguments, option);
+        std::chrono::seconds ttl;
+        if (!ParseTtl(option.substr(SetExpiresIn.size()), ttl))
         {
-            storage.Write(keyValue[0], keyValue[1]);
+            BOOST_LOG_TRIVIAL(warning) << "invalid expiration time (" <<  line << "). $set is not perfomed.";
+            return FormatError(format, "invalid expiration time");
+        }
+        storage.Write(key, value, ttl);
+        return FormatOk(format);
+    }
+    case CommandId::Expire:
+    {
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
+
+        std::string_view arguments = command.arguments;
+        std::string_view key;
+        std::string_view seconds;
+        NextArgument(arguments, key);
+        std::chrono::seconds ttl;
+        if (!NextArgument(arguments, seconds) || !ParseTtl(seconds, ttl))
+        {
+            BOOST_LOG_TRIVIAL(warning) << "invalid expiration time (" <<  line << "). $expire is not perfomed.";
+            return FormatError(format, "invalid expiration time");
+        }
+        if (!storage.Expire(key, ttl))
+        {
+            return FormatValue(format, false, std::string());
+        }
+        return FormatOk(format);
+    }
+    case CommandId::MGet:
+    {
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
+
+        std::vector<std::string_view> keys;
+        std::string_view arguments = command.arguments;
+        std::string_view key;
+        while (NextArgument(arguments, key))
+        {
+            keys.push_back(key);
+        }
+        std::vector<std::optional<std::string>> values = storage.ReadMany(keys);
+        const size_t hits = std::count_if(values.begin(), values.end(),
+            [](const std::optional<std::string>& value)
+            {
+                return value.has_value();
+            });
+        metrics.AddHits(hits);
+        metrics.AddMisses(values.size() - hits);
+        return FormatValues(format, std::move(values));
+    }
+    case CommandId::MSet:
+    {
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
+
+        std::vector<std::pair<std::string_view, std::string_view>> keysValues;
+        std::string_view arguments = command.arguments;
+        std::string_view argument;
+        while (NextArgument(arguments, argument))
+        {
+            std::string_view key;
+            std::string_view value;
+            if (!SplitKeyValue(argument, key, value))
+            {
+                BOOST_LOG_TRIVIAL(warning) << "invalid key/value pair (" <<  argument << "). $mset is not perfomed.";
+                return FormatError(format, "invalid key/value pair");
+            }
+            if (!storage.CanSave(key, value))
+            {
+                BOOST_LOG_TRIVIAL(warning) << "the config file can't hold the key or value (" <<  argument << "). $mset is not perfomed.";
+                return FormatError(format, "key or value can't be saved");
+            }
+            keysValues.emplace_back(key, value);
+        }
+        storage.WriteMany(keysValues);
+        return FormatOk(format);
+    }
+    case CommandId::Proto:
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
+
+        if (command.argument == ProtocolFramed)
+        {
+            format = ResponseFormat::Framed;
+        }
+        else if (command.argument == ProtocolText)
+        {
+            format = ResponseFormat::Text;
         }
         else
         {
-            BOOST_LOG_TRIVIAL(warning) << "invalid key/value pair (" <<  line << "). $set is not perfomed.";
+            BOOST_LOG_TRIVIAL(warning) << "unknown protocol (" <<  line << "). Protocol isn't changed.";
+            return FormatError(format, "unknown protocol");
+        }
+        return FormatOk(format);
+    case CommandId::Stats:
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
+
+        if (command.argumentCount == 0)
+        {
+            return FormatValue(format, true, metrics.Report(MetricsFormat::Text, storage.GetStatistics()));
         }
+        if (command.argument == StatsPrometheus)
+        {
+            return FormatValue(format, true, metrics.Report(MetricsFormat::Prometheus, storage.GetStatistics()));
+        }
+        BOOST_LOG_TRIVIAL(warning) << "unknown statistics format (" <<  line << "). $stats is not perfomed.";
+        return FormatError(format, "unknown statistics format");
+    case CommandId::Memory:
+        BOOST_LOG_TRIVIAL(trace) << "command: \"" << command.name << "\"" << std::endl;
+
+        return FormatValue(format, true, FormatMemory(storage.GetMemoryUsage()));
+    case CommandId::Unknown:
+        break;
     }
-    
-    return result;
+
+    return FormatError(format, "unknown command");
 }
 
-void Server::MonitorThreads()
+BinaryStatus Server::HandleBinaryCommand(BinaryOpcode opcode, std::string_view key, std::string_view value,
+                                         std::string& result)
 {
-    while (!stopMonitoringThread)
+    const auto start = std::chrono::steady_clock::now();
+    switch (opcode)
+    {
+    case BinaryOpcode::Get:
     {
+        const bool found = storage.Read(key, result);
+        metrics.AddHits(found ? 1 : 0);
+        metrics.AddMisses(found ? 0 : 1);
+        metrics.RecordCommand(CommandId::Get, std::chrono::steady_clock::now() - start);
+        return found ? BinaryStatus::Ok : BinaryStatus::NotFound;
+    }
+    case BinaryOpcode::Set:
+        if (!options.replicaOf.empty())
         {
-            std::lock_guard<std::mutex> lock1(threadListMutex);
-            std::lock_guard<std::mutex> lock2(listMutex);
-            if (!(connectionThreads.empty() || threadsForJoin.empty()))
-            {
-                for (auto thIt = connectionThreads.begin(); thIt != connectionThreads.end(); ++thIt)
-                {
-                    for (auto jIt = threadsForJoin.begin(); jIt != threadsForJoin.end(); ++jIt)
-                    {
-                        if (thIt->get_id() == *jIt)
-                        {
-                            BOOST_LOG_TRIVIAL(trace) << "join thread (" <<  *jIt << ").";
-                            thIt->join();
-                            thIt = connectionThreads.erase(thIt);
-                            jIt = threadsForJoin.erase(jIt);
-                        }
-                    }
-                    if (threadsForJoin.empty())
-                    {
-                        BOOST_LOG_TRIVIAL(trace) << "Nothing to join.";
-                        break;
-                    }
-                }
-            }
+            BOOST_LOG_TRIVIAL(warning) << "The server is a read-only replica. Binary set ignored.";
+            return BinaryStatus::Error;
+        }
+        if (!storage.CanSave(key, value))
+        {
+            BOOST_LOG_TRIVIAL(warning) << "The config file can't hold the key or value. Binary set ignored.";
+            return BinaryStatus::Error;
         }
-        std::this_thread::sleep_for(MonitoringSleep);
+        storage.Write(key, value);
+        metrics.RecordCommand(CommandId::Set, std::chrono::steady_clock::now() - start);
+        return BinaryStatus::Ok;
     }
+
+    BOOST_LOG_TRIVIAL(warning) << "unknown binary opcode " << static_cast<int>(opcode) << ". Command ignored.";
+    return BinaryStatus::Error;
 }
@@ -1,42 +1,140 @@
-
 #pragma once
 
+#include "Protocol.h"
+#include "ServerMetrics.h"
+
 #include <boost/asio.hpp>
-#include <list>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 
 class Storage;
+class PollServer;
+class ReplicaClient;
+class SharedMemoryServer;
+class UringServer;
+
+enum class ServerMode
+{
+    // A fixed pool of threads polls the sockets of the connections.
+    Threads,
+    // Connections are multiplexed over a pool of threads running one io_context.
+    Async,
+    // Every worker thread completes socket operations of its connections with
+    // its own io_uring; falls back to Async where the kernel can't.
+    IoUring
+};
+
+// How command results are sent back, chosen per connection.
+enum class ResponseFormat
+{
+    // Raw values with no terminator; nothing for a miss or a $set.
+    Text,
+    // One self-delimiting response per command, see Protocol.h.
+    Framed
+};
+
+struct ServerOptions
+{
+    ServerMode mode = ServerMode::Async;
+    // Threads serving the connections in every mode.
+    size_t workerThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    // Connections served at once; more are told the server is busy and
+    // closed. 0 means no limit.
+    size_t maxConnections = 10000;
+    // Every worker listens on a socket of its own bound with SO_REUSEPORT, so
+    // the kernel spreads new connections over the workers and a connection
+    // stays with the worker that accepted it. Async and IoUring modes only.
+    bool reusePort = false;
+    // "host:port" of a primary whose data the server keeps a copy of, see
+    // ReplicaClient. Writes are then rejected. Empty for a primary.
+    std::string replicaOf;
+    // Path of a Unix domain socket to listen on besides the TCP port, for
+    // clients on the same host. Empty for none.
+    std::string unixSocket;
+};
 
 class Server
 {
 public:
-    Server(const boost::asio::ip::port_type port, Storage& storage);
+    Server(const boost::asio::ip::port_type port, Storage& storage,
+           const ServerOptions& options = ServerOptions());
     ~Server();
 
     void Start();
+
+    // Executes one command line and returns the response to it.
+    std::string HandleCommand(std::string_view line, ResponseFormat& format);
+
+    // Called for every accepted connection before it is served. Returns false
+    // if maxConnections are being served already; the peer is then told so
+    // and the caller closes the socket.
+    bool Admit(int fd);
+
+    ServerMetrics& Metrics() { return metrics; }
 private:
+    friend class Session;
+    friend class SharedMemoryServer;
+    class AsyncSession;
+
     const boost::asio::ip::port_type port;
+    const ServerOptions options;
     const int pollTimeoutMs = 1000;
-    const std::chrono::seconds MonitoringSleep = std::chrono::seconds(1);
     Storage& storage;
+    ServerMetrics metrics;
+    // Sessions alive; every one was admitted and releases its place when
+    // destroyed.
+    std::atomic<size_t> activeConnections;
 
-    std::mutex threadListMutex;
-    std::list<std::thread> connectionThreads;
+    boost::asio::io_context ioContext;
+    // A context per worker when the workers listen on their own sockets.
+    std::vector<std::unique_ptr<boost::asio::io_context>> workerContexts;
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+    std::unique_ptr<boost::asio::local::stream_protocol::acceptor> localAcceptor;
+    std::vector<std::thread> workerThreads;
+    std::unique_ptr<UringServer> uringServer;
 
-    std::thread mainThread;
-    std::thread monitoringThread;
-
-    std::mutex listMutex;
-    std::list<std::thread::id> threadsForJoin;
+    std::unique_ptr<ReplicaClient> replicaClient;
+    std::unique_ptr<SharedMemoryServer> sharedMemoryServer;
 
-    std::atomic_bool stopConnectionThreads;
-    std::atomic_bool stopMonitoringThread;
+    std::unique_ptr<PollServer> pollServer;
+    std::thread mainThread;
     std::atomic_bool stopMainThread;
 
+    struct DurabilityWaiter
+    {
+        uint64_t position;
+        std::function<void(bool durable)> done;
+    };
+    // Syncs the log for sessions holding responses back until their writes
+    // are on disk, so no worker thread waits for the disk.
+    std::thread syncThread;
+    std::mutex syncMutex;
+    std::condition_variable syncWanted;
+    std::vector<DurabilityWaiter> syncWaiters;
+    bool stopSyncThread;
+
     void MainLoop();
-    void HandleClient(std::shared_ptr<boost::asio::ip::tcp::socket> socket);
-    std::string HandleCommand(const std::string& line);
-    void MonitorThreads();
+    // Calls 'done' from the sync thread once the log is on disk up to
+    // 'position', with false if syncing failed; after the server began to
+    // stop, from the caller with false at once.
+    void WhenDurable(uint64_t position, std::function<void(bool durable)> done);
+    void SyncLoop();
+    std::string ExecuteCommand(const ParsedCommand& command, std::string_view line, ResponseFormat& format);
+    BinaryStatus HandleBinaryCommand(BinaryOpcode opcode, std::string_view key, std::string_view value,
+                                     std::string& result);
+
+    void StartUring();
+    void StartAsync();
+    template <typename Acceptor>
+    void AcceptAsync(Acceptor& acceptor);
+    // Listens on options.unixSocket with 'context', if it is set.
+    void ListenLocal(boost::asio::io_context& context);
+    void StopAsync();
 };
@@ -0,0 +1,213 @@
+#include "ServerMetrics.h"
+
+#include "Storage.h"
+#include "TimerWheel.h"
+
+#include <sstream>
+
+namespace
+{
+    const char MetricPrefix[] = "kv_";
+    // Percentiles reported for every command.
+    const double Percentiles[] = { 50.0, 99.0, 99.9 };
+
+    double ToMicroseconds(double nanoseconds)
+    {
+        return nanoseconds / 1000.0;
+    }
+
+    double ToSeconds(double nanoseconds)
+    {
+        return nanoseconds / 1e9;
+    }
+
+    // "$mget" is reported as "mget".
+    std::string_view MetricName(CommandId id)
+    {
+        std::string_view name = CommandName(id);
+        name.remove_prefix(1);
+        return name;
+    }
+
+    void PrometheusHeader(std::ostringstream& stream, std::string_view name, std::string_view type,
+                          std::string_view help)
+    {
+        stream << "# HELP " << MetricPrefix << name << " " << help << "\n"
+               << "# TYPE " << MetricPrefix << name << " " << type << "\n";
+    }
+
+    void PrometheusValue(std::ostringstream& stream, std::string_view name, std::string_view type,
+                         std::string_view help, uint64_t value)
+    {
+        PrometheusHeader(stream, name, type, help);
+        stream << MetricPrefix << name << " " << value << "\n";
+    }
+}
+
+ServerMetrics::ServerMetrics() :
+    replica(false), replicaConnected(false), replicatedUntil(0)
+{
+    for (auto& stripe: stripes)
+    {
+        stripe.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+ServerMetrics::~ServerMetrics()
+{
+    for (auto& stripe: stripes)
+    {
+        delete stripe.load(std::memory_order_relaxed);
+    }
+}
+
+ServerMetrics::LatencyStripe& ServerMetrics::ThreadStripe()
+{
+    static std::atomic<size_t> nextStripe {0};
+    thread_local const size_t index = nextStripe.fetch_add(1, std::memory_order_relaxed) % StripeCount;
+
+    LatencyStripe* stripe = stripes[index].load(std::memory_order_acquire);
+    if (!stripe)
+    {
+        LatencyStripe* created = new LatencyStripe();
+        if (stripes[index].compare_exchange_strong(stripe, created, std::memory_order_acq_rel))
+        {
+            stripe = created;
+        }
+        else
+        {
+            // Another thread of this stripe won; 'stripe' holds its one.
+            delete created;
+        }
+    }
+    return *stripe;
+}
+
+void ServerMetrics::RecordCommand(CommandId id, std::chrono::steady_clock::duration latency)
+{
+    const uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+
+    LatencyStripe& stripe = ThreadStripe();
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    stripe.latencies[static_cast<size_t>(id)].Record(nanoseconds);
+}
+
+std::array<Histogram, CommandIdCount> ServerMetrics::MergeLatencies() const
+{
+    std::array<Histogram, CommandIdCount> result;
+    for (const auto& stripe: stripes)
+    {
+        LatencyStripe* latencies = stripe.load(std::memory_order_acquire);
+        if (!latencies)
+        {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(latencies->mutex);
+        for (size_t id = 0; id < CommandIdCount; ++id)
+        {
+            result[id].Merge(latencies->latencies[id]);
+        }
+    }
+    return result;
+}
+
+std::string ServerMetrics::Report(MetricsFormat format, const StorageStatistics& storage) const
+{
+    // Read the closed count first so the difference can't go below zero.
+    const uint64_t closed = connectionsClosed.Load();
+    const uint64_t opened = connectionsOpened.Load();
+    const std::array<Histogram, CommandIdCount> latencies = MergeLatencies();
+    // Lag is known once the primary has sent its time; clocks of the two
+    // machines are assumed to agree.
+    const uint64_t until = replicatedUntil.load();
+    const bool lagKnown = replica && until != 0;
+    const uint64_t now = NowMilliseconds();
+    const uint64_t lagMs = lagKnown && now > until ? now - until : 0;
+
+    std::ostringstream stream;
+    if (format == MetricsFormat::Text)
+    {
+        stream << "connections_active " << opened - closed << "\n"
+               << "connections_total " << opened << "\n"
+               << "connections_rejected " << connectionsRejected.Load() << "\n"
+               << "bytes_in " << bytesIn.Load() << "\n"
+               << "bytes_out " << bytesOut.Load() << "\n"
+               << "get_hits " << hits.Load() << "\n"
+               << "get_misses " << misses.Load() << "\n"
+               << "storage_reads " << storage.readCount << "\n"
+               << "storage_writes " << storage.writeCount << "\n"
+               << "storage_expired_keys " << storage.expiredCount << "\n"
+               << "storage_evicted_keys " << storage.evictionCount << "\n"
+               << "storage_syncs " << storage.syncCount << "\n"
+               << "replication_replicas " << storage.replicaCount << "\n";
+        if (replica)
+        {
+            stream << "replication_connected " << replicaConnected.load() << "\n";
+        }
+        if (lagKnown)
+        {
+            stream << "replication_lag_ms " << lagMs << "\n";
+        }
+
+        for (size_t id = 1; id < CommandIdCount; ++id)
+        {
+            const Histogram& histogram = latencies[id];
+            const std::string_view name = MetricName(static_cast<CommandId>(id));
+            stream << "command_" << name << "_count " << histogram.Count() << "\n"
+                   << "command_" << name << "_mean_us " << ToMicroseconds(histogram.Mean()) << "\n"
+                   << "command_" << name << "_p50_us " << ToMicroseconds(histogram.Percentile(50.0)) << "\n"
+                   << "command_" << name << "_p99_us " << ToMicroseconds(histogram.Percentile(99.0)) << "\n"
+                   << "command_" << name << "_p999_us " << ToMicroseconds(histogram.Percentile(99.9)) << "\n"
+                   << "command_" << name << "_max_us " << ToMicroseconds(histogram.Max()) << "\n";
+        }
+        return stream.str();
+    }
+
+    PrometheusValue(stream, "connections_active", "gauge", "Open client connections.", opened - closed);
+    PrometheusValue(stream, "connections_total", "counter", "Accepted client connections.", opened);
+    PrometheusValue(stream, "connections_rejected_total", "counter", "Connections closed as the server was full.",
+                    connectionsRejected.Load());
+    PrometheusValue(stream, "received_bytes_total", "counter", "Bytes received from clients.", bytesIn.Load());
+    PrometheusValue(stream, "sent_bytes_total", "counter", "Bytes sent to clients.", bytesOut.Load());
+    PrometheusValue(stream, "get_hits_total", "counter", "Keys found by $get and $mget.", hits.Load());
+    PrometheusValue(stream, "get_misses_total", "counter", "Keys not found by $get and $mget.", misses.Load());
+    PrometheusValue(stream, "storage_reads_total", "counter", "Keys read from the storage.", storage.readCount);
+    PrometheusValue(stream, "storage_writes_total", "counter", "Keys written to the storage.", storage.writeCount);
+    PrometheusValue(stream, "storage_expired_keys_total", "counter", "Keys erased when their time to live ran out.",
+                    storage.expiredCount);
+    PrometheusValue(stream, "storage_evicted_keys_total", "counter", "Keys evicted to stay within the memory limit.",
+                    storage.evictionCount);
+    PrometheusValue(stream, "storage_syncs_total", "counter", "Syncs of the write-ahead log to disk.",
+                    storage.syncCount);
+    PrometheusValue(stream, "replication_replicas", "gauge", "Replicas streaming changes from this server.",
+                    storage.replicaCount);
+    if (replica)
+    {
+        PrometheusValue(stream, "replication_connected", "gauge", "Whether the replica is connected to its primary.",
+                        replicaConnected.load());
+    }
+    if (lagKnown)
+    {
+        PrometheusHeader(stream, "replication_lag_seconds", "gauge",
+                         "Time since the last change of the primary the replica surely has.");
+        stream << MetricPrefix << "replication_lag_seconds " << lagMs / 1000.0 << "\n";
+    }
+
+    PrometheusHeader(stream, "command_duration_seconds", "summary", "Time to execute a command.");
+    for (size_t id = 1; id < CommandIdCount; ++id)
+    {
+        const Histogram& histogram = latencies[id];
+        const std::string_view name = MetricName(static_cast<CommandId>(id));
+        for (double percentile: Percentiles)
+        {
+            stream << MetricPrefix << "command_duration_seconds{command=\"" << name << "\",quantile=\""
+                   << percentile / 100.0 << "\"} " << ToSeconds(histogram.Percentile(percentile)) << "\n";
+        }
+        stream << MetricPrefix << "command_duration_seconds_sum{command=\"" << name << "\"} "
+               << ToSeconds(histogram.Mean() * histogram.Count()) << "\n"
+               << MetricPrefix << "command_duration_seconds_count{command=\"" << name << "\"} "
+               << histogram.Count() << "\n";
+    }
+    return stream.str();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "CommandParser.h"
+#include "Histogram.h"
+#include "StripedCounter.h"
+
+struct StorageStatistics;
+
+enum class MetricsFormat
+{
+    // "name value" lines.
+    Text,
+    // Prometheus text exposition format.
+    Prometheus
+};
+
+// Counters and per-command latency histograms of a server. Every update goes
+// to a stripe owned by the calling thread, so recording never makes the
+// connection threads contend with each other; a report sums the stripes.
+class ServerMetrics
+{
+public:
+    ServerMetrics();
+    ~ServerMetrics();
+
+    ServerMetrics(const ServerMetrics&) = delete;
+    ServerMetrics& operator=(const ServerMetrics&) = delete;
+
+    void RecordCommand(CommandId id, std::chrono::steady_clock::duration latency);
+    void AddHits(uint64_t count) { hits.Add(count); }
+    void AddMisses(uint64_t count) { misses.Add(count); }
+    void AddBytesIn(uint64_t count) { bytesIn.Add(count); }
+    void AddBytesOut(uint64_t count) { bytesOut.Add(count); }
+    void ConnectionOpened() { connectionsOpened.Add(); }
+    void ConnectionClosed() { connectionsClosed.Add(); }
+    void ConnectionRejected() { connectionsRejected.Add(); }
+
+    // Replicas only, see ReplicaClient. Every change the primary made before
+    // its time 'primaryTime' has been applied.
+    void ReplicaConnected(bool connected)
+    {
+        replica = true;
+        replicaConnected = connected;
+    }
+    void ReplicatedUntil(uint64_t primaryTime) { replicatedUntil = primaryTime; }
+
+    std::string Report(MetricsFormat format, const StorageStatistics& storage) const;
+private:
+    // Histograms are big, so a stripe is allocated by the first thread that
+    // records into it, and there are fewer stripes than counter stripes.
+    static const size_t StripeCount = 32;
+
+    struct alignas(64) LatencyStripe
+    {
+        // Only contended when threads share a stripe or a report is taken.
+        std::mutex mutex;
+        std::array<Histogram, CommandIdCount> latencies;
+    };
+
+    std::atomic<LatencyStripe*> stripes[StripeCount];
+
+    StripedCounter hits;
+    StripedCounter misses;
+    StripedCounter bytesIn;
+    StripedCounter bytesOut;
+    StripedCounter connectionsOpened;
+    StripedCounter connectionsClosed;
+    StripedCounter connectionsRejected;
+
+    std::atomic_bool replica;
+    std::atomic_bool replicaConnected;
+    // 0 until the first heartbeat from the primary.
+    std::atomic<uint64_t> replicatedUntil;
+
+    LatencyStripe& ThreadStripe();
+    std::array<Histogram, CommandIdCount> MergeLatencies() const;
+};
@@ -0,0 +1,284 @@
+#include "Session.h"
+
+#include "CommandParser.h"
+#include "SharedMemoryServer.h"
+#include "Storage.h"
+
+#include <boost/log/trivial.hpp>
+#include <cstring>
+
+namespace
+{
+    const size_t InitialReceiveBufferSize = 4096;
+
+    // Responses shorter than this are copied into a shared segment...
+    const size_t SmallResponseSize = 512;
+    // ...until the segment grows to this size.
+    const size_t OutputSegmentSize = 16 * 1024;
+}
+
+ReceiveBuffer::ReceiveBuffer() :
+    data(InitialReceiveBufferSize), begin(0), end(0)
+{
+}
+
+boost::asio::mutable_buffer ReceiveBuffer::Prepare()
+{
+    if (end == data.size())
+    {
+        if (begin > 0)
+        {
+            std::memmove(data.data(), data.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        else
+        {
+            data.resize(data.size() * 2);
+        }
+    }
+    return boost::asio::buffer(data.data() + end, data.size() - end);
+}
+
+void ReceiveBuffer::Commit(size_t size)
+{
+    end += size;
+}
+
+std::string_view ReceiveBuffer::Data() const
+{
+    return std::string_view(data.data() + begin, end - begin);
+}
+
+void ReceiveBuffer::Consume(size_t size)
+{
+    begin += size;
+    if (begin == end)
+    {
+        begin = end = 0;
+    }
+}
+
+Session::Session(Server& server) :
+    server(server), countedInput(0), protocol(WireProtocol::Unknown), format(ResponseFormat::Text),
+    handOver(HandOverTarget::None), textScanned(0), syncPosition(0), outputOffset(0)
+{
+    server.Metrics().ConnectionOpened();
+}
+
+Session::~Session()
+{
+    server.Metrics().ConnectionClosed();
+    server.activeConnections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool Session::Process()
+{
+    // Bytes are only added to the input by the transport between calls, so
+    // everything beyond the unprocessed tail of the last call is new.
+    server.Metrics().AddBytesIn(input.Data().size() - countedInput);
+    // Only writes of this thread move its position, and the thread runs
+    // nothing else meanwhile.
+    const uint64_t writtenBefore = server.storage.WritePosition();
+    const bool result = ProcessInput();
+    countedInput = input.Data().size();
+    if (HandOverRequested())
+    {
+        return false;
+    }
+
+    // Responses go out after Process(), so writes of the whole batch are
+    // made durable by one sync before any of them is acknowledged.
+    const uint64_t writtenAfter = server.storage.WritePosition();
+    if (writtenAfter != writtenBefore)
+    {
+        syncPosition = writtenAfter;
+    }
+    return result;
+}
+
+void Session::WhenDurable(std::function<void(bool durable)> done)
+{
+    server.WhenDurable(syncPosition, std::move(done));
+    syncPosition = 0;
+}
+
+bool Session::WaitDurable()
+{
+    const uint64_t position = syncPosition;
+    syncPosition = 0;
+    try
+    {
+        server.storage.Sync(position);
+    }
+    catch (std::exception& e)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Syncing writes: " << e.what() << ". Connection is closed.";
+        return false;
+    }
+    return true;
+}
+
+void Session::HandOver(int fd)
+{
+    if (handOver == HandOverTarget::SharedMemory)
+    {
+        server.sharedMemoryServer->Add(fd, sharedMemoryName);
+        return;
+    }
+    BOOST_LOG_TRIVIAL(info) << "Connection becomes a replication stream.";
+    server.storage.AddReplica(fd);
+}
+
+bool Session::ProcessInput()
+{
+    if (protocol == WireProtocol::Unknown)
+    {
+        const std::string_view data = input.Data();
+        if (data.empty())
+        {
+            return true;
+        }
+
+        protocol = static_cast<unsigned char>(data[0]) == BinaryMagic ? WireProtocol::Binary : WireProtocol::Text;
+        if (protocol == WireProtocol::Binary)
+        {
+            input.Consume(1);
+        }
+    }
+
+    if (protocol == WireProtocol::Binary)
+    {
+        return ProcessBinary();
+    }
+
+    return ProcessText();
+}
+
+bool Session::ProcessText()
+{
+    std::string_view pending = input.Data();
+    std::string_view line;
+
+    // The incomplete line left by the last call has no line break, so a long
+    // line isn't searched from its start again on every receive.
+    std::string_view unscanned = pending.substr(textScanned);
+    const bool lineEnded = NextLine(unscanned, line);
+
+    while (lineEnded && NextLine(pending, line))
+    {
+        BOOST_LOG_TRIVIAL(trace) << line;
+        const std::string_view command = TrimRight(line);
+        if (command == ReplicateCommand)
+        {
+            handOver = HandOverTarget::Replica;
+            break;
+        }
+        if (command.size() > SharedMemoryCommand.size() + 1
+            && command.substr(0, SharedMemoryCommand.size()) == SharedMemoryCommand
+            && command[SharedMemoryCommand.size()] == ' ')
+        {
+            handOver = HandOverTarget::SharedMemory;
+            sharedMemoryName = command.substr(SharedMemoryCommand.size() + 1);
+            break;
+        }
+        AppendOutput(server.HandleCommand(command, format));
+    }
+    input.Consume(input.Data().size() - pending.size());
+    textScanned = pending.size();
+
+    // The rest is a line still incomplete.
+    if (!HandOverRequested() && pending.size() > MaxTextLineLength)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Text line of over " << MaxTextLineLength
+                                   << " bytes is too long. Connection is closed.";
+        return false;
+    }
+    return true;
+}
+
+bool Session::ProcessBinary()
+{
+    std::string_view pending = input.Data();
+
+    while (pending.size() >= sizeof(BinaryHeader))
+    {
+        BinaryHeader request;
+        std::memcpy(&request, pending.data(), sizeof(request));
+
+        if (request.valueLength > MaxBinaryValueLength)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "Binary value of " << request.valueLength
+                                       << " bytes is too long. Connection is closed.";
+            return false;
+        }
+
+        const size_t requestSize = sizeof(request) + request.keyLength + request.valueLength;
+        if (pending.size() < requestSize)
+        {
+            break;
+        }
+
+        const std::string_view key = pending.substr(sizeof(request), request.keyLength);
+        const std::string_view value = pending.substr(sizeof(request) + request.keyLength, request.valueLength);
+
+        std::string responseValue;
+        const BinaryStatus status = server.HandleBinaryCommand(
+            static_cast<BinaryOpcode>(request.code), key, value, responseValue);
+
+        BinaryHeader response {};
+        response.code = static_cast<uint8_t>(status);
+        response.valueLength = responseValue.size();
+        response.requestId = request.requestId;
+
+        AppendOutput(std::string(reinterpret_cast<const char*>(&response), sizeof(response)));
+        AppendOutput(std::move(responseValue));
+
+        pending.remove_prefix(requestSize);
+    }
+    input.Consume(input.Data().size() - pending.size());
+
+    return true;
+}
+
+void Session::AppendOutput(std::string&& response)
+{
+    if (response.empty())
+    {
+        return;
+    }
+
+    if (response.size() < SmallResponseSize && !output.empty()
+        && output.back().size() < OutputSegmentSize)
+    {
+        output.back() += response;
+        return;
+    }
+    output.push_back(std::move(response));
+}
+
+const std::vector<boost::asio::const_buffer>& Session::Output()
+{
+    outputBuffers.clear();
+    for (size_t i = 0; i < output.size(); ++i)
+    {
+        const size_t offset = i == 0 ? outputOffset : 0;
+        outputBuffers.emplace_back(output[i].data() + offset, output[i].size() - offset);
+    }
+    return outputBuffers;
+}
+
+void Session::ConsumeOutput(size_t size)
+{
+    server.Metrics().AddBytesOut(size);
+
+    size_t segment = 0;
+    while (segment < output.size() && size >= output[segment].size() - outputOffset)
+    {
+        size -= output[segment].size() - outputOffset;
+        outputOffset = 0;
+        ++segment;
+    }
+    output.erase(output.begin(), output.begin() + segment);
+    outputOffset = output.empty() ? 0 : outputOffset + size;
+}
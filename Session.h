@@ -0,0 +1,113 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Protocol.h"
+#include "Server.h"
+
+// Bytes received from a connection. Complete lines are parsed in place and
+// consumed; an incomplete tail waits for the rest of its line.
+class ReceiveBuffer
+{
+public:
+    ReceiveBuffer();
+
+    // Free space to receive into; grows the buffer when it is full.
+    boost::asio::mutable_buffer Prepare();
+    void Commit(size_t size);
+
+    std::string_view Data() const;
+    void Consume(size_t size);
+private:
+    std::vector<char> data;
+    size_t begin;
+    size_t end;
+};
+
+// Protocol state of one connection, independent of how bytes are moved.
+// The transport appends received bytes to the input, calls Process() to run
+// every complete command in it and then sends all queued responses in one
+// gathered write. The first byte received selects the text or the binary
+// protocol.
+class Session
+{
+public:
+    explicit Session(Server& server);
+    ~Session();
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    ReceiveBuffer& Input() { return input; }
+
+    // Returns false if the peer broke the protocol and must be disconnected,
+    // or asked for its socket to be handed over.
+    bool Process();
+    // Whether responses queued by Process() acknowledge writes that have to
+    // reach the disk first (Durability::SyncOnAck). The transport then holds
+    // them back and takes no more input until WhenDurable() calls back or
+    // WaitDurable() returns; a batch that only reads never waits.
+    bool SyncPending() const { return syncPosition != 0; }
+    // Calls 'done' from another thread once the writes are on disk, with
+    // false if syncing failed and the connection is to be closed.
+    void WhenDurable(std::function<void(bool durable)> done);
+    // Waits for the same in the calling thread.
+    bool WaitDurable();
+    // Whether the peer sent ReplicateCommand or SharedMemoryCommand; the
+    // transport then gives its socket up to HandOver() rather than closing
+    // it.
+    bool HandOverRequested() const { return handOver != HandOverTarget::None; }
+    // Passes the socket 'fd' on to the storage for a replica or to the
+    // shared memory server, which owns it from then on.
+    void HandOver(int fd);
+
+    bool HasOutput() const { return !output.empty(); }
+    // Buffer sequence over every queued response.
+    const std::vector<boost::asio::const_buffer>& Output();
+    // Drops 'size' sent bytes from the front of the output.
+    void ConsumeOutput(size_t size);
+private:
+    enum class WireProtocol
+    {
+        Unknown,
+        Text,
+        Binary
+    };
+
+    enum class HandOverTarget
+    {
+        None,
+        Replica,
+        SharedMemory
+    };
+
+    Server& server;
+    ReceiveBuffer input;
+    // Input bytes already counted in the statistics.
+    size_t countedInput;
+    WireProtocol protocol;
+    ResponseFormat format;
+    HandOverTarget handOver;
+    // Name of the channel the peer asked for with SharedMemoryCommand.
+    std::string sharedMemoryName;
+    // Bytes at the start of the input known to hold no line break.
+    size_t textScanned;
+    // Where the writes awaiting a sync end in the log; 0 if there are none.
+    uint64_t syncPosition;
+
+    // Small responses are coalesced into one segment, big ones keep their own
+    // so they are sent without copying.
+    std::vector<std::string> output;
+    size_t outputOffset;
+    std::vector<boost::asio::const_buffer> outputBuffers;
+
+    bool ProcessInput();
+    bool ProcessText();
+    bool ProcessBinary();
+    void AppendOutput(std::string&& response);
+};
@@ -0,0 +1,377 @@
+#include "ShardedClient.h"
+
+#include "Protocol.h"
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace
+{
+    // Neither keys nor values of text commands may contain these.
+    const char ForbiddenCharacters[] = " \t\r\n=";
+    const size_t ReceiveBufferSize = 64 * 1024;
+
+    void CheckArgument(std::string_view text)
+    {
+        if (text.empty() || text.find_first_of(ForbiddenCharacters) != std::string_view::npos)
+        {
+            throw std::invalid_argument("Can't send '" + std::string(text)
+                                        + "': keys and values must be non-empty and have no spaces, '=' or line breaks");
+        }
+    }
+
+    bool StartsWith(std::string_view text, std::string_view prefix)
+    {
+        return text.substr(0, prefix.size()) == prefix;
+    }
+}
+
+HashRing::HashRing(size_t virtualNodes) :
+    virtualNodes(std::max<size_t>(virtualNodes, 1))
+{
+}
+
+void HashRing::Add(const std::string& node)
+{
+    if (std::find(nodes.begin(), nodes.end(), node) != nodes.end())
+    {
+        return;
+    }
+    nodes.push_back(node);
+    Rebuild();
+}
+
+void HashRing::Remove(const std::string& node)
+{
+    const auto found = std::find(nodes.begin(), nodes.end(), node);
+    if (found == nodes.end())
+    {
+        return;
+    }
+    nodes.erase(found);
+    Rebuild();
+}
+
+void HashRing::Rebuild()
+{
+    points.clear();
+    points.reserve(nodes.size() * virtualNodes);
+    for (size_t node = 0; node < nodes.size(); ++node)
+    {
+        for (size_t i = 0; i < virtualNodes; ++i)
+        {
+            points.push_back({Hash(nodes[node] + "#" + std::to_string(i)), node});
+        }
+    }
+    std::sort(points.begin(), points.end(), [this](const Point& left, const Point& right)
+        {
+            return left.hash != right.hash ? left.hash < right.hash : nodes[left.node] < nodes[right.node];
+        });
+}
+
+size_t HashRing::NodeOf(std::string_view key) const
+{
+    if (nodes.size() == 1)
+    {
+        return 0;
+    }
+
+    const uint64_t hash = Hash(key);
+    const auto found = std::lower_bound(points.begin(), points.end(), hash, [](const Point& point, uint64_t hash)
+        {
+            return point.hash < hash;
+        });
+    return found == points.end() ? points.front().node : found->node;
+}
+
+uint64_t HashRing::Hash(std::string_view data)
+{
+    // FNV-1a, then the MurmurHash3 finalizer so that similar names such as
+    // those of virtual nodes land far apart.
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c: data)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+ShardedClient::ShardedClient(const std::vector<std::string>& servers, size_t virtualNodes) :
+    ring(virtualNodes)
+{
+    SetServers(servers);
+}
+
+ShardedClient::~ShardedClient() = default;
+
+void ShardedClient::SetServers(const std::vector<std::string>& servers)
+{
+    // Nothing changes unless every address is good.
+    for (const std::string& server: servers)
+    {
+        const size_t colon = server.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == server.size())
+        {
+            throw std::invalid_argument("Server address '" + server + "' isn't <host>:<port>");
+        }
+    }
+
+    for (const std::string& server: std::vector<std::string>(ring.Nodes()))
+    {
+        if (std::find(servers.begin(), servers.end(), server) == servers.end())
+        {
+            ring.Remove(server);
+            nodes.erase(server);
+        }
+    }
+    for (const std::string& server: servers)
+    {
+        if (!nodes.count(server))
+        {
+            nodes.emplace(server, std::make_unique<Node>(ioContext, server));
+            ring.Add(server);
+        }
+    }
+}
+
+const std::string& ShardedClient::ServerOf(std::string_view key) const
+{
+    if (ring.Empty())
+    {
+        throw std::runtime_error("There are no servers to send to");
+    }
+    return ring.Nodes()[ring.NodeOf(key)];
+}
+
+ShardedClient::Node& ShardedClient::NodeFor(std::string_view key)
+{
+    Node& node = *nodes.at(ServerOf(key));
+    if (!node.socket.is_open())
+    {
+        Connect(node);
+    }
+    return node;
+}
+
+void ShardedClient::Connect(Node& node)
+{
+    const size_t colon = node.address.rfind(':');
+    try
+    {
+        boost::asio::ip::tcp::resolver resolver(ioContext);
+        boost::asio::connect(node.socket,
+                             resolver.resolve(node.address.substr(0, colon), node.address.substr(colon + 1)));
+        node.socket.set_option(boost::asio::ip::tcp::no_delay(true));
+
+        Send(node, "$proto " + std::string(ProtocolFramed) + FramedEol);
+        ReadOk(node);
+    }
+    catch (const boost::system::system_error& e)
+    {
+        Reset(node);
+        throw std::runtime_error("Can't connect to " + node.address + ": " + e.what());
+    }
+}
+
+void ShardedClient::Reset(Node& node)
+{
+    boost::system::error_code error;
+    node.socket.close(error);
+    node.input.clear();
+}
+
+std::optional<std::string> ShardedClient::Get(std::string_view key)
+{
+    CheckArgument(key);
+    Node& node = NodeFor(key);
+    try
+    {
+        Send(node, "$get " + std::string(key) + FramedEol);
+        return ReadValue(node);
+    }
+    catch (const boost::system::system_error&)
+    {
+        Reset(node);
+        throw;
+    }
+}
+
+void ShardedClient::Set(std::string_view key, std::string_view value)
+{
+    CheckArgument(key);
+    CheckArgument(value);
+    Node& node = NodeFor(key);
+    try
+    {
+        Send(node, "$set " + std::string(key) + "=" + std::string(value) + FramedEol);
+        ReadOk(node);
+    }
+    catch (const boost::system::system_error&)
+    {
+        Reset(node);
+        throw;
+    }
+}
+
+std::vector<std::optional<std::string>> ShardedClient::MGet(const std::vector<std::string_view>& keys)
+{
+    // Positions in 'keys' per node and the request of every node.
+    std::map<Node*, std::pair<std::vector<size_t>, std::string>> parts;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        CheckArgument(keys[i]);
+        auto& [positions, request] = parts[&NodeFor(keys[i])];
+        positions.push_back(i);
+        request += request.empty() ? "$mget " : " ";
+        request += keys[i];
+    }
+
+    std::vector<std::optional<std::string>> result(keys.size());
+    try
+    {
+        for (auto& [node, part]: parts)
+        {
+            Send(*node, part.second + FramedEol);
+        }
+        for (auto& [node, part]: parts)
+        {
+            const std::string status = ReadLine(*node);
+            if (!StartsWith(status, FramedValues)
+                || std::strtoull(status.c_str() + FramedValues.size(), nullptr, 10) != part.first.size())
+            {
+                Reject(*node, status);
+            }
+            for (const size_t position: part.first)
+            {
+                result[position] = ReadValue(*node);
+            }
+        }
+    }
+    catch (const std::exception&)
+    {
+        // Responses of the other nodes may still be on their way.
+        for (auto& [node, part]: parts)
+        {
+            Reset(*node);
+        }
+        throw;
+    }
+    return result;
+}
+
+void ShardedClient::MSet(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)
+{
+    std::map<Node*, std::string> requests;
+    for (const auto& [key, value]: keysValues)
+    {
+        CheckArgument(key);
+        CheckArgument(value);
+        std::string& request = requests[&NodeFor(key)];
+        request += request.empty() ? "$mset " : " ";
+        request += key;
+        request += '=';
+        request += value;
+    }
+
+    try
+    {
+        for (auto& [node, request]: requests)
+        {
+            Send(*node, request + FramedEol);
+        }
+        for (auto& [node, request]: requests)
+        {
+            ReadOk(*node);
+        }
+    }
+    catch (const std::exception&)
+    {
+        for (auto& [node, request]: requests)
+        {
+            Reset(*node);
+        }
+        throw;
+    }
+}
+
+void ShardedClient::Send(Node& node, std::string_view request)
+{
+    boost::asio::write(node.socket, boost::asio::buffer(request.data(), request.size()));
+}
+
+std::string ShardedClient::ReadLine(Node& node)
+{
+    size_t eol;
+    while ((eol = node.input.find(FramedEol)) == std::string::npos)
+    {
+        char buffer[ReceiveBufferSize];
+        const size_t received = node.socket.read_some(boost::asio::buffer(buffer));
+        node.input.append(buffer, received);
+    }
+    std::string line = node.input.substr(0, eol + 1);
+    node.input.erase(0, eol + 1);
+    return line;
+}
+
+std::string ShardedClient::ReadBytes(Node& node, size_t size)
+{
+    if (node.input.size() < size)
+    {
+        const size_t buffered = node.input.size();
+        node.input.resize(size);
+        boost::asio::read(node.socket, boost::asio::buffer(&node.input[buffered], size - buffered));
+    }
+    std::string bytes = node.input.substr(0, size);
+    node.input.erase(0, size);
+    return bytes;
+}
+
+std::optional<std::string> ShardedClient::ReadValue(Node& node)
+{
+    const std::string status = ReadLine(node);
+    if (status == FramedNotFound)
+    {
+        return std::nullopt;
+    }
+    if (!StartsWith(status, FramedValue))
+    {
+        Reject(node, status);
+    }
+
+    const size_t length = std::strtoull(status.c_str() + FramedValue.size(), nullptr, 10);
+    std::string value = ReadBytes(node, length + 1);
+    value.pop_back();
+    return value;
+}
+
+void ShardedClient::ReadOk(Node& node)
+{
+    const std::string status = ReadLine(node);
+    if (status != FramedOk)
+    {
+        Reject(node, status);
+    }
+}
+
+void ShardedClient::Reject(Node& node, const std::string& response)
+{
+    const std::string_view reason = std::string_view(response).substr(0, response.size() - 1);
+    if (StartsWith(response, FramedError))
+    {
+        throw std::runtime_error("Server " + node.address + " rejected the request: "
+                                 + std::string(reason.substr(FramedError.size())));
+    }
+    // Whatever follows can't be parsed any more.
+    Reset(node);
+    throw std::runtime_error("Unexpected response from " + node.address + ": " + std::string(reason));
+}
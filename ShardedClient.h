@@ -0,0 +1,123 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Consistent hashing of keys to nodes. Every node owns a number of points
+// (virtual nodes) on a ring of 64-bit hashes and a key belongs to the node
+// of the first point at or after the key's hash. Adding or removing a node
+// only moves the keys of the arcs it gains or loses, about 1/N of them, and
+// the many points per node keep the arcs of every node about equal.
+class HashRing
+{
+public:
+    static const size_t DefaultVirtualNodes = 160;
+
+    explicit HashRing(size_t virtualNodes = DefaultVirtualNodes);
+
+    // Adding a node that is there already does nothing.
+    void Add(const std::string& node);
+    void Remove(const std::string& node);
+
+    // Nodes in the order they were added; indexes shift down on removal.
+    const std::vector<std::string>& Nodes() const { return nodes; }
+    bool Empty() const { return nodes.empty(); }
+    // Index into Nodes() of the node owning 'key'. The ring must not be empty.
+    size_t NodeOf(std::string_view key) const;
+
+    // Stable across processes and platforms, unlike std::hash, so every
+    // client routes a key to the same node.
+    static uint64_t Hash(std::string_view data);
+private:
+    struct Point
+    {
+        uint64_t hash;
+        size_t node;
+    };
+
+    const size_t virtualNodes;
+    std::vector<std::string> nodes;
+    // Sorted by hash; ties go to the node with the smaller name, so the
+    // order nodes are added in doesn't matter.
+    std::vector<Point> points;
+
+    void Rebuild();
+};
+
+// Blocking client of several servers that share one key space, each key
+// kept by the server HashRing routes it to. There is one connection per
+// server, opened on first use and reopened on the next use after a failure.
+// Responses are framed, see Protocol.h. Not thread safe.
+//
+// Every method throws std::runtime_error if a server can't be reached or
+// rejects a request, and std::invalid_argument for a key or value that the
+// text protocol can't carry: empty or with spaces, '=' or line breaks.
+class ShardedClient
+{
+public:
+    // 'servers' are "<host>:<port>" strings.
+    explicit ShardedClient(const std::vector<std::string>& servers,
+                           size_t virtualNodes = HashRing::DefaultVirtualNodes);
+    ~ShardedClient();
+
+    ShardedClient(const ShardedClient&) = delete;
+    ShardedClient& operator=(const ShardedClient&) = delete;
+
+    // Adds and removes servers to match 'servers'. Connections to servers
+    // that stay are kept, and only keys of the servers added or removed are
+    // routed elsewhere from then on; no data is moved between servers. An
+    // address that isn't "<host>:<port>" throws std::invalid_argument and
+    // leaves the servers as they were.
+    void SetServers(const std::vector<std::string>& servers);
+    const std::string& ServerOf(std::string_view key) const;
+
+    std::optional<std::string> Get(std::string_view key);
+    void Set(std::string_view key, std::string_view value);
+
+    // Batches are split by server. The part of every server is sent before
+    // any response is read, so the servers work on them in parallel.
+    std::vector<std::optional<std::string>> MGet(const std::vector<std::string_view>& keys);
+    // Atomic per server only: a failure may leave the pairs of some servers
+    // written and of others not.
+    void MSet(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues);
+private:
+    struct Node
+    {
+        Node(boost::asio::io_context& ioContext, const std::string& address) :
+            address(address), socket(ioContext)
+        {
+        }
+
+        const std::string address;
+        boost::asio::ip::tcp::socket socket;
+        // Received bytes not parsed yet.
+        std::string input;
+    };
+
+    boost::asio::io_context ioContext;
+    HashRing ring;
+    std::map<std::string, std::unique_ptr<Node>> nodes;
+
+    // The connected node owning 'key'.
+    Node& NodeFor(std::string_view key);
+    void Connect(Node& node);
+    // Closes the connection; the next use reconnects.
+    void Reset(Node& node);
+
+    void Send(Node& node, std::string_view request);
+    std::string ReadLine(Node& node);
+    std::string ReadBytes(Node& node, size_t size);
+    // Reads a VALUE or NOT_FOUND response.
+    std::optional<std::string> ReadValue(Node& node);
+    void ReadOk(Node& node);
+    // Throws for an ERROR or unexpected response.
+    [[noreturn]] void Reject(Node& node, const std::string& response);
+};
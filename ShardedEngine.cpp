@@ -0,0 +1,177 @@
+#include "ShardedEngine.h"
+
+#include <mutex>
+
+ShardedEngine::ShardedEngine(size_t shardCount) :
+    StorageEngine(shardCount), shards(new Shard[shardCount])
+{
+}
+
+ShardedEngine::Shard& ShardedEngine::GetShard(size_t hash) const
+{
+    return shards[ShardIndex(hash, shardCount)];
+}
+
+ReadStatus ShardedEngine::Read(std::string_view key, std::string& value, uint64_t now) const
+{
+    const size_t hash = PersistentMap::Hash(key);
+    const Shard& shard = GetShard(hash);
+
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    uint64_t expiresAt = 0;
+    const std::string* stored = shard.keysValues.Find(key, hash, expiresAt);
+    if (!stored)
+    {
+        return ReadStatus::Missing;
+    }
+    if (IsExpired(expiresAt, now))
+    {
+        return ReadStatus::Expired;
+    }
+    value = *stored;
+    return ReadStatus::Found;
+}
+
+std::vector<std::optional<std::string>> ShardedEngine::ReadMany(const std::vector<std::string_view>& keys,
+                                                                uint64_t now) const
+{
+    std::vector<size_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        hashes[i] = PersistentMap::Hash(keys[i]);
+    }
+
+    const std::vector<size_t> shardIndexes = ShardIndexes(hashes, shardCount);
+    std::vector<std::shared_lock<std::shared_mutex>> locks;
+    locks.reserve(shardIndexes.size());
+    for (size_t index: shardIndexes)
+    {
+        locks.emplace_back(shards[index].mutex);
+    }
+
+    std::vector<std::optional<std::string>> result(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        uint64_t expiresAt = 0;
+        const std::string* stored = GetShard(hashes[i]).keysValues.Find(keys[i], hashes[i], expiresAt);
+        if (stored && !IsExpired(expiresAt, now))
+        {
+            result[i] = *stored;
+        }
+    }
+    return result;
+}
+
+void ShardedEngine::Write(std::string_view key, std::string_view value, uint64_t expiresAt)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    shard.keysValues.Set(key, value, hash, expiresAt);
+    if (changeLog)
+    {
+        changeLog->Append(key, value, expiresAt);
+    }
+    Evict(shard.keysValues, shard.clockHand);
+}
+
+void ShardedEngine::WriteMany(const std::vector<KeyValue>& keysValues)
+{
+    std::vector<size_t> hashes(keysValues.size());
+    for (size_t i = 0; i < keysValues.size(); ++i)
+    {
+        hashes[i] = PersistentMap::Hash(keysValues[i].first);
+    }
+
+    const std::vector<size_t> shardIndexes = ShardIndexes(hashes, shardCount);
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    locks.reserve(shardIndexes.size());
+    for (size_t index: shardIndexes)
+    {
+        locks.emplace_back(shards[index].mutex);
+    }
+
+    for (size_t i = 0; i < keysValues.size(); ++i)
+    {
+        GetShard(hashes[i]).keysValues.Set(keysValues[i].first, keysValues[i].second, hashes[i]);
+    }
+    if (changeLog)
+    {
+        changeLog->AppendBatch(keysValues);
+    }
+    for (size_t index: shardIndexes)
+    {
+        Evict(shards[index].keysValues, shards[index].clockHand);
+    }
+}
+
+bool ShardedEngine::Expire(std::string_view key, uint64_t expiresAt, uint64_t now)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    uint64_t oldExpiresAt = 0;
+    const std::string* stored = shard.keysValues.Find(key, hash, oldExpiresAt);
+    if (!stored || IsExpired(oldExpiresAt, now))
+    {
+        return false;
+    }
+
+    // Set() may replace the value the pointer refers to.
+    const std::string value = *stored;
+    shard.keysValues.Set(key, value, hash, expiresAt);
+    if (changeLog)
+    {
+        changeLog->Append(key, value, expiresAt);
+    }
+    return true;
+}
+
+bool ShardedEngine::EraseExpired(std::string_view key, uint64_t now)
+{
+    const size_t hash = PersistentMap::Hash(key);
+    Shard& shard = GetShard(hash);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    uint64_t expiresAt = 0;
+    if (!shard.keysValues.Find(key, hash, expiresAt) || !IsExpired(expiresAt, now))
+    {
+        return false;
+    }
+    return shard.keysValues.Erase(key, hash);
+}
+
+void ShardedEngine::ForEach(const PersistentMap::Visitor& visitor) const
+{
+    // Copying a shard's map only shares its root, so readers and writers are
+    // held up for constant time; the copies are visited without locks.
+    std::vector<PersistentMap> snapshot(shardCount);
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        const Shard& shard = shards[i];
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        snapshot[i] = shard.keysValues;
+    }
+
+    for (const PersistentMap& map: snapshot)
+    {
+        map.ForEach(visitor);
+    }
+}
+
+MemoryUsage ShardedEngine::Memory() const
+{
+    MemoryUsage result;
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        const Shard& shard = shards[i];
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        const PersistentMap map = shard.keysValues;
+        lock.unlock();
+
+        result += map.Memory();
+    }
+    return result;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "StorageEngine.h"
+
+#include <memory>
+#include <shared_mutex>
+
+// Engine with a reader/writer lock per shard.
+class ShardedEngine : public StorageEngine
+{
+public:
+    explicit ShardedEngine(size_t shardCount);
+
+    ReadStatus Read(std::string_view key, std::string& value, uint64_t now) const override;
+    std::vector<std::optional<std::string>> ReadMany(const std::vector<std::string_view>& keys,
+                                                     uint64_t now) const override;
+    void Write(std::string_view key, std::string_view value, uint64_t expiresAt) override;
+    void WriteMany(const std::vector<KeyValue>& keysValues) override;
+    bool Expire(std::string_view key, uint64_t expiresAt, uint64_t now) override;
+    bool EraseExpired(std::string_view key, uint64_t now) override;
+
+    void ForEach(const PersistentMap::Visitor& visitor) const override;
+    MemoryUsage Memory() const override;
+private:
+    // Each shard is locked independently; readers share the lock.
+    // Aligned to a cache line so neighbouring shard locks don't false-share.
+    // The map is persistent, so a snapshot of a shard is a constant time copy.
+    struct alignas(64) Shard
+    {
+        mutable std::shared_mutex mutex;
+        PersistentMap keysValues;
+        // Where the eviction sweep goes on from.
+        size_t clockHand = 0;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+
+    Shard& GetShard(size_t hash) const;
+};
@@ -0,0 +1,291 @@
+#include "SharedMemoryChannel.h"
+
+#include "Protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    const uint64_t Magic = 0x314d48535f564b00ull;
+    const size_t MinRingSize = 4096;
+    // A waiting side spins this long before it sleeps; a request or response
+    // of a busy peer is mostly there by then, and a futex wake costs more.
+    // On a single CPU spinning only keeps the peer from running.
+    const std::chrono::microseconds SpinTime(std::thread::hardware_concurrency() > 1 ? 50 : 0);
+    // Checks between looks at the clock while spinning.
+    const int SpinChecks = 64;
+
+    void CpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain integers");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring indexes are shared between processes");
+
+    // Shared, not private, futexes: the two sides are different processes.
+    long Futex(std::atomic<uint32_t>& word, int operation, uint32_t value, const timespec* timeout)
+    {
+        return ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), operation, value, timeout, nullptr, 0);
+    }
+
+    void WakeIfSleeping(std::atomic<uint32_t>& sleeping)
+    {
+        if (sleeping.load(std::memory_order_seq_cst) != 0)
+        {
+            Futex(sleeping, FUTEX_WAKE, 1, nullptr);
+        }
+    }
+
+    // Spins, then sleeps on 'sleeping' until 'ready' or the timeout. A
+    // spurious wake may end the wait early.
+    template <typename Ready>
+    bool Wait(std::atomic<uint32_t>& sleeping, std::chrono::milliseconds timeout, Ready ready)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - start < SpinTime)
+        {
+            for (int i = 0; i < SpinChecks; ++i)
+            {
+                if (ready())
+                {
+                    return true;
+                }
+                CpuRelax();
+            }
+        }
+
+        // Pairs with WakeIfSleeping() after the peer moves an index: either
+        // the peer sees this side sleeping or this check sees the new index.
+        sleeping.store(1, std::memory_order_seq_cst);
+        bool result = ready();
+        if (!result)
+        {
+            const timespec time {static_cast<time_t>(timeout.count() / 1000),
+                                 static_cast<long>(timeout.count() % 1000 * 1000000)};
+            Futex(sleeping, FUTEX_WAIT, 1, &time);
+            result = ready();
+        }
+        sleeping.store(0, std::memory_order_relaxed);
+        return result;
+    }
+}
+
+struct SharedMemoryChannel::Ring
+{
+    // Bytes ever written; stored by the producer only.
+    alignas(64) std::atomic<uint64_t> tail;
+    // Set while the producer sleeps waiting for room.
+    std::atomic<uint32_t> writerSleeping;
+    // Bytes ever read; stored by the consumer only.
+    alignas(64) std::atomic<uint64_t> head;
+    // Set while the consumer sleeps waiting for bytes.
+    std::atomic<uint32_t> readerSleeping;
+};
+
+// The data of the request ring and then of the response ring follow.
+struct SharedMemoryChannel::Header
+{
+    uint64_t magic;
+    uint64_t ringSize;
+    Ring requests;
+    Ring responses;
+};
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::Create(const std::string& name, size_t ringSize)
+{
+    if (ringSize < MinRingSize || (ringSize & (ringSize - 1)) != 0)
+    {
+        throw std::runtime_error("Can't create shared memory " + name + ": ring size " + std::to_string(ringSize)
+                                 + " isn't a power of two of at least " + std::to_string(MinRingSize));
+    }
+
+    const int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1)
+    {
+        throw std::runtime_error("Can't create shared memory " + name + ": " + std::strerror(errno));
+    }
+
+    const size_t size = sizeof(Header) + 2 * ringSize;
+    void* memory = MAP_FAILED;
+    if (::ftruncate(fd, size) == 0)
+    {
+        memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    }
+    const int error = errno;
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        ::shm_unlink(name.c_str());
+        throw std::runtime_error("Can't map shared memory " + name + ": " + std::strerror(error));
+    }
+
+    Header* header = new (memory) Header {};
+    header->magic = Magic;
+    header->ringSize = ringSize;
+    return std::unique_ptr<SharedMemoryChannel>(new SharedMemoryChannel(name, true, memory, size, ringSize, false));
+}
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::Open(const std::string& name, uid_t owner)
+{
+    if (name.compare(0, SharedMemoryPrefix.size(), SharedMemoryPrefix) != 0
+        || name.find('/', 1) != std::string::npos || name.size() > NAME_MAX)
+    {
+        throw std::runtime_error("Can't open shared memory " + name + ": the name isn't allowed");
+    }
+
+    const int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd == -1)
+    {
+        throw std::runtime_error("Can't open shared memory " + name + ": " + std::strerror(errno));
+    }
+
+    struct stat status {};
+    if (::fstat(fd, &status) == -1 || static_cast<size_t>(status.st_size) < sizeof(Header) + 2 * MinRingSize)
+    {
+        ::close(fd);
+        throw std::runtime_error("Can't open shared memory " + name + ": it isn't a channel");
+    }
+    if (status.st_uid != owner)
+    {
+        ::close(fd);
+        throw std::runtime_error("Can't open shared memory " + name + ": it belongs to another user");
+    }
+    const size_t size = status.st_size;
+    void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    const int error = errno;
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        throw std::runtime_error("Can't map shared memory " + name + ": " + std::strerror(error));
+    }
+
+    // Read once: the client may change the header at any time.
+    const Header* header = static_cast<const Header*>(memory);
+    const uint64_t magic = header->magic;
+    const uint64_t ringSize = header->ringSize;
+    if (magic != Magic || (ringSize & (ringSize - 1)) != 0 || (size - sizeof(Header)) / 2 != ringSize
+        || (size - sizeof(Header)) % 2 != 0)
+    {
+        ::munmap(memory, size);
+        throw std::runtime_error("Can't open shared memory " + name + ": it isn't a channel");
+    }
+    return std::unique_ptr<SharedMemoryChannel>(new SharedMemoryChannel(name, false, memory, size, ringSize, true));
+}
+
+SharedMemoryChannel::SharedMemoryChannel(const std::string& name, bool linked, void* memory, size_t mappedSize,
+                                         size_t ringSize, bool server) :
+    name(name), linked(linked), memory(memory), mappedSize(mappedSize), ringSize(ringSize),
+    input(server ? static_cast<Header*>(memory)->requests : static_cast<Header*>(memory)->responses),
+    output(server ? static_cast<Header*>(memory)->responses : static_cast<Header*>(memory)->requests),
+    inputData(static_cast<char*>(memory) + sizeof(Header) + (server ? 0 : ringSize)),
+    outputData(static_cast<char*>(memory) + sizeof(Header) + (server ? ringSize : 0)),
+    broken(false)
+{
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+    ::munmap(memory, mappedSize);
+    Unlink();
+}
+
+void SharedMemoryChannel::Unlink()
+{
+    if (linked)
+    {
+        ::shm_unlink(name.c_str());
+        linked = false;
+    }
+}
+
+size_t SharedMemoryChannel::Write(const void* data, size_t size)
+{
+    const uint64_t tail = output.tail.load(std::memory_order_relaxed);
+    const uint64_t head = output.head.load(std::memory_order_acquire);
+    if (tail - head > ringSize)
+    {
+        broken = true;
+    }
+    if (broken)
+    {
+        return 0;
+    }
+
+    const size_t count = std::min<uint64_t>(size, ringSize - (tail - head));
+    if (count == 0)
+    {
+        return 0;
+    }
+    const size_t offset = tail & (ringSize - 1);
+    const size_t first = std::min(count, ringSize - offset);
+    std::memcpy(outputData + offset, data, first);
+    std::memcpy(outputData, static_cast<const char*>(data) + first, count - first);
+
+    output.tail.store(tail + count, std::memory_order_seq_cst);
+    WakeIfSleeping(output.readerSleeping);
+    return count;
+}
+
+size_t SharedMemoryChannel::Read(void* data, size_t size)
+{
+    const uint64_t head = input.head.load(std::memory_order_relaxed);
+    const uint64_t tail = input.tail.load(std::memory_order_acquire);
+    if (tail - head > ringSize)
+    {
+        broken = true;
+    }
+    if (broken)
+    {
+        return 0;
+    }
+
+    const size_t count = std::min<uint64_t>(size, tail - head);
+    if (count == 0)
+    {
+        return 0;
+    }
+    const size_t offset = head & (ringSize - 1);
+    const size_t first = std::min(count, ringSize - offset);
+    std::memcpy(data, inputData + offset, first);
+    std::memcpy(static_cast<char*>(data) + first, inputData, count - first);
+
+    input.head.store(head + count, std::memory_order_seq_cst);
+    WakeIfSleeping(input.writerSleeping);
+    return count;
+}
+
+bool SharedMemoryChannel::WaitReadable(std::chrono::milliseconds timeout)
+{
+    return Wait(input.readerSleeping, timeout, [this]()
+        {
+            return input.tail.load(std::memory_order_seq_cst) != input.head.load(std::memory_order_relaxed);
+        });
+}
+
+bool SharedMemoryChannel::WaitWritable(std::chrono::milliseconds timeout)
+{
+    return Wait(output.writerSleeping, timeout, [this]()
+        {
+            return output.tail.load(std::memory_order_relaxed) - output.head.load(std::memory_order_seq_cst)
+                   < ringSize;
+        });
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+// A byte stream each way between a client and the server on the same host,
+// kept in a POSIX shared memory object both of them map: a request ring the
+// client writes and the server reads, and a response ring the other way
+// round. Each ring has one producer and one consumer, so moving bytes takes
+// neither locks nor system calls. A side waiting for the other spins for a
+// while and then sleeps on a futex in the ring, which the other side only
+// wakes if the sleeper said it sleeps. See SharedMemoryCommand in Protocol.h
+// for how a connection switches over to a channel.
+//
+// Either side may be gone or misbehave: the server checks every index the
+// client wrote and never reads or writes outside its mapping.
+class SharedMemoryChannel
+{
+public:
+    static const size_t DefaultRingSize = 1024 * 1024;
+
+    // Client side: creates the object 'name' with two rings of 'ringSize'
+    // bytes, a power of two of at least a page. The name is removed when
+    // the channel is destroyed unless Unlink() did so before.
+    static std::unique_ptr<SharedMemoryChannel> Create(const std::string& name, size_t ringSize = DefaultRingSize);
+    // Server side: maps the object 'name' a client created, which must be
+    // named with SharedMemoryPrefix and owned by the user 'owner'.
+    // Both throw std::runtime_error if the object can't be set up.
+    static std::unique_ptr<SharedMemoryChannel> Open(const std::string& name, uid_t owner);
+    ~SharedMemoryChannel();
+
+    SharedMemoryChannel(const SharedMemoryChannel&) = delete;
+    SharedMemoryChannel& operator=(const SharedMemoryChannel&) = delete;
+
+    // Removes the name once the server has mapped the object; the mappings
+    // stay until both sides are done.
+    void Unlink();
+
+    // Copy up to 'size' bytes without blocking and return how many; 0 if
+    // the ring is full or empty. Writing wakes a sleeping reader, reading a
+    // writer sleeping for room.
+    size_t Write(const void* data, size_t size);
+    size_t Read(void* data, size_t size);
+
+    // Return false if there is still nothing to read or no room to write
+    // when they give up, after 'timeout' at most.
+    bool WaitReadable(std::chrono::milliseconds timeout);
+    bool WaitWritable(std::chrono::milliseconds timeout);
+
+    // Whether the peer left a ring's indexes inconsistent; nothing can be
+    // moved any more then.
+    bool Broken() const { return broken; }
+private:
+    struct Ring;
+    struct Header;
+
+    const std::string name;
+    bool linked;
+    void* const memory;
+    const size_t mappedSize;
+    const size_t ringSize;
+    // The ring this side reads from and the one it writes to.
+    Ring& input;
+    Ring& output;
+    char* const inputData;
+    char* const outputData;
+    bool broken;
+
+    SharedMemoryChannel(const std::string& name, bool linked, void* memory, size_t mappedSize, size_t ringSize,
+                        bool server);
+};
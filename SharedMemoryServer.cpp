@@ -0,0 +1,195 @@
+#include "SharedMemoryServer.h"
+
+#include "Protocol.h"
+#include "Server.h"
+#include "Session.h"
+#include "SharedMemoryChannel.h"
+
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    // How often an idle session looks whether the client or the server is
+    // going away.
+    const std::chrono::milliseconds WaitTimeout(100);
+
+    // Best effort; the client has nothing to say on the socket any more.
+    void Answer(int fd, std::string_view answer)
+    {
+        if (::send(fd, answer.data(), answer.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(answer.size()))
+        {
+            BOOST_LOG_TRIVIAL(trace) << "Can't answer a shared memory request: " << std::strerror(errno);
+        }
+    }
+
+    // The user of the process at the other end of a Unix domain socket 'fd';
+    // throws for any other socket.
+    uid_t LocalPeerUser(int fd)
+    {
+        sockaddr_storage address {};
+        socklen_t addressSize = sizeof(address);
+        if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &addressSize) != 0
+            || address.ss_family != AF_UNIX)
+        {
+            throw std::runtime_error("Shared memory is refused to a connection not over the Unix socket");
+        }
+        ucred credentials {};
+        socklen_t credentialsSize = sizeof(credentials);
+        if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsSize) != 0)
+        {
+            throw std::runtime_error(std::string("Can't get the peer of a connection: ") + std::strerror(errno));
+        }
+        return credentials.uid;
+    }
+
+    // The client only closes the socket, so anything happening on it means
+    // the client is gone.
+    bool PeerClosed(int fd)
+    {
+        pollfd pollFd {fd, POLLIN | POLLRDHUP, 0};
+        return ::poll(&pollFd, 1, 0) != 0;
+    }
+}
+
+SharedMemoryServer::SharedMemoryServer(Server& server) :
+    server(server), stopping(false), threadCount(0)
+{
+}
+
+SharedMemoryServer::~SharedMemoryServer()
+{
+    stopping = true;
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this]()
+        {
+            return threadCount == 0;
+        });
+}
+
+void SharedMemoryServer::Add(int fd, const std::string& name)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping)
+        {
+            ::close(fd);
+            return;
+        }
+        ++threadCount;
+    }
+    std::thread(&SharedMemoryServer::Serve, this, fd, name).detach();
+}
+
+void SharedMemoryServer::Serve(int fd, const std::string& name)
+{
+    // Transports hand their sockets over in non-blocking mode.
+    const int flags = ::fcntl(fd, F_GETFL);
+    if (flags != -1)
+    {
+        ::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    try
+    {
+        // The rings are trusted no more than the socket, but another user
+        // must neither drive the server's sessions nor get it to map objects
+        // of a third one.
+        const uid_t peer = LocalPeerUser(fd);
+        if (peer != ::geteuid())
+        {
+            throw std::runtime_error("Shared memory is refused to user " + std::to_string(peer));
+        }
+        std::unique_ptr<SharedMemoryChannel> channel = SharedMemoryChannel::Open(name, peer);
+        Answer(fd, FramedOk);
+        BOOST_LOG_TRIVIAL(info) << "Connection moves to shared memory " << name << ".";
+        Run(*channel, fd);
+        BOOST_LOG_TRIVIAL(info) << "Shared memory " << name << " is closed.";
+    }
+    // Whatever a session throws, like running out of memory, ends it alone.
+    catch (const std::exception& e)
+    {
+        BOOST_LOG_TRIVIAL(warning) << e.what() << ". Connection is closed.";
+        Answer(fd, std::string(FramedError) + "no shared memory" + FramedEol);
+    }
+    ::close(fd);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    --threadCount;
+    finished.notify_all();
+}
+
+void SharedMemoryServer::Run(SharedMemoryChannel& channel, int fd)
+{
+    // The session takes over the place of the connection the client asked
+    // over, which its transport releases.
+    server.activeConnections.fetch_add(1, std::memory_order_relaxed);
+    Session session(server);
+
+    while (!stopping)
+    {
+        const boost::asio::mutable_buffer buffer = session.Input().Prepare();
+        const size_t received = channel.Read(buffer.data(), buffer.size());
+        if (received == 0)
+        {
+            if (channel.Broken())
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Shared memory request ring is damaged.";
+                return;
+            }
+            if (!channel.WaitReadable(WaitTimeout) && PeerClosed(fd))
+            {
+                return;
+            }
+            continue;
+        }
+
+        session.Input().Commit(received);
+        if (!session.Process())
+        {
+            if (session.HandOverRequested())
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Shared memory sessions can't be handed over.";
+            }
+            return;
+        }
+        // The thread is the session's own, so it may wait for the disk.
+        if (session.SyncPending() && !session.WaitDurable())
+        {
+            return;
+        }
+
+        while (session.HasOutput())
+        {
+            size_t sent = 0;
+            for (const boost::asio::const_buffer& response: session.Output())
+            {
+                const size_t written = channel.Write(response.data(), response.size());
+                sent += written;
+                if (written < response.size())
+                {
+                    break;
+                }
+            }
+            session.ConsumeOutput(sent);
+
+            if (channel.Broken())
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Shared memory response ring is damaged.";
+                return;
+            }
+            if (session.HasOutput() && !channel.WaitWritable(WaitTimeout) && (stopping || PeerClosed(fd)))
+            {
+                return;
+            }
+        }
+    }
+}
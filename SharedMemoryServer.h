@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+
+class Server;
+class SharedMemoryChannel;
+
+// Serves the sessions of clients that asked for a SharedMemoryChannel with
+// SharedMemoryCommand, each from a thread of its own that keeps the socket
+// the client asked over to notice when the client goes away.
+class SharedMemoryServer
+{
+public:
+    explicit SharedMemoryServer(Server& server);
+    // Ends the sessions and waits for their threads.
+    ~SharedMemoryServer();
+
+    SharedMemoryServer(const SharedMemoryServer&) = delete;
+    SharedMemoryServer& operator=(const SharedMemoryServer&) = delete;
+
+    // Takes the connected socket 'fd' over and serves commands over the
+    // channel 'name' until the client closes either.
+    void Add(int fd, const std::string& name);
+private:
+    Server& server;
+    std::atomic_bool stopping;
+
+    std::mutex mutex;
+    // Signalled when a session thread ends.
+    std::condition_variable finished;
+    size_t threadCount;
+
+    void Serve(int fd, const std::string& name);
+    void Run(SharedMemoryChannel& channel, int fd);
+};
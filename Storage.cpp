@@ -1,27 +1,119 @@
-
 #include "Storage.h"
 
+#include "BinarySnapshot.h"
+#include "CompactEngine.h"
+#include "IniLoader.h"
+#include "LockFreeEngine.h"
+#include "Replication.h"
+#include "ShardedEngine.h"
+#include "WriteAheadLog.h"
+
 #include <boost/log/trivial.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 
-Storage::Storage(const std::string& configPath) :
-    configPath(configPath), dataChanged(false),
-    readCount(0), writeCount(0)
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+#include <vector>
+
+namespace
 {
+    const char WalSuffix[] = ".wal";
+    const char TemporarySuffix[] = ".tmp";
+    // Pairs loaded from the config file per batch write.
+    const size_t LoadBatchSize = 4096;
+
+    // Flushes a file or directory to disk.
+    void SyncPath(const std::string& path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+        }
+        const int result = ::fsync(fd);
+        const int error = errno;
+        ::close(fd);
+        if (result != 0)
+        {
+            throw std::runtime_error("Can't sync " + path + ": " + std::strerror(error));
+        }
+    }
+
+    // Same characters as read_ini trims off keys and values.
+    bool IsIniSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    // Whether read_ini gives 'text' back as it is written as a key or value.
+    bool IsIniText(std::string_view text)
+    {
+        return text.find('\n') == std::string_view::npos
+               && (text.empty() || (!IsIniSpace(text.front()) && !IsIniSpace(text.back())));
+    }
+
+    std::unique_ptr<StorageEngine> MakeEngine(const StorageOptions& options)
+    {
+        const size_t shardCount = std::max<size_t>(options.shardCount, 1);
+        if (options.engine == EngineType::LockFree)
+        {
+            return std::make_unique<LockFreeEngine>(shardCount);
+        }
+        if (options.engine == EngineType::Compact)
+        {
+            return std::make_unique<CompactEngine>(shardCount);
+        }
+        return std::make_unique<ShardedEngine>(shardCount);
+    }
+}
+
+Storage::Storage(const std::string& configPath, const StorageOptions& options) :
+    options(options), engine(MakeEngine(options)), configPath(configPath), dataChanged(false),
+    stopThread(false), expirations(NowMilliseconds())
+{
+    engine->SetMemoryLimit(options.memoryLimit);
     LoadConfig(configPath);
+    replication = std::make_unique<ReplicationSource>(*engine);
+    replication->SetNext(wal.get());
+    engine->SetLog(replication.get());
 
-    saveThread = std::thread(&Storage::SaveThread, this);
+    if (options.backgroundSave)
+    {
+        saveThread = std::thread(&Storage::SaveThread, this);
+    }
+    expiryThread = std::thread(&Storage::ExpiryThread, this);
 }
 
 Storage::~Storage()
 {
     BOOST_LOG_TRIVIAL(trace) << "~Storage";
 
+    engine->SetLog(wal.get());
+    replication.reset();
+
     stopThread = true;
-    saveThread.join();
+    if (saveThread.joinable())
+    {
+        saveThread.join();
+    }
+    expiryThread.join();
 
-    if (dataChanged)
+    if (wal)
+    {
+        wal->Flush();
+        if (wal->Size() > 0 || std::filesystem::exists(wal->RotatedPath()))
+        {
+            CompactLog();
+        }
+    }
+    else if (dataChanged)
     {
         SaveConfig(configPath);
     }
@@ -29,66 +121,282 @@ Storage::~Storage()
 
 void Storage::LoadConfig(const std::string& filename)
 {
-    boost::property_tree::ptree pt;
-
+    bool configExists = true;
     {
         std::ifstream fileStream(filename);
         if (!fileStream)
         {
             BOOST_LOG_TRIVIAL(info) << "File " + filename + " not exists. Continue with empty storage.";
-            return;
+            configExists = false;
         }
     }
-    
-    boost::property_tree::ini_parser::read_ini(filename, pt);
 
-    for (const auto& item: pt)
+    if (configExists)
     {
-        keysValues[item.first.data()] = item.second.data();
+        const auto start = std::chrono::steady_clock::now();
+        const size_t keyCount = SnapshotReader::IsSnapshot(filename) ? LoadSnapshot(filename) : LoadIni(filename);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const double megabytes = std::filesystem::file_size(filename) / (1024.0 * 1024.0);
+
+        BOOST_LOG_TRIVIAL(info) << keyCount << " keys are loaded from " << filename << ": " << megabytes
+                                << " MB in " << seconds << " s, " << megabytes / std::max(seconds, 1e-9)
+                                << " MB/s.";
+    }
+
+    if (options.persistence != PersistenceMode::Wal)
+    {
+        return;
+    }
+
+    wal = std::make_unique<WriteAheadLog>(filename + WalSuffix);
+
+    // A rotated log is left behind only if the last compaction didn't finish,
+    // so it's older than the current one.
+    const size_t replayed = ReplayLog(wal->RotatedPath()) + ReplayLog(wal->Path());
+    if (replayed > 0)
+    {
+        BOOST_LOG_TRIVIAL(info) << replayed << " records are replayed from the log.";
+        CompactLog();
     }
 }
 
-void Storage::SaveConfig(const std::string& filename)
+size_t Storage::LoadIni(const std::string& filename)
+{
+    return LoadIniConfig(filename, *engine, options.loadThreads, [this](std::string_view key, uint64_t expiresAt)
+        {
+            // Nothing has expired at time 0, so every key is still there.
+            if (engine->Expire(key, expiresAt, 0))
+            {
+                ScheduleExpiration(key, expiresAt);
+            }
+        });
+}
+
+size_t Storage::LoadSnapshot(const std::string& filename)
 {
-    boost::property_tree::ptree pt;
+    // Keys and values are copied into the engine straight from the mapping.
+    const SnapshotReader snapshot(filename);
+
+    std::vector<StorageEngine::KeyValue> batch;
+    snapshot.ForEach([this, &batch](std::string_view key, std::string_view value, uint64_t expiresAt)
+        {
+            if (expiresAt != 0)
+            {
+                engine->Write(key, value, expiresAt);
+                ScheduleExpiration(key, expiresAt);
+                return;
+            }
+
+            batch.emplace_back(key, value);
+            if (batch.size() == LoadBatchSize)
+            {
+                engine->WriteMany(batch);
+                batch.clear();
+            }
+        });
+    engine->WriteMany(batch);
+
+    return snapshot.Size();
+}
+
+size_t Storage::ReplayLog(const std::string& filename)
+{
+    return WriteAheadLog::Replay(filename, [this](std::string_view key, std::string_view value, uint64_t expiresAt)
+        {
+            engine->Write(key, value, expiresAt);
+            ScheduleExpiration(key, expiresAt);
+        });
+}
 
+void Storage::SaveConfig(const std::string& filename)
+{
+    // Write aside and rename so a crash never leaves a truncated config.
+    const std::string temporaryName = filename + TemporarySuffix;
+    // Keys that have expired by now are left out.
+    const uint64_t now = NowMilliseconds();
+    if (options.snapshotFormat == SnapshotFormat::Binary)
     {
-        std::lock_guard<std::mutex> lock(dataMutex);
-        for (const auto& item: keysValues)
+        SnapshotWriter snapshot(temporaryName);
+        engine->ForEach([&snapshot, now](const std::string& key, const std::string& value, uint64_t expiresAt)
+            {
+                if (!StorageEngine::IsExpired(expiresAt, now))
+                {
+                    snapshot.Add(key, value, expiresAt);
+                }
+            });
+        snapshot.Finish();
+    }
+    else
+    {
+        boost::property_tree::ptree pt;
+        boost::property_tree::ptree expiring;
+        engine->ForEach([&pt, &expiring, now](const std::string& key, const std::string& value, uint64_t expiresAt)
+            {
+                if (StorageEngine::IsExpired(expiresAt, now))
+                {
+                    return;
+                }
+                pt.put(key, value);
+                if (expiresAt != 0)
+                {
+                    expiring.push_back(std::make_pair(key, boost::property_tree::ptree(std::to_string(expiresAt))));
+                }
+            });
+        if (!expiring.empty())
         {
-            pt.put(item.first, item.second);
+            pt.push_back(std::make_pair(ExpirationSection, std::move(expiring)));
         }
+        boost::property_tree::ini_parser::write_ini(temporaryName, pt);
+    }
+    if (options.durability != Durability::None)
+    {
+        SyncPath(temporaryName);
+    }
+    if (std::rename(temporaryName.c_str(), filename.c_str()) != 0)
+    {
+        throw std::runtime_error("Can't replace " + filename);
+    }
+    // The rename itself has to be durable before a compacted log is removed.
+    if (options.durability != Durability::None)
+    {
+        const std::filesystem::path directory = std::filesystem::path(filename).parent_path();
+        SyncPath(directory.empty() ? "." : directory.string());
     }
+}
 
-    boost::property_tree::ini_parser::write_ini(filename, pt);
+void Storage::CompactLog()
+{
+    // Every record in the rotated log was applied to its shard before the
+    // record was appended (both happen under the shard lock), so the snapshot
+    // taken after the rotation contains all of them. Records that land in the
+    // new log may be in the snapshot too; replaying them again is harmless.
+    // A rotated log still there means an earlier save failed; it's folded in
+    // by a snapshot of its own first, since rotating would replace it.
+    if (std::filesystem::exists(wal->RotatedPath()))
+    {
+        SaveConfig(configPath);
+        wal->RemoveRotated();
+    }
+    wal->Rotate();
+    SaveConfig(configPath);
+    wal->RemoveRotated();
+}
+
+bool Storage::CanSave(std::string_view key, std::string_view value) const
+{
+    if (options.snapshotFormat == SnapshotFormat::Binary)
+    {
+        return true;
+    }
+    // ptree paths are split at '.', and the expiration times are saved
+    // under a name of their own.
+    return !key.empty() && IsIniText(key) && IsIniText(value)
+           && key.front() != '[' && key.front() != ';' && key.front() != '#'
+           && key.find_first_of("=.") == std::string_view::npos && key != ExpirationSection;
 }
 
-std::string Storage::Read(const std::string& key) const
+std::string Storage::Read(std::string_view key) const
 {
     std::string result;
 
-    try
+    // if there is no such key then return empty string
+    Read(key, result);
+
+    return result;
+}
+
+bool Storage::Read(std::string_view key, std::string& value) const
+{
+    const uint64_t now = NowMilliseconds();
+    const ReadStatus status = engine->Read(key, value, now);
+    readCount.Add();
+
+    // The timer wheel would get to the key soon; erasing it now frees the
+    // memory sooner. Saves leave expired keys out, so nothing is changed.
+    if (status == ReadStatus::Expired && engine->EraseExpired(key, now))
     {
-        std::lock_guard<std::mutex> lock(dataMutex);
-        result = keysValues.at(key);
+        expiredCount.Add();
     }
-    catch(std::out_of_range&)
+    return status == ReadStatus::Found;
+}
+
+void Storage::Write(std::string_view key, std::string_view value)
+{
+    engine->Write(key, value, 0);
+
+    dataChanged = true;
+    writeCount.Add();
+}
+
+void Storage::Write(std::string_view key, std::string_view value, std::chrono::milliseconds ttl)
+{
+    const uint64_t expiresAt = NowMilliseconds() + ttl.count();
+    engine->Write(key, value, expiresAt);
+    ScheduleExpiration(key, expiresAt);
+
+    dataChanged = true;
+    writeCount.Add();
+}
+
+bool Storage::Expire(std::string_view key, std::chrono::milliseconds ttl)
+{
+    const uint64_t now = NowMilliseconds();
+    const uint64_t expiresAt = now + ttl.count();
+    if (!engine->Expire(key, expiresAt, now))
     {
-        // if there is no such key then return empty string
+        return false;
     }
-    ++readCount;
-    
-    return result;
+    ScheduleExpiration(key, expiresAt);
+
+    dataChanged = true;
+    writeCount.Add();
+    return true;
 }
 
-void Storage::Write(const std::string& key, const std::string& value)
+void Storage::WriteReplicated(std::string_view key, std::string_view value, uint64_t expiresAt)
 {
-    std::lock_guard<std::mutex> lock(dataMutex);
+    engine->Write(key, value, expiresAt);
+    ScheduleExpiration(key, expiresAt);
+
+    dataChanged = true;
+    writeCount.Add();
+}
 
-    keysValues[key] = value;
+void Storage::WriteReplicatedMany(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)
+{
+    engine->WriteMany(keysValues);
 
     dataChanged = true;
-    ++writeCount;
+    writeCount.Add(keysValues.size());
+}
+
+void Storage::AddReplica(int fd)
+{
+    replication->AddReplica(fd);
+}
+
+void Storage::ScheduleExpiration(std::string_view key, uint64_t expiresAt)
+{
+    if (expiresAt != 0)
+    {
+        expirations.Schedule(key, expiresAt);
+    }
+}
+
+std::vector<std::optional<std::string>> Storage::ReadMany(const std::vector<std::string_view>& keys) const
+{
+    std::vector<std::optional<std::string>> result = engine->ReadMany(keys, NowMilliseconds());
+    readCount.Add(keys.size());
+
+    return result;
+}
+
+void Storage::WriteMany(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)
+{
+    engine->WriteMany(keysValues);
+
+    dataChanged = true;
+    writeCount.Add(keysValues.size());
 }
 
 void Storage::SaveThread()
@@ -97,16 +405,97 @@ void Storage::SaveThread()
     {
         std::this_thread::sleep_for(SavePeriod);
 
-        if (dataChanged)
+        try
+        {
+            std::lock_guard<std::mutex> lock(saveMutex);
+            if (wal)
+            {
+                if (options.durability == Durability::None)
+                {
+                    wal->Flush();
+                }
+                else
+                {
+                    wal->Sync();
+                }
+                if (wal->Size() >= options.walCompactionSize)
+                {
+                    BOOST_LOG_TRIVIAL(debug) << "Compacting log of " << wal->Size() << " bytes.";
+                    CompactLog();
+                }
+            }
+            else if (dataChanged.exchange(false))
+            {
+                SaveConfig(configPath);
+            }
+        }
+        catch (std::exception& e)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Saving storage: " << e.what();
+            dataChanged = true;
+        }
+    }
+}
+
+void Storage::ExpiryThread()
+{
+    // Each key is erased under its own shard lock, so readers and writers of
+    // other keys wait for one erase at most.
+    while (!stopThread)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(TimerWheel::TickMilliseconds));
+
+        const uint64_t now = NowMilliseconds();
+        size_t erased = 0;
+        for (const std::string& key: expirations.Advance(now))
+        {
+            erased += engine->EraseExpired(key, now) ? 1 : 0;
+        }
+        if (erased > 0)
         {
-            SaveConfig(configPath);
+            expiredCount.Add(erased);
+            dataChanged = true;
         }
     }
 }
 
+uint64_t Storage::WritePosition() const
+{
+    return options.durability == Durability::SyncOnAck && wal ? wal->ThreadPosition() : 0;
+}
+
+void Storage::Sync(uint64_t position)
+{
+    if (wal)
+    {
+        wal->Sync(position);
+    }
+}
+
+void Storage::Save()
+{
+    std::lock_guard<std::mutex> lock(saveMutex);
+    if (wal)
+    {
+        wal->Flush();
+        CompactLog();
+    }
+    else
+    {
+        dataChanged = false;
+        SaveConfig(configPath);
+    }
+}
+
 StorageStatistics Storage::GetStatistics() const
 {
-    StorageStatistics result {readCount, writeCount};
+    StorageStatistics result {readCount.Load(), writeCount.Load(), expiredCount.Load(), engine->EvictionCount(),
+                              wal ? wal->SyncCount() : 0, replication->ReplicaCount()};
 
     return result;
 }
+
+MemoryUsage Storage::GetMemoryUsage() const
+{
+    return engine->Memory();
+}
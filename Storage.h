@@ -1,44 +1,189 @@
-
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
-#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "StorageEngine.h"
+#include "StripedCounter.h"
+#include "TimerWheel.h"
+
+class ReplicationSource;
+class WriteAheadLog;
 
 struct StorageStatistics
 {
-    unsigned int readCount;
-    unsigned int writeCount;
+    uint64_t readCount;
+    uint64_t writeCount;
+    // Keys erased because their time to live ran out.
+    uint64_t expiredCount;
+    // Keys erased to stay within StorageOptions::memoryLimit.
+    uint64_t evictionCount;
+    // fdatasync() calls made on the log; with Durability::SyncOnAck writes
+    // per sync show how well they are batched.
+    uint64_t syncCount;
+    // Replicas streaming changes from this storage.
+    size_t replicaCount;
+};
+
+enum class PersistenceMode
+{
+    // Rewrite the whole config file every save period if anything changed.
+    Snapshot,
+    // Append every write to a log next to the config file and fold the log
+    // into a new config file in the background once it grows large.
+    Wal
+};
+
+enum class Durability
+{
+    // Changes reach the files in the background and are never synced; a
+    // machine crash may lose whatever the kernel hasn't written back yet.
+    None,
+    // The save thread syncs what it writes every save period, so at most
+    // one period of acknowledged writes is lost.
+    Periodic,
+    // Needs PersistenceMode::Wal. Sync() returns once every write made
+    // before it is on disk; writers syncing at the same time share one
+    // fdatasync() of the log.
+    SyncOnAck
+};
+
+enum class EngineType
+{
+    // Shards guarded by reader/writer locks.
+    Sharded,
+    // Lock-free reads of published immutable shards; see LockFreeEngine.h.
+    LockFree,
+    // Shards guarded by reader/writer locks, packed tightly; see CompactMap.h.
+    Compact
+};
+
+enum class SnapshotFormat
+{
+    // Text 'key=value' lines, see boost::property_tree::ini_parser.
+    Ini,
+    // Memory mapped at load, see BinarySnapshot.h.
+    Binary
+};
+
+struct StorageOptions
+{
+    EngineType engine = EngineType::Sharded;
+    size_t shardCount = 16;
+    PersistenceMode persistence = PersistenceMode::Snapshot;
+    Durability durability = Durability::Periodic;
+    // Format the config file is saved in; either format is loaded.
+    SnapshotFormat snapshotFormat = SnapshotFormat::Ini;
+    size_t walCompactionSize = 64 * 1024 * 1024;
+    // Bytes of keys and values (as the engine estimates them) beyond which
+    // keys that haven't been used lately are evicted; 0 is no limit.
+    size_t memoryLimit = 0;
+    // Threads parsing an INI config at startup.
+    size_t loadThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    // Save changes from a background thread; otherwise only Save() and the
+    // destructor do.
+    bool backgroundSave = true;
 };
 
 class Storage
 {
 public:
-    Storage(const std::string& configPath);
+    Storage(const std::string& configPath, const StorageOptions& options = StorageOptions());
     ~Storage();
 
-    std::string Read(const std::string& key) const;
-    void Write(const std::string& key, const std::string& value);
+    std::string Read(std::string_view key) const;
+    // Returns false if there is no such key or it has expired.
+    bool Read(std::string_view key, std::string& value) const;
+    // The key never expires, even if it was going to.
+    void Write(std::string_view key, std::string_view value);
+    // The key expires once 'ttl' passes. Expired keys read as missing and
+    // are erased in the background.
+    void Write(std::string_view key, std::string_view value, std::chrono::milliseconds ttl);
+    // Makes an existing key expire once 'ttl' passes; returns false if there
+    // is no such key.
+    bool Expire(std::string_view key, std::chrono::milliseconds ttl);
+
+    // Batch versions lock every shard involved once for the whole batch.
+    // ReadMany sees either all or none of the pairs of any WriteMany. An
+    // element of the result is empty if its key isn't found.
+    std::vector<std::optional<std::string>> ReadMany(const std::vector<std::string_view>& keys) const;
+    // Applies all pairs atomically; a later pair wins over an earlier one
+    // with the same key.
+    void WriteMany(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues);
+
+    // Whether the config file can hold the pair as it is. A binary snapshot
+    // holds any bytes; an INI config loses line breaks, whitespace around
+    // keys and values and keys with '=' or '.' in them or starting like a
+    // section or a comment, and a key named ExpirationSection would clash
+    // with that section, so writes of such pairs are to be refused.
+    bool CanSave(std::string_view key, std::string_view value) const;
+
+    // With Durability::SyncOnAck where the last write the calling thread
+    // made ends in the log; it changes only when the thread writes. 0 with
+    // other modes, as writes are acknowledged at once then.
+    uint64_t WritePosition() const;
+    // Waits until the writes up to 'position' are on disk, so they can be
+    // acknowledged.
+    void Sync(uint64_t position);
+
+    // Applies a change streamed from the primary; see ReplicaClient.
+    void WriteReplicated(std::string_view key, std::string_view value, uint64_t expiresAt);
+    // Applies a batch streamed from the primary atomically, as WriteMany().
+    void WriteReplicatedMany(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues);
+    // Takes the connected socket 'fd' of a replica over and streams every
+    // key and then every change to it, see ReplicateCommand in Protocol.h.
+    void AddReplica(int fd);
+
+    // Writes everything to the config file now.
+    void Save();
 
     StorageStatistics GetStatistics() const;
+    // Takes time proportional to the number of keys.
+    MemoryUsage GetMemoryUsage() const;
 private:
     const std::chrono::seconds SavePeriod = std::chrono::seconds(1);
-    
-    std::unordered_map<std::string, std::string> keysValues;
+
+    const StorageOptions options;
+    std::unique_ptr<StorageEngine> engine;
     std::string configPath;
+    std::unique_ptr<WriteAheadLog> wal;
+    // Every change goes through it on to the log, if there is one.
+    std::unique_ptr<ReplicationSource> replication;
 
-    mutable std::mutex dataMutex;
     std::thread saveThread;
+    // Serializes saves from the thread and from Save().
+    std::mutex saveMutex;
     std::atomic_bool dataChanged;
     std::atomic_bool stopThread;
 
+    // Expiration times of the keys that expire, advanced by expiryThread.
+    TimerWheel expirations;
+    std::thread expiryThread;
+
     // statistics
-    mutable std::atomic_uint readCount;
-    mutable std::atomic_uint writeCount;
+    mutable StripedCounter readCount;
+    StripedCounter writeCount;
+    mutable StripedCounter expiredCount;
 
     void LoadConfig(const std::string& filename);
+    // Both return the number of keys loaded.
+    size_t LoadIni(const std::string& filename);
+    size_t LoadSnapshot(const std::string& filename);
     void SaveConfig(const std::string& filename);
     void SaveThread();
+    void ExpiryThread();
+    void ScheduleExpiration(std::string_view key, uint64_t expiresAt);
+
+    size_t ReplayLog(const std::string& filename);
+    void CompactLog();
 };
@@ -0,0 +1,17 @@
+#include "StorageEngine.h"
+
+#include <algorithm>
+
+std::vector<size_t> StorageEngine::ShardIndexes(const std::vector<size_t>& hashes, size_t shardCount)
+{
+    std::vector<size_t> result;
+    result.reserve(hashes.size());
+    for (size_t hash: hashes)
+    {
+        result.push_back(ShardIndex(hash, shardCount));
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "ChangeLog.h"
+#include "MemoryUsage.h"
+#include "PersistentMap.h"
+#include "StripedCounter.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class ReadStatus
+{
+    Found,
+    Missing,
+    // The key is there but its expiration time has passed.
+    Expired
+};
+
+// Keeps the keys and values of a Storage in memory. Storage takes care of
+// loading, saving and statistics; every method of an engine may be called
+// from any number of threads at once.
+class StorageEngine
+{
+public:
+    using KeyValue = std::pair<std::string_view, std::string_view>;
+
+    explicit StorageEngine(size_t shardCount) : shardCount(shardCount) {}
+    virtual ~StorageEngine() = default;
+
+    // Times are milliseconds since the Unix epoch, see NowMilliseconds(). A
+    // key expires once 'now' reaches its expiration time; 0 is never. An
+    // expired key reads as missing but stays until EraseExpired().
+    static bool IsExpired(uint64_t expiresAt, uint64_t now)
+    {
+        return expiresAt != 0 && expiresAt <= now;
+    }
+
+    virtual ReadStatus Read(std::string_view key, std::string& value, uint64_t now) const = 0;
+    // Sees either all or none of the pairs of any WriteMany.
+    virtual std::vector<std::optional<std::string>> ReadMany(const std::vector<std::string_view>& keys,
+                                                             uint64_t now) const = 0;
+    virtual void Write(std::string_view key, std::string_view value, uint64_t expiresAt) = 0;
+    // Applies all pairs atomically; a later pair wins over an earlier one
+    // with the same key. The pairs never expire.
+    virtual void WriteMany(const std::vector<KeyValue>& keysValues) = 0;
+    // Changes the expiration time of a key that hasn't expired at 'now'.
+    // Returns false if there is no such key.
+    virtual bool Expire(std::string_view key, uint64_t expiresAt, uint64_t now) = 0;
+    // Erases the key if it has expired at 'now'; returns whether it did.
+    virtual bool EraseExpired(std::string_view key, uint64_t now) = 0;
+
+    // Visits a point-in-time view of every shard without blocking writers
+    // for the whole visit.
+    virtual void ForEach(const PersistentMap::Visitor& visitor) const = 0;
+
+    // Bytes held by the keys and values of every shard.
+    virtual MemoryUsage Memory() const = 0;
+
+    // Once set, every change is appended to the log while no other change
+    // of the same keys can be made, so the log order matches the data.
+    void SetLog(ChangeLog* log) { changeLog = log; }
+
+    // Keeps every shard within an equal share of 'bytes', as estimated by its
+    // map, by evicting keys that haven't been read or written lately after
+    // each write to the shard; 0 is no limit. Evictions aren't logged, so a
+    // replayed log may bring evicted keys back until the next writes.
+    void SetMemoryLimit(size_t bytes)
+    {
+        shardMemoryLimit = bytes == 0 ? 0 : std::max<size_t>(bytes / shardCount, 1);
+    }
+    uint64_t EvictionCount() const { return evictionCount.Load(); }
+
+    // Keys of one shard never contend with keys of another one, so bulk
+    // loaders split work by shard.
+    size_t ShardCount() const { return shardCount; }
+    size_t ShardOf(size_t hash) const { return ShardIndex(hash, shardCount); }
+protected:
+    const size_t shardCount;
+    ChangeLog* changeLog = nullptr;
+    size_t shardMemoryLimit = 0;
+    StripedCounter evictionCount;
+
+    // The high half of the hash selects the shard so that the low bits stay
+    // well distributed for the shard's own trie.
+    static size_t ShardIndex(size_t hash, size_t shardCount)
+    {
+        return (hash >> (sizeof(size_t) * 4)) % shardCount;
+    }
+
+    // Sorted distinct shards of 'hashes'. Batches lock or publish shards in
+    // this order, so they can't deadlock.
+    static std::vector<size_t> ShardIndexes(const std::vector<size_t>& hashes, size_t shardCount);
+
+    // Evicts keys of a shard's 'map' until it fits into the shard's share of
+    // the memory limit, sweeping from 'hand'. The caller holds the shard's
+    // write lock.
+    template <typename Map>
+    void Evict(Map& map, size_t& hand)
+    {
+        if (shardMemoryLimit == 0)
+        {
+            return;
+        }
+
+        std::vector<std::string> victims;
+        while (map.Bytes() > shardMemoryLimit && map.Size() > 0)
+        {
+            victims.clear();
+            map.Sweep(hand, EvictionBatchSize, victims);
+            for (const std::string& key: victims)
+            {
+                map.Erase(key, PersistentMap::Hash(key));
+            }
+            evictionCount.Add(victims.size());
+        }
+    }
+private:
+    // Keys a sweep looks for at a time.
+    static const size_t EvictionBatchSize = 16;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Counter for frequent updates from many threads. Each thread adds to its
+// own cache-line-sized stripe, so threads rarely write to a shared line;
+// reading the value sums the stripes.
+class StripedCounter
+{
+public:
+    void Add(uint64_t count = 1)
+    {
+        stripes[ThreadStripe()].value.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    uint64_t Load() const
+    {
+        uint64_t result = 0;
+        for (const Stripe& stripe: stripes)
+        {
+            result += stripe.value.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+private:
+    static const size_t StripeCount = 64;
+
+    struct alignas(64) Stripe
+    {
+        std::atomic<uint64_t> value {0};
+    };
+
+    Stripe stripes[StripeCount];
+
+    static size_t ThreadStripe()
+    {
+        static std::atomic<size_t> nextStripe {0};
+        thread_local const size_t stripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % StripeCount;
+        return stripe;
+    }
+};
@@ -0,0 +1,125 @@
+#include "TimerWheel.h"
+
+#include <algorithm>
+#include <ctime>
+#include <iterator>
+
+uint64_t NowMilliseconds()
+{
+    struct timespec now {};
+    ::clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return uint64_t(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+TimerWheel::TimerWheel(uint64_t now) :
+    currentTick(now / TickMilliseconds), size(0)
+{
+}
+
+void TimerWheel::Schedule(std::string_view key, uint64_t expiresAt)
+{
+    // The tick that has fully passed at 'expiresAt'.
+    const uint64_t tick = (expiresAt + TickMilliseconds - 1) / TickMilliseconds;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> due;
+    // A time that has already passed fires on the next tick.
+    Insert(Timer { std::string(key), std::max(tick, currentTick + 1) }, due);
+    ++size;
+}
+
+void TimerWheel::Insert(Timer&& timer, std::vector<std::string>& due)
+{
+    if (timer.tick <= currentTick)
+    {
+        due.push_back(std::move(timer.key));
+        --size;
+        return;
+    }
+
+    const uint64_t delta = timer.tick - currentTick;
+    for (size_t level = 0; level < LevelCount; ++level)
+    {
+        if (delta >> (SlotBits * (level + 1)) == 0)
+        {
+            const size_t index = (timer.tick >> (SlotBits * level)) & (SlotCount - 1);
+            levels[level][index].push_back(std::move(timer));
+            return;
+        }
+    }
+    overflow.push_back(std::move(timer));
+}
+
+void TimerWheel::Cascade(Slot& slot, std::vector<std::string>& due)
+{
+    Slot timers;
+    timers.swap(slot);
+    for (Timer& timer: timers)
+    {
+        Insert(std::move(timer), due);
+    }
+}
+
+std::vector<std::string> TimerWheel::Advance(uint64_t now)
+{
+    const uint64_t targetTick = now / TickMilliseconds;
+    std::vector<std::string> due;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (targetTick > currentTick && targetTick - currentTick > JumpTicks)
+    {
+        Jump(targetTick, due);
+        return due;
+    }
+    while (currentTick < targetTick)
+    {
+        ++currentTick;
+
+        // Each level below has just completed a turn: its slot for the
+        // coming ticks is filled from the level above.
+        size_t level = 1;
+        for (; level < LevelCount; ++level)
+        {
+            const uint64_t lowerTicks = currentTick & ((uint64_t(1) << (SlotBits * level)) - 1);
+            if (lowerTicks != 0)
+            {
+                break;
+            }
+            Cascade(levels[level][(currentTick >> (SlotBits * level)) & (SlotCount - 1)], due);
+        }
+        if (level == LevelCount && (currentTick & ((uint64_t(1) << (SlotBits * LevelCount)) - 1)) == 0)
+        {
+            Cascade(overflow, due);
+        }
+
+        Cascade(levels[0][currentTick & (SlotCount - 1)], due);
+    }
+    return due;
+}
+
+void TimerWheel::Jump(uint64_t tick, std::vector<std::string>& due)
+{
+    // Takes time in the number of timers and slots, not of ticks skipped.
+    Slot timers;
+    timers.swap(overflow);
+    for (auto& level: levels)
+    {
+        for (Slot& slot: level)
+        {
+            std::move(slot.begin(), slot.end(), std::back_inserter(timers));
+            slot.clear();
+        }
+    }
+
+    currentTick = tick;
+    for (Timer& timer: timers)
+    {
+        Insert(std::move(timer), due);
+    }
+}
+
+size_t TimerWheel::Size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return size;
+}
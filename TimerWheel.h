@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Milliseconds since the Unix epoch from a coarse clock, cheap enough to
+// read on every request. Expiration times are kept in these units so that
+// they survive a restart.
+uint64_t NowMilliseconds();
+
+// Hierarchical timing wheel of key expiration times.
+//
+// Level 0 has a slot per tick, every next level a slot per whole turn of the
+// level below it; a timer goes to the lowest level whose span covers it and
+// moves down a level each time the slot it's in comes round. Scheduling and
+// advancing by a tick take constant time whatever the number of timers, and
+// nothing ever scans the keys. Times beyond the top level wait in an
+// overflow list that is looked at once per turn of the top level.
+// Thread safe.
+class TimerWheel
+{
+public:
+    explicit TimerWheel(uint64_t now);
+
+    void Schedule(std::string_view key, uint64_t expiresAt);
+    // Moves the wheel on to 'now' and returns the keys whose time has come.
+    // A key may still have been given a later time since it was scheduled.
+    std::vector<std::string> Advance(uint64_t now);
+
+    size_t Size() const;
+
+    static constexpr uint64_t TickMilliseconds = 100;
+private:
+    static constexpr unsigned SlotBits = 6;
+    static constexpr size_t SlotCount = size_t(1) << SlotBits;
+    static constexpr size_t LevelCount = 4;
+    // Beyond this many ticks, as after the clock is set forward, Advance()
+    // refiles every timer at once rather than going tick by tick.
+    static constexpr uint64_t JumpTicks = SlotCount * SlotCount;
+
+    struct Timer
+    {
+        std::string key;
+        uint64_t tick;
+    };
+
+    using Slot = std::vector<Timer>;
+
+    mutable std::mutex mutex;
+    std::array<std::array<Slot, SlotCount>, LevelCount> levels;
+    Slot overflow;
+    // Every timer up to this tick has fired.
+    uint64_t currentTick;
+    size_t size;
+
+    void Insert(Timer&& timer, std::vector<std::string>& due);
+    void Cascade(Slot& slot, std::vector<std::string>& due);
+    void Jump(uint64_t tick, std::vector<std::string>& due);
+};
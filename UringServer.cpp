@@ -0,0 +1,618 @@
+#include "UringServer.h"
+
+#include "IoUring.h"
+#include "Session.h"
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    const unsigned RingEntries = 1024;
+    const uint16_t BufferGroup = 0;
+    const unsigned BufferCount = 512;
+    const size_t BufferSize = 4096;
+    // Input buffered while responses are sent beyond which receiving pauses.
+    const size_t MaxBufferedInput = 1024 * 1024;
+    // Accepting pauses this long once descriptors or memory run out.
+    const __kernel_timespec AcceptPause {0, 100 * 1000 * 1000};
+
+    // The operation is kept in the low bits of the completion's user data,
+    // the connection in the rest.
+    enum Operation : uint64_t
+    {
+        Accept,
+        AcceptLocal,
+        Wake,
+        Receive,
+        Send,
+        Cancel,
+        // Pauses before an Accept or AcceptLocal is armed again.
+        PauseAccept,
+        PauseAcceptLocal
+    };
+    const uint64_t OperationMask = 7;
+}
+
+class UringServer::Worker
+{
+public:
+    Worker(Server& server, int listenFd, int localListenFd);
+    ~Worker();
+
+    void Run();
+    // Makes Run() return; may be called from any thread.
+    void Stop();
+private:
+    struct Connection
+    {
+        Connection(Server& server, int fd) :
+            fd(fd), session(server)
+        {
+        }
+
+        int fd;
+        Session session;
+        std::list<Connection>::iterator position;
+        // Submitted operations the kernel hasn't finished yet.
+        unsigned pending = 0;
+        bool receiving = false;
+        bool sending = false;
+        // Responses wait for their writes to reach the disk, which counts
+        // as pending too; like a send it holds further commands back.
+        bool syncing = false;
+        bool closing = false;
+        std::vector<iovec> iovecs;
+        msghdr message {};
+    };
+    static_assert(alignof(Connection) > OperationMask, "user data needs free low bits");
+
+    Server& server;
+    const int listenFd;
+    const int localListenFd;
+    std::unique_ptr<IoUring> ring;
+    int wakeFd;
+    uint64_t wakeValue;
+    bool multishotAccept;
+    bool bufferRing;
+    bool multishotReceive;
+    bool stopping;
+    // Set by Stop(); the Wake completion otherwise brings finished syncs.
+    std::atomic_bool stopRequested;
+    std::list<Connection> connections;
+
+    std::mutex syncedMutex;
+    // Connections whose sync finished, and whether it succeeded.
+    std::vector<std::pair<Connection*, bool>> synced;
+
+    static uint64_t UserData(Connection* connection, Operation operation)
+    {
+        return reinterpret_cast<uint64_t>(connection) | operation;
+    }
+
+    // 'operation' is Accept or AcceptLocal.
+    void ArmAccept(Operation operation);
+    void PauseAccepting(Operation operation);
+    void ArmWake();
+    // Resumes the connections in 'synced'.
+    void TakeSynced();
+    void ArmReceive(Connection& connection);
+    void StartSend(Connection& connection);
+    void CancelReceive(Connection& connection);
+    void Close(Connection& connection);
+    // Gives a copy of the socket to whatever the session asked to hand over
+    // to and lets the connection go without shutting the socket down.
+    void HandOver(Connection& connection);
+
+    void Complete(const io_uring_cqe& completion);
+    void OnAccept(const io_uring_cqe& completion, Operation operation);
+    void OnReceive(Connection& connection, const io_uring_cqe& completion);
+    void OnSend(Connection& connection, const io_uring_cqe& completion);
+    // Runs the received commands and sends their responses.
+    void ProcessInput(Connection& connection);
+};
+
+UringServer::Worker::Worker(Server& server, int listenFd, int localListenFd) :
+    server(server), listenFd(listenFd), localListenFd(localListenFd), ring(std::make_unique<IoUring>(RingEntries)), wakeFd(-1), wakeValue(0),
+    multishotAccept(true), bufferRing(false), multishotReceive(false), stopping(false),
+    stopRequested(false)
+{
+    for (const uint8_t opcode: {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ,
+                                IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT})
+    {
+        if (!ring->Supports(opcode))
+        {
+            throw std::runtime_error("io_uring has no operation " + std::to_string(opcode));
+        }
+    }
+
+    wakeFd = ::eventfd(0, EFD_CLOEXEC);
+    if (wakeFd < 0)
+    {
+        throw std::runtime_error(std::string("Can't create an eventfd: ") + std::strerror(errno));
+    }
+
+    // Without provided buffers every idle connection would pin a receive
+    // buffer of its own, and receives couldn't be multishot.
+    bufferRing = ring->RegisterBufferRing(BufferGroup, BufferCount, BufferSize);
+    multishotReceive = bufferRing;
+}
+
+UringServer::Worker::~Worker()
+{
+    // Closing the ring cancels whatever is in flight before the connections'
+    // buffers go away.
+    ring.reset();
+    for (Connection& connection: connections)
+    {
+        ::close(connection.fd);
+    }
+    connections.clear();
+    ::close(wakeFd);
+}
+
+void UringServer::Worker::Run()
+{
+    try
+    {
+        ArmAccept(Accept);
+        if (localListenFd != -1)
+        {
+            ArmAccept(AcceptLocal);
+        }
+        ArmWake();
+        while (!stopping)
+        {
+            // Everything queued while handling the last batch goes out with
+            // the wait for the next one.
+            ring->Submit(1);
+            ring->ForEachCompletion([this](const io_uring_cqe& completion)
+                {
+                    Complete(completion);
+                });
+        }
+    }
+    catch (const std::exception& error)
+    {
+        BOOST_LOG_TRIVIAL(error) << "io_uring worker stopped: " << error.what();
+    }
+}
+
+void UringServer::Worker::Stop()
+{
+    stopRequested = true;
+    const uint64_t one = 1;
+    if (::write(wakeFd, &one, sizeof(one)) != sizeof(one))
+    {
+        BOOST_LOG_TRIVIAL(error) << "Can't wake an io_uring worker: " << std::strerror(errno);
+    }
+}
+
+void UringServer::Worker::ArmAccept(Operation operation)
+{
+    io_uring_sqe& entry = ring->NextEntry();
+    entry.opcode = IORING_OP_ACCEPT;
+    entry.fd = operation == AcceptLocal ? localListenFd : listenFd;
+    entry.accept_flags = SOCK_CLOEXEC;
+    if (multishotAccept)
+    {
+        entry.ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    entry.user_data = UserData(nullptr, operation);
+}
+
+void UringServer::Worker::PauseAccepting(Operation operation)
+{
+    io_uring_sqe& entry = ring->NextEntry();
+    entry.opcode = IORING_OP_TIMEOUT;
+    entry.fd = -1;
+    entry.addr = reinterpret_cast<uint64_t>(&AcceptPause);
+    entry.len = 1;
+    entry.user_data = UserData(nullptr, operation == AcceptLocal ? PauseAcceptLocal : PauseAccept);
+}
+
+void UringServer::Worker::ArmWake()
+{
+    io_uring_sqe& entry = ring->NextEntry();
+    entry.opcode = IORING_OP_READ;
+    entry.fd = wakeFd;
+    entry.addr = reinterpret_cast<uint64_t>(&wakeValue);
+    entry.len = sizeof(wakeValue);
+    entry.user_data = UserData(nullptr, Wake);
+}
+
+void UringServer::Worker::ArmReceive(Connection& connection)
+{
+    io_uring_sqe& entry = ring->NextEntry();
+    entry.opcode = IORING_OP_RECV;
+    entry.fd = connection.fd;
+    if (bufferRing)
+    {
+        entry.flags = IOSQE_BUFFER_SELECT;
+        entry.buf_group = BufferGroup;
+        if (multishotReceive)
+        {
+            entry.ioprio = IORING_RECV_MULTISHOT;
+        }
+    }
+    else
+    {
+        const boost::asio::mutable_buffer space = connection.session.Input().Prepare();
+        entry.addr = reinterpret_cast<uint64_t>(space.data());
+        entry.len = static_cast<uint32_t>(space.size());
+    }
+    entry.user_data = UserData(&connection, Receive);
+    connection.receiving = true;
+    ++connection.pending;
+}
+
+void UringServer::Worker::StartSend(Connection& connection)
+{
+    // Responses to everything pipelined go out in one gathered send.
+    const std::vector<boost::asio::const_buffer>& output = connection.session.Output();
+    connection.iovecs.resize(std::min<size_t>(output.size(), IOV_MAX));
+    for (size_t i = 0; i < connection.iovecs.size(); ++i)
+    {
+        connection.iovecs[i].iov_base = const_cast<void*>(output[i].data());
+        connection.iovecs[i].iov_len = output[i].size();
+    }
+    connection.message = msghdr {};
+    connection.message.msg_iov = connection.iovecs.data();
+    connection.message.msg_iovlen = connection.iovecs.size();
+
+    io_uring_sqe& entry = ring->NextEntry();
+    entry.opcode = IORING_OP_SENDMSG;
+    entry.fd = connection.fd;
+    entry.addr = reinterpret_cast<uint64_t>(&connection.message);
+    entry.len = 1;
+    entry.msg_flags = MSG_NOSIGNAL;
+    entry.user_data = UserData(&connection, Send);
+    connection.sending = true;
+    ++connection.pending;
+}
+
+void UringServer::Worker::CancelReceive(Connection& connection)
+{
+    io_uring_sqe& entry = ring->NextEntry();
+    entry.opcode = IORING_OP_ASYNC_CANCEL;
+    entry.addr = UserData(&connection, Receive);
+    entry.user_data = UserData(&connection, Cancel);
+    ++connection.pending;
+}
+
+void UringServer::Worker::Close(Connection& connection)
+{
+    // Operations in flight finish with an error or end of file; the
+    // connection is freed after the last one.
+    connection.closing = true;
+    ::shutdown(connection.fd, SHUT_RDWR);
+}
+
+void UringServer::Worker::HandOver(Connection& connection)
+{
+    const int fd = ::fcntl(connection.fd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Can't hand a connection over: " << std::strerror(errno);
+        Close(connection);
+        return;
+    }
+    connection.session.HandOver(fd);
+
+    connection.closing = true;
+    if (connection.receiving)
+    {
+        CancelReceive(connection);
+    }
+}
+
+void UringServer::Worker::Complete(const io_uring_cqe& completion)
+{
+    const Operation operation = static_cast<Operation>(completion.user_data & OperationMask);
+    Connection* connection = reinterpret_cast<Connection*>(completion.user_data & ~OperationMask);
+
+    switch (operation)
+    {
+    case Accept:
+    case AcceptLocal:
+        OnAccept(completion, operation);
+        return;
+    case PauseAccept:
+    case PauseAcceptLocal:
+        if (!stopping)
+        {
+            ArmAccept(operation == PauseAcceptLocal ? AcceptLocal : Accept);
+        }
+        return;
+    case Wake:
+        if (stopRequested)
+        {
+            stopping = true;
+            return;
+        }
+        TakeSynced();
+        ArmWake();
+        return;
+    case Receive:
+        OnReceive(*connection, completion);
+        break;
+    case Send:
+        OnSend(*connection, completion);
+        break;
+    case Cancel:
+        --connection->pending;
+        break;
+    }
+
+    if (connection->closing && connection->pending == 0)
+    {
+        ::close(connection->fd);
+        connections.erase(connection->position);
+    }
+}
+
+void UringServer::Worker::OnAccept(const io_uring_cqe& completion, Operation operation)
+{
+    if (completion.res >= 0 && !server.Admit(completion.res))
+    {
+        ::close(completion.res);
+    }
+    else if (completion.res >= 0)
+    {
+        connections.emplace_back(server, completion.res);
+        Connection& connection = connections.back();
+        connection.position = std::prev(connections.end());
+
+        boost::asio::ip::tcp::endpoint peer;
+        socklen_t peerSize = peer.capacity();
+        if (operation == AcceptLocal)
+        {
+            BOOST_LOG_TRIVIAL(info) << "New connection from: the Unix socket";
+        }
+        else if (::getpeername(connection.fd, peer.data(), &peerSize) == 0)
+        {
+            peer.resize(peerSize);
+            BOOST_LOG_TRIVIAL(info) << "New connection from: " << peer;
+        }
+        ArmReceive(connection);
+    }
+    else if (completion.res == -EINVAL && multishotAccept)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "io_uring has no multishot accept";
+        multishotAccept = false;
+    }
+    else
+    {
+        BOOST_LOG_TRIVIAL(warning) << "error while accepting: " << std::strerror(-completion.res);
+    }
+
+    if ((completion.flags & IORING_CQE_F_MORE) || stopping)
+    {
+        return;
+    }
+    // Accepting again at once would only fail until a connection ends.
+    const int error = -completion.res;
+    if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+    {
+        PauseAccepting(operation);
+    }
+    else
+    {
+        ArmAccept(operation);
+    }
+}
+
+void UringServer::Worker::OnReceive(Connection& connection, const io_uring_cqe& completion)
+{
+    if (!(completion.flags & IORING_CQE_F_MORE))
+    {
+        connection.receiving = false;
+        --connection.pending;
+    }
+
+    ReceiveBuffer& input = connection.session.Input();
+    if (completion.res > 0 && (completion.flags & IORING_CQE_F_BUFFER))
+    {
+        const uint16_t id = static_cast<uint16_t>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+        const char* data = ring->Buffer(id);
+        size_t left = completion.res;
+        while (left > 0)
+        {
+            const boost::asio::mutable_buffer space = input.Prepare();
+            const size_t size = std::min(space.size(), left);
+            std::memcpy(space.data(), data, size);
+            input.Commit(size);
+            data += size;
+            left -= size;
+        }
+        ring->RecycleBuffer(id);
+    }
+    else if (completion.res > 0)
+    {
+        input.Commit(completion.res);
+    }
+
+    if (connection.closing)
+    {
+        return;
+    }
+    if (completion.res == -EINVAL && multishotReceive)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "io_uring has no multishot receive";
+        multishotReceive = false;
+    }
+    else if (completion.res == 0)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "Reading data: end of file";
+        Close(connection);
+        return;
+    }
+    // Out of provided buffers or paused while sending; receiving resumes
+    // below or after the send.
+    else if (completion.res < 0 && completion.res != -ENOBUFS && completion.res != -ECANCELED)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Error reading data: " << std::strerror(-completion.res);
+        Close(connection);
+        return;
+    }
+    else if (completion.res > 0 && !connection.sending && !connection.syncing)
+    {
+        ProcessInput(connection);
+    }
+    else if (completion.res > 0 && connection.receiving && input.Data().size() > MaxBufferedInput)
+    {
+        // The peer doesn't read its responses, stop taking more requests.
+        CancelReceive(connection);
+    }
+
+    if (!connection.closing && !connection.receiving && !connection.sending && !connection.syncing)
+    {
+        ArmReceive(connection);
+    }
+}
+
+void UringServer::Worker::OnSend(Connection& connection, const io_uring_cqe& completion)
+{
+    --connection.pending;
+    connection.sending = false;
+
+    if (connection.closing)
+    {
+        return;
+    }
+    if (completion.res < 0)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Error writing data: " << std::strerror(-completion.res);
+        Close(connection);
+        return;
+    }
+
+    connection.session.ConsumeOutput(completion.res);
+    if (connection.session.HasOutput())
+    {
+        StartSend(connection);
+        return;
+    }
+    // Commands received during the send.
+    ProcessInput(connection);
+    if (!connection.closing && !connection.receiving && !connection.sending && !connection.syncing)
+    {
+        ArmReceive(connection);
+    }
+}
+
+void UringServer::Worker::ProcessInput(Connection& connection)
+{
+    if (!connection.session.Process())
+    {
+        if (connection.session.HandOverRequested())
+        {
+            HandOver(connection);
+            return;
+        }
+        Close(connection);
+        return;
+    }
+    if (connection.session.SyncPending())
+    {
+        connection.syncing = true;
+        ++connection.pending;
+        // Called from the server's sync thread.
+        connection.session.WhenDurable([this, &connection](bool durable)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(syncedMutex);
+                    synced.emplace_back(&connection, durable);
+                }
+                const uint64_t one = 1;
+                if (::write(wakeFd, &one, sizeof(one)) != sizeof(one))
+                {
+                    BOOST_LOG_TRIVIAL(error) << "Can't wake an io_uring worker: " << std::strerror(errno);
+                }
+            });
+        return;
+    }
+    if (connection.session.HasOutput())
+    {
+        StartSend(connection);
+    }
+}
+
+void UringServer::Worker::TakeSynced()
+{
+    std::vector<std::pair<Connection*, bool>> finished;
+    {
+        std::lock_guard<std::mutex> lock(syncedMutex);
+        finished.swap(synced);
+    }
+    for (const auto& [connection, durable]: finished)
+    {
+        connection->syncing = false;
+        --connection->pending;
+        if (!durable && !connection->closing)
+        {
+            Close(*connection);
+        }
+        else if (!connection->closing && connection->session.HasOutput())
+        {
+            StartSend(*connection);
+        }
+        else if (!connection->closing)
+        {
+            // Commands received during the sync.
+            ProcessInput(*connection);
+            if (!connection->closing && !connection->receiving && !connection->sending && !connection->syncing)
+            {
+                ArmReceive(*connection);
+            }
+        }
+
+        // No completion may be left to free it, as in Complete().
+        if (connection->closing && connection->pending == 0)
+        {
+            ::close(connection->fd);
+            connections.erase(connection->position);
+        }
+    }
+}
+
+UringServer::UringServer(Server& server, const std::vector<int>& listenFds, int localListenFd, size_t threadCount)
+{
+    // Rings are set up here so a kernel without io_uring is reported to the
+    // caller rather than to a worker thread.
+    for (size_t i = 0; i < std::max<size_t>(threadCount, 1); ++i)
+    {
+        workers.push_back(std::make_unique<Worker>(server, listenFds[i % listenFds.size()], localListenFd));
+    }
+    for (auto& worker: workers)
+    {
+        threads.emplace_back(&Worker::Run, worker.get());
+    }
+}
+
+UringServer::~UringServer()
+{
+    for (auto& worker: workers)
+    {
+        worker->Stop();
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    BOOST_LOG_TRIVIAL(trace) << "io_uring worker threads are joined";
+}
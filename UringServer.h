@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+class Server;
+
+// Serves connections with io_uring instead of readiness polling: every
+// worker thread owns a ring and has accepts, receives and sends of its
+// connections completed by the kernel, so a batch of requests costs one
+// system call per loop iteration. Accepts and receives are multishot and
+// receive into a ring of kernel registered buffers where the kernel allows.
+class UringServer
+{
+public:
+    // Worker i accepts on listenFds[i % listenFds.size()]: either all share
+    // one socket or each has its own, bound with SO_REUSEPORT. All accept on
+    // the Unix domain socket 'localListenFd' too, unless it is -1. Throws
+    // std::runtime_error if the kernel lacks io_uring or an operation needed,
+    // in which case the caller should use another mode.
+    UringServer(Server& server, const std::vector<int>& listenFds, int localListenFd, size_t threadCount);
+    // Stops the workers and closes their connections.
+    ~UringServer();
+
+    UringServer(const UringServer&) = delete;
+    UringServer& operator=(const UringServer&) = delete;
+private:
+    class Worker;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+};
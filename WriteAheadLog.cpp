@@ -0,0 +1,383 @@
+#include "WriteAheadLog.h"
+
+#include <boost/crc.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const size_t RecordHeaderSize = 3 * sizeof(uint32_t);
+    const size_t EntryHeaderSize = 2 * sizeof(uint32_t);
+    const uint32_t BatchMarker = 0xFFFFFFFF;
+    const uint32_t ExpiringMarker = 0xFFFFFFFE;
+
+    // The log the calling thread appended to last and where its last record
+    // ends there.
+    thread_local const WriteAheadLog* lastAppendLog = nullptr;
+    thread_local uint64_t lastAppendEnd = 0;
+
+    void AppendUint32(std::string& out, uint32_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    uint32_t ReadUint32(const char* data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    uint32_t Checksum(const char* data, size_t size)
+    {
+        boost::crc_32_type crc;
+        crc.process_bytes(data, size);
+        return crc.checksum();
+    }
+
+    void AppendEntry(std::string& out, std::string_view key, std::string_view value)
+    {
+        AppendUint32(out, key.size());
+        AppendUint32(out, value.size());
+        out.append(key);
+        out.append(value);
+    }
+
+    // Fills in the checksum of the record that starts at 'recordStart'.
+    void SealRecord(std::string& out, size_t recordStart)
+    {
+        const size_t checksumSize = sizeof(uint32_t);
+        const uint32_t checksum = Checksum(out.data() + recordStart + checksumSize,
+                                           out.size() - recordStart - checksumSize);
+        std::memcpy(&out[recordStart], &checksum, sizeof(checksum));
+    }
+}
+
+WriteAheadLog::WriteAheadLog(const std::string& path) :
+    path(path), fileSize(0), fd(-1), appendedBytes(0), durableBytes(0), syncing(false), syncCount(0)
+{
+    Open();
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    try
+    {
+        Flush();
+    }
+    catch (std::exception& e)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Flushing log " << path << ": " << e.what();
+    }
+    ::close(fd);
+}
+
+void WriteAheadLog::Open()
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw std::runtime_error("Can't open log " + path + ": " + std::strerror(errno));
+    }
+
+    struct stat fileStat {};
+    fileSize = ::fstat(fd, &fileStat) == 0 ? fileStat.st_size : 0;
+}
+
+void WriteAheadLog::Append(std::string_view key, std::string_view value, uint64_t expiresAt)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const size_t recordStart = buffer.size();
+    EncodeRecord(buffer, key, value, expiresAt);
+    appendedBytes += buffer.size() - recordStart;
+    lastAppendLog = this;
+    lastAppendEnd = appendedBytes;
+}
+
+void WriteAheadLog::AppendBatch(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const size_t recordStart = buffer.size();
+    EncodeBatch(buffer, keysValues);
+    appendedBytes += buffer.size() - recordStart;
+    lastAppendLog = this;
+    lastAppendEnd = appendedBytes;
+}
+
+void WriteAheadLog::EncodeRecord(std::string& out, std::string_view key, std::string_view value, uint64_t expiresAt)
+{
+    const size_t recordStart = out.size();
+    AppendUint32(out, 0);
+    if (expiresAt == 0)
+    {
+        AppendEntry(out, key, value);
+    }
+    else
+    {
+        AppendUint32(out, ExpiringMarker);
+        AppendUint32(out, sizeof(expiresAt) + EntryHeaderSize + key.size() + value.size());
+        out.append(reinterpret_cast<const char*>(&expiresAt), sizeof(expiresAt));
+        AppendEntry(out, key, value);
+    }
+    SealRecord(out, recordStart);
+}
+
+void WriteAheadLog::EncodeBatch(std::string& out,
+                                const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)
+{
+    const size_t recordStart = out.size();
+    AppendUint32(out, 0);
+    AppendUint32(out, BatchMarker);
+    AppendUint32(out, 0);
+
+    const size_t payloadStart = out.size();
+    for (const auto& [key, value]: keysValues)
+    {
+        AppendEntry(out, key, value);
+    }
+
+    const uint32_t payloadSize = out.size() - payloadStart;
+    std::memcpy(&out[payloadStart - sizeof(uint32_t)], &payloadSize, sizeof(payloadSize));
+    SealRecord(out, recordStart);
+}
+
+void WriteAheadLog::Flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    FlushLocked();
+}
+
+void WriteAheadLog::Sync(uint64_t position)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    const uint64_t target = std::min(position, appendedBytes);
+    while (durableBytes < target)
+    {
+        if (!syncError.empty())
+        {
+            throw std::runtime_error(syncError);
+        }
+        if (syncing)
+        {
+            synced.wait(lock);
+            continue;
+        }
+
+        // Everything appended until now rides on this sync; appends go on
+        // meanwhile and are picked up by the next one.
+        FlushLocked();
+        const uint64_t flushed = appendedBytes;
+        syncing = true;
+        lock.unlock();
+        const int result = ::fdatasync(fd);
+        const int error = errno;
+        lock.lock();
+        syncing = false;
+        ++syncCount;
+        synced.notify_all();
+        if (result != 0)
+        {
+            syncError = "Can't sync log " + path + ": " + std::strerror(error);
+            throw std::runtime_error(syncError);
+        }
+        durableBytes = std::max(durableBytes, flushed);
+    }
+}
+
+uint64_t WriteAheadLog::ThreadPosition() const
+{
+    return lastAppendLog == this ? lastAppendEnd : 0;
+}
+
+void WriteAheadLog::FlushLocked()
+{
+    size_t written = 0;
+    while (written < buffer.size())
+    {
+        ssize_t result = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // Keep the unwritten tail so the next flush retries it.
+            buffer.erase(0, written);
+            fileSize += written;
+            throw std::runtime_error("Can't write log " + path + ": " + std::strerror(errno));
+        }
+        written += result;
+    }
+    fileSize += written;
+    buffer.clear();
+}
+
+size_t WriteAheadLog::Size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return fileSize + buffer.size();
+}
+
+uint64_t WriteAheadLog::SyncCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return syncCount;
+}
+
+void WriteAheadLog::Rotate()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (::access(RotatedPath().c_str(), F_OK) == 0)
+    {
+        throw std::runtime_error("Can't rotate log " + path + ": " + RotatedPath() + " isn't removed yet");
+    }
+    synced.wait(lock, [this]()
+        {
+            return !syncing;
+        });
+    if (!syncError.empty())
+    {
+        throw std::runtime_error(syncError);
+    }
+
+    // Writers waiting in Sync() may have records in this file.
+    FlushLocked();
+    if (durableBytes < appendedBytes)
+    {
+        const int result = ::fdatasync(fd);
+        ++syncCount;
+        if (result != 0)
+        {
+            syncError = "Can't sync log " + path + ": " + std::strerror(errno);
+            synced.notify_all();
+            throw std::runtime_error(syncError);
+        }
+        durableBytes = appendedBytes;
+        synced.notify_all();
+    }
+    ::close(fd);
+    fd = -1;
+
+    if (std::rename(path.c_str(), RotatedPath().c_str()) != 0)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Can't rotate log " << path << ": " << std::strerror(errno);
+    }
+    Open();
+}
+
+void WriteAheadLog::RemoveRotated()
+{
+    std::remove(RotatedPath().c_str());
+}
+
+size_t WriteAheadLog::Replay(const std::string& path, const ReplayCallback& callback)
+{
+    std::ifstream fileStream(path, std::ios::binary);
+    if (!fileStream)
+    {
+        return 0;
+    }
+
+    const std::string content((std::istreambuf_iterator<char>(fileStream)),
+                              std::istreambuf_iterator<char>());
+
+    size_t records = 0;
+    const size_t offset = ReplayRecords(content, callback, records);
+
+    if (offset < content.size())
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Log " << path << " has a damaged tail at offset " << offset
+                                   << ", " << content.size() - offset << " bytes are ignored.";
+    }
+
+    return records;
+}
+
+size_t WriteAheadLog::ReplayRecords(std::string_view records, const ReplayCallback& callback, size_t& count,
+                                    const BatchCallback& batchCallback)
+{
+    std::vector<std::pair<std::string_view, std::string_view>> batch;
+    size_t offset = 0;
+    while (offset < records.size())
+    {
+        const char* record = records.data() + offset;
+        const size_t left = records.size() - offset;
+        if (left < RecordHeaderSize)
+        {
+            break;
+        }
+
+        const uint32_t keySize = ReadUint32(record + sizeof(uint32_t));
+        const uint32_t valueSize = ReadUint32(record + 2 * sizeof(uint32_t));
+        const bool isBatch = keySize == BatchMarker;
+        const bool isExpiring = keySize == ExpiringMarker;
+        const size_t recordSize = RecordHeaderSize + (isBatch || isExpiring ? 0 : size_t(keySize)) + valueSize;
+        if (left < recordSize
+            || Checksum(record + sizeof(uint32_t), recordSize - sizeof(uint32_t)) != ReadUint32(record))
+        {
+            break;
+        }
+
+        if (isExpiring)
+        {
+            // The checksum matched, so the entry is intact.
+            uint64_t expiresAt;
+            std::memcpy(&expiresAt, record + RecordHeaderSize, sizeof(expiresAt));
+            const char* entry = record + RecordHeaderSize + sizeof(expiresAt);
+            const uint32_t entryKeySize = ReadUint32(entry);
+            const uint32_t entryValueSize = ReadUint32(entry + sizeof(uint32_t));
+            const char* key = entry + EntryHeaderSize;
+            callback(std::string_view(key, entryKeySize), std::string_view(key + entryKeySize, entryValueSize),
+                     expiresAt);
+        }
+        else if (!isBatch)
+        {
+            callback(std::string_view(record + RecordHeaderSize, keySize),
+                     std::string_view(record + RecordHeaderSize + keySize, valueSize), 0);
+        }
+        else
+        {
+            // The checksum matched, so the entries are intact.
+            const char* entry = record + RecordHeaderSize;
+            const char* end = entry + valueSize;
+            batch.clear();
+            while (size_t(end - entry) >= EntryHeaderSize)
+            {
+                const uint32_t entryKeySize = ReadUint32(entry);
+                const uint32_t entryValueSize = ReadUint32(entry + sizeof(uint32_t));
+                const char* key = entry + EntryHeaderSize;
+                if (batchCallback)
+                {
+                    batch.emplace_back(std::string_view(key, entryKeySize),
+                                       std::string_view(key + entryKeySize, entryValueSize));
+                }
+                else
+                {
+                    callback(std::string_view(key, entryKeySize), std::string_view(key + entryKeySize, entryValueSize),
+                             0);
+                }
+                entry = key + entryKeySize + entryValueSize;
+            }
+            if (batchCallback)
+            {
+                batchCallback(batch);
+            }
+        }
+        offset += recordSize;
+        ++count;
+    }
+
+    return offset;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "ChangeLog.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Append-only log of storage writes.
+//
+// Records are buffered in memory by Append() and written to the file by
+// Flush(). Each record is
+//     [crc32: u32][key length: u32][value length: u32][key][value]
+// in host byte order; the checksum covers everything after itself, so a
+// record torn by a crash is detected and replay stops there. A batch that
+// must be applied atomically is a single record whose key length is
+// BatchMarker and whose value is a sequence of
+//     [key length: u32][value length: u32][key][value]
+// A write of a key that expires is a record whose key length is
+// ExpiringMarker and whose value is
+//     [expiration time: u64][key length: u32][value length: u32][key][value]
+// Replication streams records of the same format, see Replication.h.
+class WriteAheadLog : public ChangeLog
+{
+public:
+    using ReplayCallback = std::function<void(std::string_view key, std::string_view value, uint64_t expiresAt)>;
+    using BatchCallback =
+        std::function<void(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues)>;
+
+    explicit WriteAheadLog(const std::string& path);
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    void Append(std::string_view key, std::string_view value, uint64_t expiresAt) override;
+    void AppendBatch(const std::vector<std::pair<std::string_view, std::string_view>>& keysValues) override;
+    void Flush();
+    // Flushes and waits until every record appended so far, or just up to
+    // 'position' (see ThreadPosition()), is on disk. Callers arriving while
+    // another one's fdatasync() runs are served together by the next one
+    // (group commit). Once an fdatasync() fails, whatever it covered may be
+    // lost while a retry succeeds, so this and Rotate() throw from then on.
+    void Sync(uint64_t position = UINT64_MAX);
+    // Where the last record the calling thread appended ends, to Sync() no
+    // further than needed for its own records; 0 if its last record went to
+    // another log or it appended none.
+    uint64_t ThreadPosition() const;
+
+    // Size of the current log file including records not flushed yet.
+    size_t Size() const;
+    // Number of fdatasync() calls made.
+    uint64_t SyncCount() const;
+
+    // Flushes and syncs the current log and moves it aside to RotatedPath(),
+    // then starts an empty log. Records appended afterwards go to the new
+    // file. Throws if the log rotated before is still there, so that it's
+    // never replaced; RemoveRotated() once its records are saved elsewhere.
+    void Rotate();
+    void RemoveRotated();
+
+    const std::string& Path() const { return path; }
+    std::string RotatedPath() const { return path + ".old"; }
+
+    // Applies every intact record of the file at 'path' in order.
+    // Returns the number of records replayed; a missing file replays nothing.
+    static size_t Replay(const std::string& path, const ReplayCallback& callback);
+    // Applies every intact record at the start of 'records' in order and
+    // returns the number of bytes they take; a torn record and whatever
+    // follows it is left. If 'batchCallback' is set, each batch record goes
+    // to it whole instead of pair by pair to 'callback'.
+    static size_t ReplayRecords(std::string_view records, const ReplayCallback& callback, size_t& count,
+                                const BatchCallback& batchCallback = nullptr);
+
+    // Both append a record to 'out'.
+    static void EncodeRecord(std::string& out, std::string_view key, std::string_view value, uint64_t expiresAt);
+    static void EncodeBatch(std::string& out,
+                            const std::vector<std::pair<std::string_view, std::string_view>>& keysValues);
+private:
+    const std::string path;
+
+    mutable std::mutex mutex;
+    std::string buffer;
+    size_t fileSize;
+    int fd;
+
+    // Bytes appended and made durable over the life of the object; unlike
+    // file sizes they grow across rotations.
+    uint64_t appendedBytes;
+    uint64_t durableBytes;
+    // An fdatasync() runs without the mutex held.
+    bool syncing;
+    std::condition_variable synced;
+    uint64_t syncCount;
+    // Why an fdatasync() failed; empty while none has.
+    std::string syncError;
+
+    void Open();
+    void FlushLocked();
+};
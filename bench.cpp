@@ -0,0 +1,475 @@
+#include "Server.h"
+#include "Storage.h"
+
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace po = boost::program_options;
+
+struct BenchmarkOptions
+{
+    // Cases run with 1, 2, 4... threads up to this number.
+    size_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t keyCount = 100000;
+    size_t valueSize = 16;
+    // Seconds each throughput case runs for.
+    double duration = 1;
+    size_t shardCount = StorageOptions().shardCount;
+    EngineType engine = EngineType::Sharded;
+    SnapshotFormat snapshotFormat = SnapshotFormat::Ini;
+    std::vector<size_t> snapshotSizes = { 1000, 10000, 100000, 1000000, 10000000 };
+    std::string directory = std::filesystem::temp_directory_path().string();
+    // Empty for the standard output.
+    std::string output;
+};
+
+void RunBenchmarks(const BenchmarkOptions& options, std::ostream& json);
+
+void PrintUsage(const po::options_description& desc)
+{
+    std::cout << "Usage: options_description [options]\n";
+    std::cout << desc;
+}
+
+int main(int ac, char** av)
+{
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    BenchmarkOptions options;
+    std::string snapshotSizes;
+    std::string engine = "sharded";
+    std::string snapshotFormat = "ini";
+
+    po::options_description desc("Allowed options");
+
+    try {
+        desc.add_options()
+            ("help,h", "produce help message")
+            ("threads,t", po::value<size_t>(&options.maxThreads)->default_value(options.maxThreads),
+             "maximum number of threads; cases run with 1, 2, 4... threads up to it")
+            ("keys,k", po::value<size_t>(&options.keyCount)->default_value(options.keyCount),
+             "number of keys in the storage for the read/write and command cases")
+            ("value-size", po::value<size_t>(&options.valueSize)->default_value(options.valueSize),
+             "size of every value in bytes")
+            ("duration,d", po::value<double>(&options.duration)->default_value(options.duration),
+             "seconds every throughput case runs for")
+            ("shards,n", po::value<size_t>(&options.shardCount)->default_value(options.shardCount),
+             "number of storage shards")
+            ("engine", po::value<std::string>(&engine)->default_value(engine),
+             "storage engine: 'sharded', 'lockfree' or 'compact'")
+            ("snapshot-format", po::value<std::string>(&snapshotFormat)->default_value(snapshotFormat),
+             "format of the snapshot cases: 'ini' or 'binary'")
+            ("snapshot-sizes", po::value<std::string>(&snapshotSizes),
+             "comma separated numbers of keys for the snapshot save/load cases, "
+             "default is 1000,10000,100000,1000000,10000000")
+            ("directory", po::value<std::string>(&options.directory)->default_value(options.directory),
+             "where the snapshot files are written")
+            ("output,o", po::value<std::string>(&options.output),
+             "file to write the JSON results to, default is the standard output");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(ac, av, desc), vm);
+
+        if (vm.count("help"))
+        {
+            PrintUsage(desc);
+            return 0;
+        }
+
+        po::notify(vm);
+
+        if (engine == "sharded")
+        {
+            options.engine = EngineType::Sharded;
+        }
+        else if (engine == "lockfree")
+        {
+            options.engine = EngineType::LockFree;
+        }
+        else if (engine == "compact")
+        {
+            options.engine = EngineType::Compact;
+        }
+        else
+        {
+            throw po::invalid_option_value(engine);
+        }
+
+        if (snapshotFormat == "ini")
+        {
+            options.snapshotFormat = SnapshotFormat::Ini;
+        }
+        else if (snapshotFormat == "binary")
+        {
+            options.snapshotFormat = SnapshotFormat::Binary;
+        }
+        else
+        {
+            throw po::invalid_option_value(snapshotFormat);
+        }
+
+        if (vm.count("snapshot-sizes"))
+        {
+            options.snapshotSizes.clear();
+            std::istringstream sizes(snapshotSizes);
+            for (std::string size; std::getline(sizes, size, ',');)
+            {
+                try
+                {
+                    options.snapshotSizes.push_back(std::stoull(size));
+                }
+                catch (std::exception&)
+                {
+                    throw po::invalid_option_value(snapshotSizes);
+                }
+            }
+        }
+        if (options.maxThreads == 0 || options.keyCount == 0)
+        {
+            throw po::error("there must be at least one thread and one key");
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "Command line parameters: " << e.what() << std::endl;
+        PrintUsage(desc);
+        return 1;
+    }
+    catch (...) {
+        std::cerr << "Command line parameters: Unknown error!\n";
+        PrintUsage(desc);
+        return 1;
+    }
+
+    try
+    {
+        if (options.output.empty())
+        {
+            RunBenchmarks(options, std::cout);
+        }
+        else
+        {
+            std::ofstream json(options.output);
+            if (!json)
+            {
+                throw std::runtime_error("Can't open " + options.output);
+            }
+            RunBenchmarks(options, json);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Benchmark: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+namespace
+{
+    // Operations between checks of the clock.
+    const size_t OperationsPerCheck = 256;
+    const size_t CommandVariants = 1024;
+    const size_t BatchSize = 8;
+    const char BenchmarkFileName[] = "storage_bench.ini";
+
+    struct Measurement
+    {
+        size_t threads;
+        uint64_t operations;
+        double seconds;
+    };
+
+    double SecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Runs 'operation(generator)' on 'threads' threads for 'duration' seconds.
+    template <typename Operation>
+    Measurement RunParallel(size_t threads, double duration, const Operation& operation)
+    {
+        std::atomic_bool start(false);
+        std::atomic_bool stop(false);
+        std::atomic_uint64_t operations(0);
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+        {
+            workers.emplace_back([&, i]()
+                {
+                    std::mt19937_64 generator(i + 1);
+                    uint64_t done = 0;
+                    while (!start)
+                    {
+                        std::this_thread::yield();
+                    }
+                    while (!stop)
+                    {
+                        for (size_t j = 0; j < OperationsPerCheck; ++j)
+                        {
+                            operation(generator);
+                        }
+                        done += OperationsPerCheck;
+                    }
+                    operations += done;
+                });
+        }
+
+        const auto startTime = std::chrono::steady_clock::now();
+        start = true;
+        std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+        stop = true;
+        for (auto& worker: workers)
+        {
+            worker.join();
+        }
+
+        return { threads, operations, SecondsSince(startTime) };
+    }
+
+    std::vector<size_t> ThreadCounts(size_t maxThreads)
+    {
+        std::vector<size_t> result;
+        for (size_t threads = 1; threads < maxThreads; threads *= 2)
+        {
+            result.push_back(threads);
+        }
+        result.push_back(maxThreads);
+        return result;
+    }
+
+    std::string Key(size_t index)
+    {
+        return "key" + std::to_string(index);
+    }
+
+    std::string Value(size_t index, size_t size)
+    {
+        std::string result = std::to_string(index);
+        result.resize(size, 'v');
+        return result;
+    }
+
+    void Fill(Storage& storage, size_t keyCount, size_t valueSize)
+    {
+        for (size_t i = 0; i < keyCount; ++i)
+        {
+            storage.Write(Key(i), Value(i, valueSize));
+        }
+    }
+
+    void PrintMeasurement(std::ostream& json, const Measurement& measurement)
+    {
+        json << "\"threads\": " << measurement.threads
+             << ", \"operations\": " << measurement.operations
+             << ", \"seconds\": " << measurement.seconds
+             << ", \"operationsPerSecond\": " << measurement.operations / measurement.seconds;
+    }
+
+    void BenchmarkStorage(const BenchmarkOptions& options, const std::string& configPath, std::ostream& json)
+    {
+        StorageOptions storageOptions;
+        storageOptions.engine = options.engine;
+        storageOptions.snapshotFormat = options.snapshotFormat;
+        storageOptions.shardCount = options.shardCount;
+        storageOptions.backgroundSave = false;
+        Storage storage(configPath, storageOptions);
+        Fill(storage, options.keyCount, options.valueSize);
+
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < options.keyCount; ++i)
+        {
+            keys.push_back(Key(i));
+        }
+        const std::string value = Value(0, options.valueSize);
+
+        json << "  \"storage\": [";
+        const char* separator = "\n";
+        for (const unsigned readPercent: { 100u, 95u, 50u, 0u })
+        {
+            for (const size_t threads: ThreadCounts(options.maxThreads))
+            {
+                std::cerr << "storage: " << readPercent << "% reads, " << threads << " threads" << std::endl;
+
+                const Measurement measurement = RunParallel(threads, options.duration,
+                    [&](std::mt19937_64& generator)
+                    {
+                        thread_local std::string result;
+                        const std::string& key = keys[generator() % keys.size()];
+                        if (generator() % 100 < readPercent)
+                        {
+                            storage.Read(key, result);
+                        }
+                        else
+                        {
+                            storage.Write(key, value);
+                        }
+                    });
+
+                json << separator << "    {\"readPercent\": " << readPercent << ", ";
+                PrintMeasurement(json, measurement);
+                json << "}";
+                separator = ",\n";
+            }
+        }
+        json << "\n  ],\n";
+    }
+
+    void BenchmarkCommands(const BenchmarkOptions& options, const std::string& configPath, std::ostream& json)
+    {
+        StorageOptions storageOptions;
+        storageOptions.engine = options.engine;
+        storageOptions.snapshotFormat = options.snapshotFormat;
+        storageOptions.shardCount = options.shardCount;
+        storageOptions.backgroundSave = false;
+        Storage storage(configPath, storageOptions);
+        Fill(storage, options.keyCount, options.valueSize);
+
+        Server server(0, storage);
+
+        std::mt19937_64 generator;
+        auto randomKey = [&]()
+            {
+                return Key(generator() % options.keyCount);
+            };
+        const std::string value = Value(0, options.valueSize);
+
+        const std::pair<const char*, std::function<std::string()>> commands[] =
+        {
+            { "$get", [&]() { return "$get " + randomKey(); } },
+            { "$set", [&]() { return "$set " + randomKey() + "=" + value; } },
+            { "$mget", [&]()
+                {
+                    std::string line = "$mget";
+                    for (size_t i = 0; i < BatchSize; ++i)
+                    {
+                        line += " " + randomKey();
+                    }
+                    return line;
+                } },
+            { "$mset", [&]()
+                {
+                    std::string line = "$mset";
+                    for (size_t i = 0; i < BatchSize; ++i)
+                    {
+                        line += " " + randomKey() + "=" + value;
+                    }
+                    return line;
+                } },
+        };
+
+        json << "  \"commands\": [";
+        const char* separator = "\n";
+        for (const auto& [name, makeLine]: commands)
+        {
+            std::vector<std::string> lines;
+            for (size_t i = 0; i < CommandVariants; ++i)
+            {
+                lines.push_back(makeLine());
+            }
+
+            for (const size_t threads: ThreadCounts(options.maxThreads))
+            {
+                std::cerr << "commands: " << name << ", " << threads << " threads" << std::endl;
+
+                const Measurement measurement = RunParallel(threads, options.duration,
+                    [&](std::mt19937_64& generator)
+                    {
+                        ResponseFormat format = ResponseFormat::Framed;
+                        server.HandleCommand(lines[generator() % lines.size()], format);
+                    });
+
+                json << separator << "    {\"command\": \"" << name << "\", ";
+                PrintMeasurement(json, measurement);
+                json << "}";
+                separator = ",\n";
+            }
+        }
+        json << "\n  ],\n";
+    }
+
+    void BenchmarkSnapshots(const BenchmarkOptions& options, const std::string& configPath, std::ostream& json)
+    {
+        StorageOptions storageOptions;
+        storageOptions.engine = options.engine;
+        storageOptions.snapshotFormat = options.snapshotFormat;
+        storageOptions.shardCount = options.shardCount;
+        storageOptions.backgroundSave = false;
+
+        json << "  \"snapshot\": [";
+        const char* separator = "\n";
+        for (const size_t keyCount: options.snapshotSizes)
+        {
+            std::cerr << "snapshot: " << keyCount << " keys" << std::endl;
+            std::filesystem::remove(configPath);
+
+            double saveSeconds = 0;
+            size_t memoryBytes = 0;
+            {
+                Storage storage(configPath, storageOptions);
+                Fill(storage, keyCount, options.valueSize);
+                memoryBytes = storage.GetMemoryUsage().TotalBytes();
+
+                const auto start = std::chrono::steady_clock::now();
+                storage.Save();
+                saveSeconds = SecondsSince(start);
+            }
+            const uintmax_t fileBytes = std::filesystem::file_size(configPath);
+
+            double loadSeconds = 0;
+            {
+                const auto start = std::chrono::steady_clock::now();
+                Storage storage(configPath, storageOptions);
+                loadSeconds = SecondsSince(start);
+            }
+
+            json << separator << "    {\"keys\": " << keyCount << ", \"memoryBytes\": " << memoryBytes
+                 << ", \"fileBytes\": " << fileBytes
+                 << ", \"saveSeconds\": " << saveSeconds << ", \"loadSeconds\": " << loadSeconds << "}";
+            separator = ",\n";
+        }
+        json << "\n  ]\n";
+
+        std::filesystem::remove(configPath);
+    }
+}
+
+void RunBenchmarks(const BenchmarkOptions& options, std::ostream& json)
+{
+    const std::string configPath = (std::filesystem::path(options.directory) / BenchmarkFileName).string();
+    const char* engineName = options.engine == EngineType::LockFree ? "lockfree"
+        : options.engine == EngineType::Compact ? "compact" : "sharded";
+
+    json << "{\n"
+         << "  \"parameters\": {\"maxThreads\": " << options.maxThreads << ", \"keys\": " << options.keyCount
+         << ", \"valueSize\": " << options.valueSize << ", \"duration\": " << options.duration
+         << ", \"shards\": " << options.shardCount
+         << ", \"engine\": \"" << engineName
+         << "\", \"snapshotFormat\": \"" << (options.snapshotFormat == SnapshotFormat::Binary ? "binary" : "ini")
+         << "\"},\n";
+
+    // Every case starts from an empty storage; the one left behind by the
+    // previous case is saved on destruction and removed here.
+    std::filesystem::remove(configPath);
+    BenchmarkStorage(options, configPath, json);
+    std::filesystem::remove(configPath);
+    BenchmarkCommands(options, configPath, json);
+    BenchmarkSnapshots(options, configPath, json);
+
+    json << "}" << std::endl;
+}
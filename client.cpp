@@ -1,15 +1,60 @@
+#include "Histogram.h"
+#include "Protocol.h"
+#include "ShardedClient.h"
+#include "SharedMemoryChannel.h"
 
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <memory>
 #include <random>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 namespace po = boost::program_options;
 
-void MainLoop(const std::string& server, boost::asio::ip::port_type port);
-void SingleIteraction(boost::asio::ip::tcp::socket& socket, const std::string& request);
+struct BenchmarkOptions
+{
+    // "<host>:<port>" or "unix:<path>" of every server; keys are spread over
+    // them by consistent hashing, see HashRing.
+    std::vector<std::string> servers;
+    bool binary = false;
+    // Every connection moves its requests to a SharedMemoryChannel.
+    bool sharedMemory = false;
+    size_t connections = 1;
+    size_t threads = 1;
+    // Total number of requests; ignored if 'duration' is set.
+    size_t requests = 10000;
+    double duration = 0;
+    double setPercent = 1;
+    // 0 means random length from 1 to 15 characters.
+    size_t valueSize = 0;
+    std::string distribution = "uniform";
+    double zipfExponent = 0.99;
+    // 0 means the built-in list of words.
+    size_t keySpace = 0;
+    // Requests per second over all connections; 0 means closed loop.
+    double rate = 0;
+    bool verbose = false;
+    // Check ShardedClient against the servers instead of benchmarking.
+    bool checkSharding = false;
+};
+
+void RunBenchmark(const BenchmarkOptions& options);
+void CheckSharding(const BenchmarkOptions& options);
+
+// Prefix of the address of a server's Unix domain socket.
+const std::string UnixAddressPrefix = "unix:";
 
 void PrintUsage(const po::options_description& desc)
 {
@@ -19,16 +64,54 @@ void PrintUsage(const po::options_description& desc)
 
 int main(int ac, char** av)
 {
+    BenchmarkOptions options;
     std::string server;
-    boost::asio::ip::port_type port;
+    boost::asio::ip::port_type port = 0;
+    std::string servers;
+    std::string unixSocket;
 
     po::options_description desc("Allowed options");
 
     try {
         desc.add_options()
             ("help,h", "produce help message")
-            ("server,s", po::value<std::string>(&server)->required(),"server's address (required)")
-            ("port,p", po::value<boost::asio::ip::port_type>(&port)->required(), "server's port (required)");
+            ("server,s", po::value<std::string>(&server), "server's address")
+            ("port,p", po::value<boost::asio::ip::port_type>(&port), "server's port")
+            ("unix-socket,u", po::value<std::string>(&unixSocket),
+             "path of the server's Unix domain socket instead of -s and -p")
+            ("servers", po::value<std::string>(&servers),
+             "comma separated list of servers sharing the key space instead of -s and -p, each "
+             "<host>:<port> or unix:<path>; every connection is made to each server and a request goes "
+             "to the one its key hashes to")
+            ("binary,b", po::bool_switch(&options.binary), "use the binary protocol instead of framed text")
+            ("shm", po::bool_switch(&options.sharedMemory),
+             "send requests and receive responses through shared memory rings set up over each connection; "
+             "needs '-u' or unix: servers, as the servers only share memory over their Unix sockets")
+            ("connections,c", po::value<size_t>(&options.connections)->default_value(options.connections),
+             "number of connections, each to every server")
+            ("threads,t", po::value<size_t>(&options.threads)->default_value(options.threads),
+             "number of threads the connections are spread over")
+            ("requests,n", po::value<size_t>(&options.requests)->default_value(options.requests),
+             "total number of requests")
+            ("duration,d", po::value<double>(&options.duration),
+             "run for this many seconds instead of a fixed number of requests")
+            ("set-percent", po::value<double>(&options.setPercent)->default_value(options.setPercent),
+             "percentage of $set requests, the rest are $get")
+            ("value-size", po::value<size_t>(&options.valueSize)->default_value(options.valueSize),
+             "size of values written, 0 for random sizes from 1 to 15")
+            ("distribution", po::value<std::string>(&options.distribution)->default_value(options.distribution),
+             "key popularity: 'uniform' or 'zipf'")
+            ("zipf-exponent", po::value<double>(&options.zipfExponent)->default_value(options.zipfExponent),
+             "skew of the zipf distribution, must not be 1")
+            ("key-space", po::value<size_t>(&options.keySpace)->default_value(options.keySpace),
+             "number of generated keys, 0 to use the built-in list of words")
+            ("rate,r", po::value<double>(&options.rate)->default_value(options.rate),
+             "open loop: send this many requests per second whatever the latency; "
+             "0 for closed loop, where each connection waits for a response before the next request")
+            ("verbose,v", po::bool_switch(&options.verbose), "print every request and response")
+            ("check-sharding", po::bool_switch(&options.checkSharding),
+             "instead of the benchmark, write keys to the TCP servers through the blocking sharded client "
+             "and read them back, also after the last server is dropped from the list and added again");
 
         po::variables_map vm;
         po::store(po::parse_command_line(ac, av, desc), vm);
@@ -40,6 +123,67 @@ int main(int ac, char** av)
         }
 
         po::notify(vm);
+
+        const bool tcp = vm.count("server") || vm.count("port");
+        if (!servers.empty() + tcp + !unixSocket.empty() > 1)
+        {
+            throw po::error("'-s' and '-p', '-u' and '--servers' exclude each other");
+        }
+        if (servers.empty() && unixSocket.empty() && !(vm.count("server") && vm.count("port")))
+        {
+            throw po::error("either '-s' and '-p', '-u' or '--servers' is required");
+        }
+        if (!unixSocket.empty())
+        {
+            options.servers.push_back(UnixAddressPrefix + unixSocket);
+        }
+        else if (servers.empty())
+        {
+            options.servers.push_back(server + ":" + std::to_string(port));
+        }
+        for (size_t begin = 0; begin < servers.size();)
+        {
+            const size_t end = std::min(servers.find(',', begin), servers.size());
+            const std::string address = servers.substr(begin, end - begin);
+            const size_t colon = address.rfind(':');
+            const bool local = address.compare(0, UnixAddressPrefix.size(), UnixAddressPrefix) == 0;
+            if (local ? address.size() == UnixAddressPrefix.size()
+                     : colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+            {
+                throw po::invalid_option_value(address);
+            }
+            options.servers.push_back(address);
+            begin = end + 1;
+        }
+
+        if (options.sharedMemory)
+        {
+            for (const std::string& address: options.servers)
+            {
+                if (address.compare(0, UnixAddressPrefix.size(), UnixAddressPrefix) != 0)
+                {
+                    throw po::error("'--shm' needs '-u' or unix: servers");
+                }
+            }
+        }
+
+        if (options.distribution != "uniform" && options.distribution != "zipf")
+        {
+            throw po::invalid_option_value(options.distribution);
+        }
+        if (options.distribution == "zipf" && (options.zipfExponent <= 0 || options.zipfExponent == 1))
+        {
+            throw po::invalid_option_value(std::to_string(options.zipfExponent));
+        }
+        if (options.connections == 0 || options.threads == 0)
+        {
+            throw po::error("there must be at least one connection and one thread");
+        }
+        if (options.checkSharding && (!unixSocket.empty() || options.binary || options.sharedMemory
+                                      || servers.find(UnixAddressPrefix) != std::string::npos))
+        {
+            throw po::error("'--check-sharding' works with TCP servers and framed text only");
+        }
     }
     catch (std::exception& e)
     {
@@ -53,7 +197,22 @@ int main(int ac, char** av)
         return 1;
     }
 
-    MainLoop(server, port);
+    try
+    {
+        if (options.checkSharding)
+        {
+            CheckSharding(options);
+        }
+        else
+        {
+            RunBenchmark(options);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << (options.checkSharding ? "Sharding check: " : "Benchmark: ") << e.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -328,106 +487,894 @@ namespace
         "worth",
         "wreck"
     };
-    const std::string Commands[] = { "$get", "$set" };
 
-    const size_t NumberOfIterations = 10000;
+    // Outstanding requests per connection in the open loop mode.
+    const size_t MaxPipelineDepth = 1024;
     const int PollTimeoutMs = 100;
-}
+    // Longest wait for the server while setting a connection up.
+    const std::chrono::seconds SetupTimeout(5);
+    const size_t MaxRandomValueSize = 15;
+    const size_t ValuePoolSize = 64 * 1024;
+    // Keys written by --check-sharding, half of them one by one and half
+    // in a batch.
+    const size_t ShardingCheckKeys = 1000;
+    const char Characters[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 
-std::string RandomString()
-{
-    const std::string Characters = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    uint64_t NowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-    std::random_device randomDevice;
-    std::mt19937 generator(randomDevice());
-    std::uniform_int_distribution<> distribution(0, Characters.size() - 1);
+    // Ranks from [0, n) where rank i is drawn with probability proportional
+    // to 1 / (i + 1)^theta; Gray et al., "Quickly Generating Billion-Record
+    // Synthetic Databases", the same generator YCSB uses.
+    class ZipfianGenerator
+    {
+    public:
+        ZipfianGenerator(size_t n, double theta) :
+            n(n), theta(theta), alpha(1.0 / (1.0 - theta)), zetaN(Zeta(n, theta)),
+            eta((1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - Zeta(2, theta) / zetaN))
+        {
+        }
+
+        template <typename Generator>
+        size_t Next(Generator& generator) const
+        {
+            const double u = std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+            const double uz = u * zetaN;
+            if (uz < 1.0)
+            {
+                return 0;
+            }
+            if (uz < 1.0 + std::pow(0.5, theta))
+            {
+                return std::min<size_t>(1, n - 1);
+            }
+            return std::min<size_t>(n * std::pow(eta * u - eta + 1.0, alpha), n - 1);
+        }
+    private:
+        const size_t n;
+        const double theta;
+        const double alpha;
+        const double zetaN;
+        const double eta;
 
-    std::uniform_int_distribution<> lengthDistribution(1, 15);
+        static double Zeta(size_t n, double theta)
+        {
+            double sum = 0;
+            for (size_t i = 1; i <= n; ++i)
+            {
+                sum += 1.0 / std::pow(static_cast<double>(i), theta);
+            }
+            return sum;
+        }
+    };
 
-    size_t length = lengthDistribution(generator);
+    struct BenchmarkResult
+    {
+        // Nanoseconds from the moment a request was due to its response.
+        Histogram latency;
+        uint64_t gets = 0;
+        uint64_t sets = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t errors = 0;
 
-    std::string random_string;
+        void Merge(const BenchmarkResult& other)
+        {
+            latency.Merge(other.latency);
+            gets += other.gets;
+            sets += other.sets;
+            hits += other.hits;
+            misses += other.misses;
+            errors += other.errors;
+        }
+    };
+
+    enum class ResponseKind
+    {
+        Incomplete,
+        Value,
+        NotFound,
+        Ok,
+        Error
+    };
 
-    for (std::size_t i = 0; i < length; ++i)
+    // Recognizes the response at the front of 'data' and sets 'size' to its
+    // length and 'value' to its payload.
+    ResponseKind ParseFramedResponse(std::string_view data, size_t& size, std::string_view& value)
     {
-        random_string += Characters[distribution(generator)];
+        const size_t eol = data.find(FramedEol);
+        if (eol == std::string_view::npos)
+        {
+            return ResponseKind::Incomplete;
+        }
+        size = eol + 1;
+
+        const std::string_view status = data.substr(0, size);
+        if (status.compare(0, FramedValue.size(), FramedValue) == 0)
+        {
+            const size_t length = std::strtoull(status.data() + FramedValue.size(), nullptr, 10);
+            if (data.size() < size + length + 1)
+            {
+                return ResponseKind::Incomplete;
+            }
+            value = data.substr(size, length);
+            size += length + 1;
+            return ResponseKind::Value;
+        }
+
+        value = status;
+        if (status == FramedNotFound)
+        {
+            return ResponseKind::NotFound;
+        }
+        return status == FramedOk ? ResponseKind::Ok : ResponseKind::Error;
     }
 
-    return random_string;
-}
+    ResponseKind ParseBinaryResponse(std::string_view data, size_t& size, std::string_view& value)
+    {
+        BinaryHeader header;
+        if (data.size() < sizeof(header))
+        {
+            return ResponseKind::Incomplete;
+        }
+        std::memcpy(&header, data.data(), sizeof(header));
 
-void MainLoop(const std::string& server, boost::asio::ip::port_type port)
-{
-    boost::asio::io_context io_context;
-    
-    boost::asio::ip::tcp::socket socket(io_context);
-    boost::asio::ip::tcp::resolver resolver(io_context);
+        size = sizeof(header) + header.keyLength + header.valueLength;
+        if (data.size() < size)
+        {
+            return ResponseKind::Incomplete;
+        }
+        value = data.substr(sizeof(header) + header.keyLength, header.valueLength);
+
+        switch (static_cast<BinaryStatus>(header.code))
+        {
+        case BinaryStatus::Ok:
+            return ResponseKind::Ok;
+        case BinaryStatus::NotFound:
+            return ResponseKind::NotFound;
+        case BinaryStatus::Error:
+            break;
+        }
+        return ResponseKind::Error;
+    }
+
+    struct PendingRequest
+    {
+        uint64_t dueNs;
+        bool isGet;
+    };
 
-    boost::asio::connect(socket, resolver.resolve(server, std::to_string(port)));    
+    // A socket to one of the servers and, with --shm, the channel that
+    // carries the requests and responses instead.
+    struct Connection
+    {
+        explicit Connection(boost::asio::io_context& ioContext) : socket(ioContext) {}
 
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_int_distribution<std::mt19937::result_type> commandDist(0, 99);
-    std::uniform_int_distribution<std::mt19937::result_type> keyDist(0, std::size(RequestKeys) - 1);
+        // A TCP or a Unix domain socket.
+        boost::asio::generic::stream_protocol::socket socket;
+        std::unique_ptr<SharedMemoryChannel> channel;
+        std::string output;
+        std::string input;
+        std::deque<PendingRequest> pending;
+        uint32_t nextRequestId = 0;
+    };
 
-    for (size_t i = 0; i < NumberOfIterations; ++i)
+    // A simulated client with a connection to every server, indexed like the
+    // nodes of the ring; every request goes to the server owning its key.
+    struct Client
     {
-        size_t cmdIndex = commandDist(rng) > 0 ? 0 : 1;
-        const std::string& command = Commands[cmdIndex];
-        const std::string& key = RequestKeys[keyDist(rng)];
-        std::string cmdLine = command + " " + key;
-        if (cmdIndex == 1)
+        std::vector<std::unique_ptr<Connection>> connections;
+        uint64_t nextDueNs = 0;
+        // Requests not sent yet.
+        size_t remaining = 0;
+        // Requests sent and not answered yet over all connections.
+        size_t outstanding = 0;
+        bool failed = false;
+    };
+
+    // Drives a group of clients from one thread with non-blocking sockets
+    // multiplexed by poll(). Shared memory channels have no file descriptor
+    // to poll: the thread waits on a channel that is all it waits for, and
+    // otherwise spins over them.
+    class Worker
+    {
+    public:
+        Worker(const BenchmarkOptions& options, const std::vector<std::string>& keys, const HashRing& ring,
+               const ZipfianGenerator* zipfian, unsigned seed) :
+            options(options), keys(keys), ring(ring), zipfian(zipfian), generator(seed),
+            keyDistribution(0, keys.size() - 1), percentDistribution(0.0, 100.0),
+            valueSizeDistribution(1, MaxRandomValueSize)
         {
-            cmdLine = cmdLine + "=" + RandomString();
+            const size_t poolSize = std::max(ValuePoolSize, 2 * options.valueSize);
+            std::uniform_int_distribution<size_t> characterDistribution(0, std::size(Characters) - 2);
+            for (size_t i = 0; i < poolSize; ++i)
+            {
+                valuePool += Characters[characterDistribution(generator)];
+            }
         }
-        cmdLine = cmdLine + '\n';
-        std::cout << "Command line: " << cmdLine;
-        SingleIteraction(socket, cmdLine);
+
+        void AddClient(std::unique_ptr<Client> client)
+        {
+            clients.push_back(std::move(client));
+        }
+
+        void Run(uint64_t startNs, uint64_t deadlineNs, double intervalNs)
+        {
+            this->deadlineNs = deadlineNs;
+            for (size_t i = 0; i < clients.size(); ++i)
+            {
+                for (auto& connection: clients[i]->connections)
+                {
+                    connection->socket.non_blocking(true);
+                }
+                // Spread the first requests of the open loop over an interval.
+                clients[i]->nextDueNs = startNs + intervalNs * i / clients.size();
+            }
+
+            std::vector<struct pollfd> pollFds;
+            // The client and connection of every entry of pollFds.
+            std::vector<std::pair<Client*, Connection*>> polled;
+            // Connections with a channel that have something to send or receive.
+            std::vector<std::pair<Client*, Connection*>> channeled;
+            uint64_t nextChannelCheckNs = 0;
+            while (true)
+            {
+                const uint64_t now = NowNs();
+                uint64_t nextDue = UINT64_MAX;
+                size_t active = 0;
+
+                pollFds.clear();
+                polled.clear();
+                channeled.clear();
+                for (auto& clientPointer: clients)
+                {
+                    Client& client = *clientPointer;
+                    if (IsDone(client, now))
+                    {
+                        continue;
+                    }
+                    ++active;
+
+                    if (intervalNs == 0)
+                    {
+                        if (client.outstanding == 0 && CanSend(client, now))
+                        {
+                            Enqueue(client, now);
+                        }
+                    }
+                    else
+                    {
+                        while (CanSend(client, now) && client.nextDueNs <= now
+                               && client.outstanding < MaxPipelineDepth)
+                        {
+                            Enqueue(client, client.nextDueNs);
+                            client.nextDueNs += intervalNs;
+                        }
+                        if (CanSend(client, now))
+                        {
+                            nextDue = std::min(nextDue, client.nextDueNs);
+                        }
+                    }
+
+                    for (auto& connection: client.connections)
+                    {
+                        const short events = (connection->output.empty() ? 0 : POLLOUT)
+                                             | (connection->pending.empty() ? 0 : POLLIN);
+                        if (events != 0 && connection->channel)
+                        {
+                            channeled.emplace_back(&client, connection.get());
+                        }
+                        else if (events != 0)
+                        {
+                            pollFds.push_back({connection->socket.native_handle(), events, 0});
+                            polled.emplace_back(&client, connection.get());
+                        }
+                    }
+                }
+
+                if (active == 0)
+                {
+                    break;
+                }
+
+                int timeoutMs = PollTimeoutMs;
+                if (nextDue != UINT64_MAX)
+                {
+                    const uint64_t waitNs = nextDue > now ? nextDue - now : 0;
+                    timeoutMs = std::min<uint64_t>(PollTimeoutMs, waitNs / 1000000);
+                }
+
+                if (channeled.size() == 1 && pollFds.empty() && channeled.front().second->output.empty())
+                {
+                    channeled.front().second->channel->WaitReadable(std::chrono::milliseconds(timeoutMs));
+                }
+                else if (!channeled.empty() && pollFds.empty())
+                {
+                    std::this_thread::yield();
+                }
+                else if (::poll(pollFds.data(), pollFds.size(), channeled.empty() ? timeoutMs : 0) == -1
+                         && errno != EINTR)
+                {
+                    std::cerr << "error while polling: " << errno << std::endl;
+                }
+
+                for (size_t i = 0; i < pollFds.size(); ++i)
+                {
+                    auto [client, connection] = polled[i];
+                    if (pollFds[i].revents & (POLLOUT | POLLERR | POLLHUP))
+                    {
+                        Send(*client, *connection);
+                    }
+                    if (pollFds[i].revents & (POLLIN | POLLERR | POLLHUP))
+                    {
+                        Receive(*client, *connection);
+                    }
+                }
+
+                for (auto [client, connection]: channeled)
+                {
+                    Send(*client, *connection);
+                    Receive(*client, *connection);
+                }
+                if (!channeled.empty() && now >= nextChannelCheckNs)
+                {
+                    CheckChannels(channeled);
+                    nextChannelCheckNs = now + PollTimeoutMs * 1000000ull;
+                }
+            }
+
+            for (auto& client: clients)
+            {
+                for (auto& connection: client->connections)
+                {
+                    boost::system::error_code ec;
+                    connection->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+                    connection->socket.close(ec);
+                }
+            }
+        }
+
+        const BenchmarkResult& Result() const { return result; }
+    private:
+        const BenchmarkOptions& options;
+        const std::vector<std::string>& keys;
+        const HashRing& ring;
+        const ZipfianGenerator* zipfian;
+        std::mt19937_64 generator;
+        std::uniform_int_distribution<size_t> keyDistribution;
+        std::uniform_real_distribution<double> percentDistribution;
+        std::uniform_int_distribution<size_t> valueSizeDistribution;
+        std::string valuePool;
+
+        std::vector<std::unique_ptr<Client>> clients;
+        uint64_t deadlineNs = 0;
+        BenchmarkResult result;
+
+        bool CanSend(const Client& client, uint64_t now) const
+        {
+            return !client.failed && client.remaining > 0 && now < deadlineNs;
+        }
+
+        // Nothing is written that isn't pending, so no request outstanding
+        // means nothing left to send either.
+        bool IsDone(const Client& client, uint64_t now) const
+        {
+            return client.failed || (!CanSend(client, now) && client.outstanding == 0);
+        }
+
+        const std::string& NextKey()
+        {
+            return keys[zipfian ? zipfian->Next(generator) : keyDistribution(generator)];
+        }
+
+        std::string_view NextValue()
+        {
+            const size_t size = options.valueSize ? options.valueSize : valueSizeDistribution(generator);
+            const size_t offset = std::uniform_int_distribution<size_t>(0, valuePool.size() - size)(generator);
+            return std::string_view(valuePool).substr(offset, size);
+        }
+
+        void Enqueue(Client& client, uint64_t dueNs)
+        {
+            const bool isGet = percentDistribution(generator) >= options.setPercent;
+            const std::string& key = NextKey();
+            const std::string_view value = isGet ? std::string_view() : NextValue();
+            Connection& connection = *client.connections[ring.NodeOf(key)];
+
+            const size_t requestStart = connection.output.size();
+            if (options.binary)
+            {
+                BinaryHeader header {};
+                header.code = static_cast<uint8_t>(isGet ? BinaryOpcode::Get : BinaryOpcode::Set);
+                header.keyLength = key.size();
+                header.valueLength = value.size();
+                header.requestId = connection.nextRequestId++;
+                connection.output.append(reinterpret_cast<const char*>(&header), sizeof(header));
+                connection.output += key;
+                connection.output += value;
+            }
+            else
+            {
+                connection.output += isGet ? "$get " : "$set ";
+                connection.output += key;
+                if (!isGet)
+                {
+                    connection.output += '=';
+                    connection.output += value;
+                }
+                connection.output += '\n';
+            }
+
+            if (options.verbose)
+            {
+                std::cout << "Command: " << (isGet ? "$get " : "$set ") << key << " " << value << std::endl;
+            }
+
+            connection.pending.push_back({ dueNs, isGet });
+            --client.remaining;
+            ++client.outstanding;
+            ++(isGet ? result.gets : result.sets);
+
+            if (requestStart == 0)
+            {
+                Send(client, connection);
+            }
+        }
+
+        void Send(Client& client, Connection& connection)
+        {
+            if (connection.output.empty() || client.failed)
+            {
+                return;
+            }
+
+            size_t sent = 0;
+            if (connection.channel)
+            {
+                sent = connection.channel->Write(connection.output.data(), connection.output.size());
+                if (connection.channel->Broken())
+                {
+                    Fail(client, "Shared memory request ring is damaged");
+                    return;
+                }
+            }
+            else
+            {
+                boost::system::error_code error;
+                sent = connection.socket.write_some(boost::asio::buffer(connection.output), error);
+                if (error && error != boost::asio::error::would_block)
+                {
+                    Fail(client, "Error writing data: " + error.message());
+                    return;
+                }
+            }
+            connection.output.erase(0, sent);
+        }
+
+        void Receive(Client& client, Connection& connection)
+        {
+            if (client.failed)
+            {
+                return;
+            }
+
+            char buffer[64 * 1024];
+            size_t received = 0;
+            if (connection.channel)
+            {
+                received = connection.channel->Read(buffer, sizeof(buffer));
+                if (connection.channel->Broken())
+                {
+                    Fail(client, "Shared memory response ring is damaged");
+                    return;
+                }
+                if (received == 0)
+                {
+                    return;
+                }
+            }
+            else
+            {
+                boost::system::error_code error;
+                received = connection.socket.read_some(boost::asio::buffer(buffer), error);
+                if (error == boost::asio::error::would_block)
+                {
+                    return;
+                }
+                if (error)
+                {
+                    Fail(client, "Error reading data: " + error.message());
+                    return;
+                }
+            }
+            connection.input.append(buffer, received);
+
+            const uint64_t now = NowNs();
+            std::string_view data = connection.input;
+            while (!connection.pending.empty())
+            {
+                size_t size = 0;
+                std::string_view value;
+                const ResponseKind kind = options.binary ? ParseBinaryResponse(data, size, value)
+                                                         : ParseFramedResponse(data, size, value);
+                if (kind == ResponseKind::Incomplete)
+                {
+                    break;
+                }
+
+                const PendingRequest request = connection.pending.front();
+                connection.pending.pop_front();
+                --client.outstanding;
+                data.remove_prefix(size);
+
+                result.latency.Record(now > request.dueNs ? now - request.dueNs : 0);
+                const bool found = kind == ResponseKind::Value || (options.binary && kind == ResponseKind::Ok);
+                if (kind == ResponseKind::Error)
+                {
+                    ++result.errors;
+                }
+                else if (request.isGet)
+                {
+                    ++(found ? result.hits : result.misses);
+                }
+
+                if (options.verbose)
+                {
+                    if (kind != ResponseKind::Value && !value.empty() && value.back() == FramedEol)
+                    {
+                        value.remove_suffix(1);
+                    }
+                    if (value.empty() && !(found && request.isGet))
+                    {
+                        value = kind == ResponseKind::NotFound ? "NOT_FOUND" : "OK";
+                    }
+                    std::cout << value << std::endl;
+                }
+            }
+            connection.input.erase(0, connection.input.size() - data.size());
+        }
+
+        // The server only closes the socket of a channel, so anything
+        // happening on it means the server is gone.
+        void CheckChannels(const std::vector<std::pair<Client*, Connection*>>& channeled)
+        {
+            for (auto [client, connection]: channeled)
+            {
+                struct pollfd pollFd {connection->socket.native_handle(), POLLIN | POLLRDHUP, 0};
+                if (!client->failed && ::poll(&pollFd, 1, 0) != 0)
+                {
+                    Fail(*client, "Server closed the shared memory channel");
+                }
+            }
+        }
+
+        void Fail(Client& client, const std::string& message)
+        {
+            std::cerr << message << std::endl;
+            client.failed = true;
+            result.errors += client.outstanding;
+            client.outstanding = 0;
+            for (auto& connection: client.connections)
+            {
+                connection->pending.clear();
+                connection->output.clear();
+            }
+        }
+    };
+
+    // Blocking, for setting a connection up.
+    void WriteAll(Connection& connection, std::string_view data)
+    {
+        if (!connection.channel)
+        {
+            boost::asio::write(connection.socket, boost::asio::buffer(data.data(), data.size()));
+            return;
+        }
+
+        const auto deadline = std::chrono::steady_clock::now() + SetupTimeout;
+        while (true)
+        {
+            data.remove_prefix(connection.channel->Write(data.data(), data.size()));
+            if (data.empty())
+            {
+                return;
+            }
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                throw std::runtime_error("server doesn't read the shared memory");
+            }
+            connection.channel->WaitWritable(std::chrono::milliseconds(PollTimeoutMs));
+        }
+    }
+
+    std::string ReadExactly(Connection& connection, size_t size)
+    {
+        std::string data(size, '\0');
+        if (!connection.channel)
+        {
+            boost::asio::read(connection.socket, boost::asio::buffer(data));
+            return data;
+        }
+
+        const auto deadline = std::chrono::steady_clock::now() + SetupTimeout;
+        size_t received = 0;
+        while (true)
+        {
+            received += connection.channel->Read(&data[received], size - received);
+            if (received == size)
+            {
+                return data;
+            }
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                throw std::runtime_error("server doesn't answer over the shared memory");
+            }
+            connection.channel->WaitReadable(std::chrono::milliseconds(PollTimeoutMs));
+        }
+    }
+
+    // Asks the server to serve the connection over a new channel, see
+    // SharedMemoryCommand.
+    void OpenChannel(Connection& connection)
+    {
+        static size_t channelCount = 0;
+        const std::string name = std::string(SharedMemoryPrefix) + std::to_string(::getpid()) + "-"
+                                 + std::to_string(channelCount++);
+        connection.channel = SharedMemoryChannel::Create(name);
+
+        const std::string request = std::string(SharedMemoryCommand) + " " + name + '\n';
+        boost::asio::write(connection.socket, boost::asio::buffer(request));
+        std::string response;
+        boost::asio::read_until(connection.socket, boost::asio::dynamic_buffer(response), FramedEol);
+        connection.channel->Unlink();
+        if (response != FramedOk)
+        {
+            throw std::runtime_error("server can't share memory: " + response);
+        }
+    }
+
+    std::unique_ptr<Connection> Connect(boost::asio::io_context& ioContext, const BenchmarkOptions& options,
+                                        const std::string& server)
+    {
+        auto connection = std::make_unique<Connection>(ioContext);
+        if (server.compare(0, UnixAddressPrefix.size(), UnixAddressPrefix) == 0)
+        {
+            boost::asio::local::stream_protocol::socket socket(ioContext);
+            socket.connect(boost::asio::local::stream_protocol::endpoint(server.substr(UnixAddressPrefix.size())));
+            connection->socket = std::move(socket);
+        }
+        else
+        {
+            boost::asio::ip::tcp::socket socket(ioContext);
+            boost::asio::ip::tcp::resolver resolver(ioContext);
+            const size_t colon = server.rfind(':');
+            boost::asio::connect(socket, resolver.resolve(server.substr(0, colon), server.substr(colon + 1)));
+            socket.set_option(boost::asio::ip::tcp::no_delay(true));
+            connection->socket = std::move(socket);
+        }
+
+        if (options.sharedMemory)
+        {
+            OpenChannel(*connection);
+        }
+
+        if (options.binary)
+        {
+            WriteAll(*connection, std::string_view(reinterpret_cast<const char*>(&BinaryMagic), sizeof(BinaryMagic)));
+            return connection;
+        }
+
+        // Framed responses tell where each one ends, so there is no need to
+        // wait for a timeout to find out that a response is complete.
+        WriteAll(*connection, "$proto " + std::string(ProtocolFramed) + '\n');
+
+        const std::string response = ReadExactly(*connection, FramedOk.size());
+        if (response != FramedOk)
+        {
+            throw std::runtime_error("server doesn't support framed responses: " + response);
+        }
+        return connection;
     }
 
-    boost::system::error_code ec;
-    socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-    socket.close();
+    void PrintReport(const BenchmarkOptions& options, const BenchmarkResult& result, double seconds)
+    {
+        const uint64_t completed = result.latency.Count();
+        auto micros = [](double nanoseconds)
+            {
+                return nanoseconds / 1000.0;
+            };
+
+        std::cout << std::fixed << std::setprecision(1)
+                  << "Connections: " << options.connections << " over " << options.threads << " threads"
+                  << (options.servers.size() > 1 ? " to each of " + std::to_string(options.servers.size())
+                                                   + " servers" : std::string()) << ", "
+                  << (options.rate > 0 ? "open loop at " + std::to_string(static_cast<uint64_t>(options.rate))
+                                         + " requests/s" : std::string("closed loop")) << ", "
+                  << (options.binary ? "binary" : "framed text") << " protocol"
+                  << (options.sharedMemory ? " over shared memory" : "") << "\n"
+                  << "Requests: " << completed << " (" << result.gets << " gets, " << result.sets << " sets), "
+                  << "hits " << result.hits << ", misses " << result.misses << ", errors " << result.errors << "\n"
+                  << std::setprecision(3) << "Duration: " << seconds << " s, throughput: "
+                  << std::setprecision(1) << (seconds > 0 ? completed / seconds : 0) << " requests/s\n"
+                  << "Latency, us: mean " << micros(result.latency.Mean())
+                  << ", p50 " << micros(result.latency.Percentile(50))
+                  << ", p99 " << micros(result.latency.Percentile(99))
+                  << ", p99.9 " << micros(result.latency.Percentile(99.9))
+                  << ", max " << micros(result.latency.Max()) << std::endl;
+    }
 }
 
-void SingleIteraction(boost::asio::ip::tcp::socket& socket, const std::string& request)
+void RunBenchmark(const BenchmarkOptions& options)
 {
-    socket.non_blocking(true);
+    std::vector<std::string> keys;
+    if (options.keySpace == 0)
+    {
+        keys.assign(std::begin(RequestKeys), std::end(RequestKeys));
+    }
+    else
+    {
+        for (size_t i = 0; i < options.keySpace; ++i)
+        {
+            keys.push_back("key" + std::to_string(i));
+        }
+    }
 
-    boost::asio::write(socket, boost::asio::buffer(request));
-    
-    boost::asio::streambuf buffer;
-    boost::system::error_code error;
+    std::unique_ptr<ZipfianGenerator> zipfian;
+    if (options.distribution == "zipf")
+    {
+        zipfian = std::make_unique<ZipfianGenerator>(keys.size(), options.zipfExponent);
+    }
 
-    do
+    HashRing ring;
+    for (const std::string& server: options.servers)
     {
+        ring.Add(server);
+    }
+
+    boost::asio::io_context ioContext;
+    std::random_device randomDevice;
+
+    const size_t threadCount = std::min(options.threads, options.connections);
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t i = 0; i < threadCount; ++i)
     {
-        struct pollfd pollFd {};
-        pollFd.fd = socket.native_handle();
-        pollFd.events = POLLIN;
+        workers.push_back(std::make_unique<Worker>(options, keys, ring, zipfian.get(), randomDevice()));
+    }
 
-        if (::poll(&pollFd, 1, PollTimeoutMs) == -1)
+    const bool timed = options.duration > 0;
+    for (size_t i = 0; i < options.connections; ++i)
+    {
+        auto client = std::make_unique<Client>();
+        for (const std::string& server: ring.Nodes())
         {
-            std::cerr << "error while polling: " << errno << std::endl;
+            client->connections.push_back(Connect(ioContext, options, server));
         }
-        if (!(pollFd.revents & POLLIN))
+        client->remaining = timed ? SIZE_MAX
+            : options.requests / options.connections + (i < options.requests % options.connections ? 1 : 0);
+        workers[i % threadCount]->AddClient(std::move(client));
+    }
+
+    // Each connection gets an equal share of the open loop rate.
+    const double intervalNs = options.rate > 0 ? 1e9 * options.connections / options.rate : 0;
+
+    const uint64_t startNs = NowNs();
+    const uint64_t deadlineNs = timed ? startNs + static_cast<uint64_t>(options.duration * 1e9) : UINT64_MAX;
+
+    std::vector<std::thread> threads;
+    for (auto& worker: workers)
+    {
+        threads.emplace_back(&Worker::Run, worker.get(), startNs, deadlineNs, intervalNs);
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+
+    const double seconds = (NowNs() - startNs) / 1e9;
+
+    BenchmarkResult total;
+    for (const auto& worker: workers)
+    {
+        total.Merge(worker->Result());
+    }
+
+    PrintReport(options, total, seconds);
+}
+
+void CheckSharding(const BenchmarkOptions& options)
+{
+    ShardedClient client(options.servers);
+
+    // Keys of an earlier run can't pass for this one's.
+    const std::string prefix = "check" + std::to_string(std::random_device()()) + "-";
+    std::vector<std::string> keys;
+    std::vector<std::string> values;
+    for (size_t i = 0; i < ShardingCheckKeys; ++i)
+    {
+        keys.push_back(prefix + std::to_string(i));
+        values.push_back("value" + std::to_string(i));
+    }
+    const std::vector<std::string_view> keyViews(keys.begin(), keys.end());
+
+    std::vector<std::pair<std::string_view, std::string_view>> batch;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (i % 2 == 0)
         {
-            break;
+            client.Set(keys[i], values[i]);
+        }
+        else
+        {
+            batch.emplace_back(keys[i], values[i]);
         }
     }
-        
-    boost::asio::read(socket, buffer, boost::asio::transfer_all(), error);
-    if (error)
+    client.MSet(batch);
+
+    const auto readBack = [&](const std::string& stage, const std::vector<bool>& reachable)
+        {
+            const std::vector<std::optional<std::string>> batchValues = client.MGet(keyViews);
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                if (reachable[i] && (batchValues[i] != values[i] || client.Get(keys[i]) != values[i]))
+                {
+                    throw std::runtime_error(stage + ": " + keys[i] + " doesn't read back from "
+                                             + client.ServerOf(keys[i]));
+                }
+            }
+        };
+    const std::vector<bool> all(keys.size(), true);
+    readBack("with every server", all);
+
+    std::map<std::string, size_t> keysPerServer;
+    std::vector<std::string> owners;
+    for (const std::string& key: keys)
+    {
+        owners.push_back(client.ServerOf(key));
+        ++keysPerServer[owners.back()];
+    }
+    std::cout << "Keys per server:";
+    for (const auto& [server, count]: keysPerServer)
+    {
+        std::cout << " " << server << " " << count;
+    }
+    std::cout << std::endl;
+
+    try
+    {
+        client.SetServers({"no port"});
+        throw std::runtime_error("a server list with a bad address is taken");
+    }
+    catch (const std::invalid_argument&)
+    {
+    }
+    readBack("after a bad server list", all);
+
+    if (options.servers.size() > 1)
     {
-        if (error.value() != boost::system::errc::resource_unavailable_try_again
-            && error.value() != boost::asio::error::eof)
+        // Only keys of the server dropped may move.
+        const std::string dropped = options.servers.back();
+        client.SetServers(std::vector<std::string>(options.servers.begin(), options.servers.end() - 1));
+        std::vector<bool> stayed(keys.size());
+        size_t moved = 0;
+        for (size_t i = 0; i < keys.size(); ++i)
         {
-            std::cerr << "Error reading data: " << error.message() << std::endl;
-            return;
+            stayed[i] = owners[i] != dropped;
+            if (stayed[i] && client.ServerOf(keys[i]) != owners[i])
+            {
+                throw std::runtime_error(keys[i] + " moved off " + owners[i] + ", which stays");
+            }
+            moved += stayed[i] ? 0 : 1;
         }
+        readBack("without " + dropped, stayed);
+
+        client.SetServers(options.servers);
+        readBack("with " + dropped + " back", all);
+        std::cout << moved << " keys moved while " << dropped << " was left out." << std::endl;
     }
-    } while(false);
-    
-    const char* data = boost::asio::buffer_cast<const char*>(buffer.data());
-    std::cout << data << std::endl;
+
+    std::cout << "Sharding check passed: " << keys.size() << " keys over " << options.servers.size()
+              << " servers." << std::endl;
 }
@@ -0,0 +1,160 @@
+#include "BinarySnapshot.h"
+#include "IniLoader.h"
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <iostream>
+#include <unordered_map>
+
+namespace po = boost::program_options;
+
+void PrintUsage(const po::options_description& desc)
+{
+    std::cout << "Usage: options_description [options]\n";
+    std::cout << desc;
+}
+
+// Returns the number of keys converted.
+size_t IniToSnapshot(const std::string& input, const std::string& output, bool verify)
+{
+    boost::property_tree::ptree pt;
+    boost::property_tree::ini_parser::read_ini(input, pt);
+
+    // The same pairs Storage loads from an INI config.
+    std::unordered_map<std::string, uint64_t> expirations;
+    size_t keyCount = pt.size();
+    for (const auto& item: pt)
+    {
+        if (item.first == ExpirationSection && !item.second.empty())
+        {
+            for (const auto& expiration: item.second)
+            {
+                expirations[expiration.first] = expiration.second.get_value<uint64_t>();
+            }
+            --keyCount;
+        }
+    }
+
+    SnapshotWriter writer(output);
+    for (const auto& item: pt)
+    {
+        if (item.first == ExpirationSection && !item.second.empty())
+        {
+            continue;
+        }
+        const auto expiration = expirations.find(item.first);
+        writer.Add(item.first, item.second.data(), expiration != expirations.end() ? expiration->second : 0);
+    }
+    writer.Finish();
+
+    if (verify)
+    {
+        const SnapshotReader reader(output);
+        if (reader.Size() != keyCount)
+        {
+            throw std::runtime_error("snapshot has " + std::to_string(reader.Size()) + " keys instead of "
+                                     + std::to_string(keyCount));
+        }
+        for (const auto& item: pt)
+        {
+            if (item.first == ExpirationSection && !item.second.empty())
+            {
+                continue;
+            }
+            const std::optional<std::string_view> value = reader.Find(item.first);
+            if (!value || *value != item.second.data())
+            {
+                throw std::runtime_error("snapshot has a wrong value for key '" + item.first + "'");
+            }
+        }
+    }
+
+    return keyCount;
+}
+
+size_t SnapshotToIni(const std::string& input, const std::string& output)
+{
+    const SnapshotReader reader(input);
+
+    boost::property_tree::ptree pt;
+    boost::property_tree::ptree expiring;
+    reader.ForEach([&pt, &expiring](std::string_view key, std::string_view value, uint64_t expiresAt)
+        {
+            pt.put(std::string(key), std::string(value));
+            if (expiresAt != 0)
+            {
+                expiring.push_back(std::make_pair(std::string(key),
+                                                  boost::property_tree::ptree(std::to_string(expiresAt))));
+            }
+        });
+    if (!expiring.empty())
+    {
+        pt.push_back(std::make_pair(ExpirationSection, std::move(expiring)));
+    }
+    boost::property_tree::ini_parser::write_ini(output, pt);
+
+    return reader.Size();
+}
+
+int main(int ac, char** av)
+{
+    std::string input;
+    std::string output;
+    std::string format = "binary";
+    bool verify = false;
+
+    po::options_description desc("Allowed options");
+
+    try {
+        desc.add_options()
+            ("help,h", "produce help message")
+            ("input,i", po::value<std::string>(&input)->required(), "config file to convert (required)")
+            ("output,o", po::value<std::string>(&output)->required(), "file to write (required)")
+            ("to", po::value<std::string>(&format)->default_value(format),
+             "format to convert to: 'binary' from an INI config, 'ini' from a binary snapshot")
+            ("verify", po::bool_switch(&verify), "look every key up in the written binary snapshot");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(ac, av, desc), vm);
+
+        if (vm.count("help"))
+        {
+            PrintUsage(desc);
+            return 0;
+        }
+
+        po::notify(vm);
+
+        if (format != "binary" && format != "ini")
+        {
+            throw po::invalid_option_value(format);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "Command line parameters: " << e.what() << std::endl;
+        PrintUsage(desc);
+        return 1;
+    }
+    catch (...) {
+        std::cerr << "Command line parameters: Unknown error!\n";
+        PrintUsage(desc);
+        return 1;
+    }
+
+    try
+    {
+        const size_t converted = format == "binary" ? IniToSnapshot(input, output, verify)
+                                                    : SnapshotToIni(input, output);
+        std::cout << converted << " keys are converted from " << input << " to " << output << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Conversion: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -39,14 +39,68 @@ int main(int ac, char** av)
 
     boost::asio::ip::port_type port;
     std::string configPath = DefaultConfigPath;
-    
+    StorageOptions storageOptions;
+    std::string persistence = "snapshot";
+    std::string durability = "periodic";
+    std::string snapshotFormat = "ini";
+    std::string engine = "sharded";
+    ServerOptions serverOptions;
+    std::string serverMode = "async";
+
     try {
         po::options_description desc("Allowed options");
         desc.add_options()
             ("help,h", "produce help message")
             ("port,p", po::value<boost::asio::ip::port_type>(&port)->required(), "server's port")
             ("config-file,c", po::value<std::string>(&configPath),
-             ("path to the config file, default is " + configPath).c_str());
+             ("path to the config file, default is " + configPath).c_str())
+            ("engine", po::value<std::string>(&engine),
+             "in-memory storage: 'sharded' guards shards with reader/writer locks, "
+             "'lockfree' reads without locks and suits read-mostly loads on many cores, "
+             "'compact' packs keys and values tightly to fit more of them in memory; "
+             "default is sharded")
+            ("shards,n", po::value<size_t>(&storageOptions.shardCount),
+             ("number of independently locked storage shards, default is "
+              + std::to_string(storageOptions.shardCount)).c_str())
+            ("persistence", po::value<std::string>(&persistence),
+             "how changes are saved: 'snapshot' rewrites the config file periodically, "
+             "'wal' appends every write to <config>.wal and compacts it in the background; "
+             "default is snapshot")
+            ("durability", po::value<std::string>(&durability),
+             "when changes reach the disk: 'none' leaves it to the kernel, 'periodic' syncs "
+             "what is saved every second, 'sync-on-ack' answers writes only once the log is "
+             "synced and needs '--persistence wal'; default is periodic")
+            ("snapshot-format", po::value<std::string>(&snapshotFormat),
+             "format the config file is saved in: 'ini' text or 'binary', which loads much faster; "
+             "either format is loaded, default is ini")
+            ("load-threads", po::value<size_t>(&storageOptions.loadThreads),
+             ("number of threads parsing an INI config at startup, default is "
+              + std::to_string(storageOptions.loadThreads)).c_str())
+            ("wal-compaction-size", po::value<size_t>(&storageOptions.walCompactionSize),
+             ("log size in bytes that triggers compaction into the config file, default is "
+              + std::to_string(storageOptions.walCompactionSize)).c_str())
+            ("memory-limit", po::value<size_t>(&storageOptions.memoryLimit),
+             "bytes of keys and values beyond which the least recently used keys are evicted; "
+             "default is 0, no limit")
+            ("server-mode", po::value<std::string>(&serverMode),
+             "'async' serves all connections from a pool of event loop threads, "
+             "'threads' polls the sockets from a fixed pool of threads, "
+             "'uring' has every worker complete socket operations with its own io_uring "
+             "and falls back to async where the kernel lacks it; default is async")
+            ("workers,w", po::value<size_t>(&serverOptions.workerThreads),
+             ("number of threads serving the connections, default is "
+              + std::to_string(serverOptions.workerThreads)).c_str())
+            ("max-connections", po::value<size_t>(&serverOptions.maxConnections),
+             ("connections served at once, more are answered 'ERROR too many connections' and closed; "
+              "0 means no limit, default is " + std::to_string(serverOptions.maxConnections)).c_str())
+            ("reuse-port", po::bool_switch(&serverOptions.reusePort),
+             "give every worker a listening socket of its own bound with SO_REUSEPORT, so the kernel "
+             "spreads new connections over the workers; async and uring modes only")
+            ("replica-of", po::value<std::string>(&serverOptions.replicaOf),
+             "<host>:<port> of a primary server to keep a copy of: its keys are loaded and every later "
+             "change is applied as it is made; writes to this server are then rejected")
+            ("unix-socket", po::value<std::string>(&serverOptions.unixSocket),
+             "path of a Unix domain socket to accept connections on too, for clients on the same host");
 
         po::variables_map vm;
         po::store(po::parse_command_line(ac, av, desc), vm);
@@ -58,6 +112,98 @@ int main(int ac, char** av)
         }
 
         po::notify(vm);
+
+        if (snapshotFormat == "ini")
+        {
+            storageOptions.snapshotFormat = SnapshotFormat::Ini;
+        }
+        else if (snapshotFormat == "binary")
+        {
+            storageOptions.snapshotFormat = SnapshotFormat::Binary;
+        }
+        else
+        {
+            throw po::invalid_option_value(snapshotFormat);
+        }
+
+        if (engine == "sharded")
+        {
+            storageOptions.engine = EngineType::Sharded;
+        }
+        else if (engine == "lockfree")
+        {
+            storageOptions.engine = EngineType::LockFree;
+        }
+        else if (engine == "compact")
+        {
+            storageOptions.engine = EngineType::Compact;
+        }
+        else
+        {
+            throw po::invalid_option_value(engine);
+        }
+
+        if (persistence == "snapshot")
+        {
+            storageOptions.persistence = PersistenceMode::Snapshot;
+        }
+        else if (persistence == "wal")
+        {
+            storageOptions.persistence = PersistenceMode::Wal;
+        }
+        else
+        {
+            throw po::invalid_option_value(persistence);
+        }
+
+        if (durability == "none")
+        {
+            storageOptions.durability = Durability::None;
+        }
+        else if (durability == "periodic")
+        {
+            storageOptions.durability = Durability::Periodic;
+        }
+        else if (durability == "sync-on-ack")
+        {
+            storageOptions.durability = Durability::SyncOnAck;
+        }
+        else
+        {
+            throw po::invalid_option_value(durability);
+        }
+        if (storageOptions.durability == Durability::SyncOnAck
+            && storageOptions.persistence != PersistenceMode::Wal)
+        {
+            throw po::error("'--durability sync-on-ack' needs '--persistence wal'");
+        }
+
+        if (serverMode == "async")
+        {
+            serverOptions.mode = ServerMode::Async;
+        }
+        else if (serverMode == "threads")
+        {
+            serverOptions.mode = ServerMode::Threads;
+        }
+        else if (serverMode == "uring")
+        {
+            serverOptions.mode = ServerMode::IoUring;
+        }
+        else
+        {
+            throw po::invalid_option_value(serverMode);
+        }
+        if (serverOptions.reusePort && serverOptions.mode == ServerMode::Threads)
+        {
+            throw po::error("'--reuse-port' needs the async or uring server mode");
+        }
+        const size_t colon = serverOptions.replicaOf.rfind(':');
+        if (!serverOptions.replicaOf.empty()
+            && (colon == std::string::npos || colon == 0 || colon + 1 == serverOptions.replicaOf.size()))
+        {
+            throw po::invalid_option_value(serverOptions.replicaOf);
+        }
     }
     catch (std::exception& e)
     {
@@ -85,7 +231,7 @@ int main(int ac, char** av)
     std::optional<Storage> storage;
     try
     {
-        storage.emplace(configPath);
+        storage.emplace(configPath, storageOptions);
     }
     catch (std::exception& e)
     {
@@ -98,7 +244,7 @@ int main(int ac, char** av)
         return 1;
     }
 
-    Server server(port, storage.value());
+    Server server(port, storage.value(), serverOptions);
 
     server.Start();
 